@@ -0,0 +1,165 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simpletron.h"
+#include "batch_io.h"
+
+
+#define READ_CHUNK_SIZE     (1 << 16)
+
+
+static void append_output(struct BatchIO *batch, const char string[], const size_t length) {
+    if (batch->output_size + length > batch->output_capacity) {
+        if (batch->output_file != NULL) {
+            flush_batch_io(batch);
+        }
+        if (batch->output_file == NULL || length > batch->output_capacity) {
+            /* Output is kept in memory or does not fit into empty buffer */
+            size_t capacity = batch->output_capacity;
+            while (batch->output_size + length > capacity)
+                capacity *= 2;
+            char *output = realloc(batch->output, capacity);
+            if (output == NULL)
+                return;
+            batch->output = output;
+            batch->output_capacity = capacity;
+        }
+    }
+    memcpy(batch->output + batch->output_size, string, length);
+    batch->output_size += length;
+}
+
+
+/* Values are separated by blanks, commas or newlines */
+static enum Status batch_read_value(void *context, word_t *value) {
+    struct BatchIO *batch = context;
+    while (
+        batch->input_position < batch->input_size
+        && (
+            isspace(batch->input[batch->input_position])
+            || batch->input[batch->input_position] == ','
+        )
+    )
+        batch->input_position++;
+    if (batch->input_position >= batch->input_size)
+        return FAIL;
+
+    char *end;
+    const long parsed_input = strtol(batch->input + batch->input_position, &end, 0);
+    if (end == batch->input + batch->input_position)
+        return FAIL;
+    batch->input_position = end - batch->input;
+    if (parsed_input != (dword_t) parsed_input || !check_value(parsed_input))
+        return FAIL;
+    *value = (word_t) parsed_input;
+    return SUCCESS;
+}
+
+
+static void batch_write_value(void *context, const word_t value) {
+    char string[WORD_BITS / 3 + 4];
+    append_output(context, string, sprintf(string, "%d\n", value));
+}
+
+
+/* Reads the rest of current line */
+static size_t batch_read_string(void *context, char string[], const size_t size) {
+    struct BatchIO *batch = context;
+    size_t length = 0;
+    while (batch->input_position < batch->input_size) {
+        const char c = batch->input[batch->input_position++];
+        if (c == '\n')
+            break;
+        if (length < size)
+            string[length++] = c;
+    }
+    return length;
+}
+
+
+static void batch_write_string(void *context, const char string[]) {
+    append_output(context, string, strlen(string));
+    append_output(context, "\n", 1);
+}
+
+
+/* Only faults are reported, to stderr */
+static void batch_report(void *context, const enum Status status, const char message[]) {
+    (void) context;
+    if (status == FAIL)
+        fputs(message, stderr);
+}
+
+
+const struct SimpletronIO batch_io = {
+    .read_value=batch_read_value,
+    .write_value=batch_write_value,
+    .read_string=batch_read_string,
+    .write_string=batch_write_string,
+    .report=batch_report,
+    .context=NULL
+};
+
+
+/* Uses input from memory, output is written to output_file */
+bool init_batch_io(
+    struct BatchIO *batch, const char input[], const size_t input_size, FILE *output_file
+) {
+    batch->input = input;
+    batch->input_size = input_size;
+    batch->input_position = 0;
+    batch->output_file = output_file;
+    batch->output = malloc(BATCH_OUTPUT_SIZE);
+    batch->output_size = 0;
+    batch->output_capacity = BATCH_OUTPUT_SIZE;
+    return batch->output != NULL;
+}
+
+
+/* Reads whole input, output is written to output_file */
+bool open_batch_io(struct BatchIO *batch, FILE *input_file, FILE *output_file) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t input_size = 0;
+    size_t result;
+
+    char *input = malloc(capacity);
+    if (input == NULL)
+        return false;
+    while ((result = fread(input + input_size, 1, capacity - input_size, input_file)) > 0) {
+        input_size += result;
+        if (input_size == capacity) {
+            capacity *= 2;
+            char *resized = realloc(input, capacity);
+            if (resized == NULL) {
+                free(input);
+                return false;
+            }
+            input = resized;
+        }
+    }
+    if (ferror(input_file) || !init_batch_io(batch, input, input_size, output_file)) {
+        free(input);
+        return false;
+    }
+    return true;
+}
+
+
+void flush_batch_io(struct BatchIO *batch) {
+    if (batch->output_file == NULL)
+        return;
+    fwrite(batch->output, 1, batch->output_size, batch->output_file);
+    batch->output_size = 0;
+}
+
+
+/* Frees input read by open_batch_io */
+void close_batch_io(struct BatchIO *batch) {
+    flush_batch_io(batch);
+    if (batch->output_file != NULL)
+        fflush(batch->output_file);
+    free((char *) batch->input);
+    free(batch->output);
+    batch->input = NULL;
+    batch->output = NULL;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "simpletron.h"
+
+
+#define BATCH_OUTPUT_SIZE   (1 << 16)  /* output is flushed when buffer is full */
+
+/* Non-interactive channel: input is read in bulk, output is buffered, no prompts */
+struct BatchIO {
+    const char  *input;                         /* whole input */
+    size_t      input_size;
+    size_t      input_position;
+    FILE        *output_file;                   /* NULL to keep output in buffer */
+    char        *output;
+    size_t      output_size;
+    size_t      output_capacity;
+};
+
+extern const struct SimpletronIO batch_io;
+
+bool init_batch_io(struct BatchIO *, const char [], const size_t, FILE *);
+bool open_batch_io(struct BatchIO *, FILE *, FILE *);
+void flush_batch_io(struct BatchIO *);
+void close_batch_io(struct BatchIO *);
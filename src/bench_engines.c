@@ -0,0 +1,115 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "simpletron.h"
+#include "engine.h"
+
+
+#define BENCH_RUNS          5
+#define INNER_LOOPS         10000
+#define OUTER_LOOPS         100
+
+/* Data addresses */
+#define ONE                 (MEMORY_SIZE - 1)
+#define INNER               (MEMORY_SIZE - 2)
+#define INNER_START         (MEMORY_SIZE - 3)
+#define OUTER               (MEMORY_SIZE - 4)
+#define SUM                 (MEMORY_SIZE - 5)
+
+
+/* Nested counting loop without I/O */
+void load_benchmark(struct Simpletron *simpletron) {
+    const word_t instructions[] = {
+        LOAD, SUBTRACT, STORE, LOAD, ADD, STORE, LOAD, BRANCHZERO, BRANCH,
+        LOAD, STORE, LOAD, SUBTRACT, STORE, BRANCHZERO, BRANCH, HALT
+    };
+    const word_t operands[] = {
+        ONE, INNER, INNER, SUM, INNER, SUM, INNER, 0x9, 0x0,
+        INNER_START, INNER, ONE, OUTER, OUTER, 0x10, 0x0, 0x0
+    };
+
+    reset(simpletron);
+    for (size_t i = 0; i < sizeof(instructions) / sizeof(word_t); i++)
+        simpletron->memory[i] = (word_t) (instructions[i] << OPERAND_BITS | operands[i]);
+    simpletron->memory[ONE] = 1;
+    simpletron->memory[INNER] = INNER_LOOPS;
+    simpletron->memory[INNER_START] = INNER_LOOPS;
+    simpletron->memory[OUTER] = OUTER_LOOPS;
+}
+
+
+double elapsed(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+/* Engines print termination message, keep it out of results */
+int silence_stdout(void) {
+    fflush(stdout);
+    const int saved = dup(STDOUT_FILENO);
+    const int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    return saved;
+}
+
+
+void restore_stdout(const int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+
+int main(void) {
+    struct Simpletron *program = malloc(sizeof(struct Simpletron));
+    struct Simpletron *simpletron = malloc(sizeof(struct Simpletron));
+    struct timespec start, end;
+    size_t instructions = 0;
+    enum Status status;
+
+    load_benchmark(program);
+
+    /* Count executed instructions once */
+    *simpletron = *program;
+    int saved = silence_stdout();
+    do {
+        status = execute_operation(simpletron);
+        instructions++;
+    } while (status == SUCCESS);
+    restore_stdout(saved);
+    const word_t expected_sum = simpletron->memory[SUM];
+
+    printf("Instructions per run: %lu, best of %d runs\n\n", instructions, BENCH_RUNS);
+    printf("%-12s%16s%16s%12s\n", "engine", "instructions/s", "ns/instruction", "speedup");
+    double baseline = 0;
+    for (const struct Engine *engine = engines; engine->name != NULL; engine++) {
+        double best = 0;
+        for (int run = 0; run < BENCH_RUNS; run++) {
+            *simpletron = *program;
+            saved = silence_stdout();
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            status = engine->run(simpletron);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            restore_stdout(saved);
+            if (status != STOP || simpletron->memory[SUM] != expected_sum) {
+                printf("Engine '%s' produced wrong result\n", engine->name);
+                return 1;
+            }
+            if (run == 0 || elapsed(&start, &end) < best)
+                best = elapsed(&start, &end);
+        }
+        if (baseline == 0)
+            baseline = best;
+        printf(
+            "%-12s%16.0f%16.2f%11.2fx\n",
+            engine->name, instructions / best, best * 1e9 / instructions, baseline / best
+        );
+    }
+    free(program);
+    free(simpletron);
+    return 0;
+}
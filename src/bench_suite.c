@@ -0,0 +1,877 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "simpletron.h"
+#include "engine.h"
+#include "batch_io.h"
+#include "translator.h"
+
+
+#define BASELINE_OPTION     "--baseline="
+#define JSON_OPTION         "--json="
+#define TOLERANCE_OPTION    "--tolerance="
+#define COUNTS_OPTION       "--counts="
+#define COUNTS_JSON_OPTION  "--counts-json="
+#define COUNT_ONLY_OPTION   "--count-only"
+#define DEFAULT_TOLERANCE   25    /* % of baseline ns/instruction a result may be slower by */
+
+#define WARMUP_RUNS         3
+#define SAMPLES             7     /* median sample is reported */
+#define RETRIES             2     /* measurements of workload repeated while it seems slower */
+#define SAMPLE_TIME         0.02  /* seconds, runs of sample are repeated to last that long */
+#define TRANSLATE_RUNS      20
+#define NAME_LENGTH         64
+#define CALIBRATION_STEPS   (1 << 20)
+#define CHAIN_LENGTH        7     /* statements in body of generated chain loop, fits in memory */
+
+/* Program with fixed input */
+struct Workload {
+    char                        name[NAME_LENGTH];
+    char                        *source;        /* BASIC source */
+    size_t                      source_size;
+    char                        *input;         /* values for READ */
+    size_t                      input_size;
+};
+
+/* Range of words restored before every run */
+struct Span {
+    size_t                      from;
+    size_t                      to;
+};
+
+/* Workload translated and loaded, ready to run */
+struct Bench {
+    struct Simpletron           *program;       /* loaded program, never run */
+    struct Simpletron           *simpletron;    /* machine runs are done on */
+    struct Span                 spans[MEMORY_SIZE];
+    size_t                      spans_size;
+    struct BatchIO              io;
+    struct SimpletronIO         channel;
+    char                        *expected;      /* output of the counted run */
+    size_t                      expected_size;
+    unsigned long               instructions;
+    double                      translate_time;
+    double                      load_time;
+};
+
+struct Result {
+    char                        program[NAME_LENGTH];
+    char                        engine[NAME_LENGTH];
+    double                      ns_per_instruction;
+    double                      calibration_ns;
+};
+
+/* Instructions executed by program, the same on every machine */
+struct Count {
+    char                        program[NAME_LENGTH];
+    unsigned long               instructions;
+};
+
+/* Time of one sample and of calibration loop timed in the same round */
+struct Sample {
+    double                      ns_per_instruction;
+    double                      calibration_ns;
+};
+
+
+void show_help(char executableName[]) {
+    puts("Usage:");
+    printf("\t%s [OPTIONS] [FILENAME.bas...]\n", executableName);
+    puts("Translates every program and generated workloads, runs each under every engine.");
+    puts("Input of FILENAME.bas is read from FILENAME.in if it exists.");
+    puts("Results are printed as JSON, one result per line.");
+    puts("Options:");
+    printf(
+        "\t%sFILE\tfail if result is slower than the same result in FILE, also when measured "
+        "again\n", BASELINE_OPTION
+    );
+    printf(
+        "\t%sN\t%% of baseline ns/instruction result may be slower by (default: %d)\n",
+        TOLERANCE_OPTION, DEFAULT_TOLERANCE
+    );
+    printf("\t%sFILE\twrite results to FILE too\n", JSON_OPTION);
+    printf(
+        "\t%sFILE\tfail if program executes other number of instructions than in FILE\n",
+        COUNTS_OPTION
+    );
+    printf("\t%sFILE\twrite instruction counts to FILE\n", COUNTS_JSON_OPTION);
+    printf("\t%s\tonly translate and count instructions, nothing is timed\n", COUNT_ONLY_OPTION);
+}
+
+
+double elapsed(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+/* Best ns per step of fixed native loop. It is timed next to every round of samples and
+ * results are compared with baseline relative to it, so speed of machine at the moment
+ * of measurement cancels out */
+double calibrate(void) {
+    volatile uint32_t sink;
+    double best = 0;
+    for (int sample = 0; sample < SAMPLES; sample++) {
+        uint32_t value = sample;
+        const double start = now();
+        for (size_t step = 0; step < CALIBRATION_STEPS; step++)
+            value = value * 1664525u + 1013904223u;
+        sink = value;
+        const double time = now() - start;
+        if (sample == 0 || time < best)
+            best = time;
+    }
+    (void) sink;
+    return best * 1e9 / CALIBRATION_STEPS;
+}
+
+
+/* Nested counting loops */
+void generate_loops(FILE *file) {
+    fputs(
+        "10 input n\n"
+        "20 for i = 1 to n\n"
+        "30 for j = 1 to 100\n"
+        "40 let s = (s + j) % 1000\n"
+        "50 next\n"
+        "60 next\n"
+        "70 print s\n"
+        "99 end\n",
+        file
+    );
+}
+
+
+/* Collatz sequences of starts from 1 to n, branch heavy */
+void generate_collatz(FILE *file) {
+    fputs(
+        "10 input n\n"
+        "20 for k = 1 to n\n"
+        "30 let x = k\n"
+        "40 if x == 1 goto 90\n"
+        "50 let r = x % 2\n"
+        "60 if r == 0 goto 80\n"
+        "70 let x = 3 * x + 1\n"
+        "75 goto 40\n"
+        "80 let x = x / 2\n"
+        "85 goto 40\n"
+        "90 let c = c + 1\n"
+        "95 next\n"
+        "97 print c\n"
+        "99 end\n",
+        file
+    );
+}
+
+
+/* Loop over CHAIN_LENGTH dependent arithmetic statements, expression heavy */
+void generate_chain(FILE *file) {
+    fputs("10 input n\n20 for i = 1 to n\n", file);
+    for (int k = 0; k < CHAIN_LENGTH; k++) {
+        fprintf(
+            file, "%d let v%d = (v%d * %d + v%d + i) %% %d\n", 30 + k, k,
+            (k + CHAIN_LENGTH - 1) % CHAIN_LENGTH, k + 2, (k + 3) % CHAIN_LENGTH, 997 - 10 * k
+        );
+    }
+    fprintf(file, "%d next\n%d print v0\n99 end\n", 30 + CHAIN_LENGTH, 31 + CHAIN_LENGTH);
+}
+
+
+struct Generator {
+    const char                  *name;
+    void                        (*generate)(FILE *);
+    const char                  *input;
+};
+
+static const struct Generator generators[] = {
+    {.name="generated_loops", .generate=generate_loops, .input="300"},
+    {.name="generated_collatz", .generate=generate_collatz, .input="300"},
+    {.name="generated_chain", .generate=generate_chain, .input="2000"},
+    {.name=NULL, .generate=NULL, .input=NULL}
+};
+
+
+/* Reads whole file, returns NULL if it can not be read */
+char *read_whole_file(const char filename[], size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return NULL;
+    size_t capacity = 4096, result;
+    char *data = malloc(capacity);
+    *size = 0;
+    while (data != NULL && (result = fread(data + *size, 1, capacity - *size, file)) > 0) {
+        *size += result;
+        if (*size == capacity) {
+            char *resized = realloc(data, capacity *= 2);
+            if (resized == NULL)
+                free(data);
+            data = resized;
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+
+/* Workload of FILENAME.bas with input from FILENAME.in, no input if it does not exist */
+bool read_workload(struct Workload *workload, const char filename[]) {
+    const char *base = strrchr(filename, '/');
+    base = base == NULL ? filename : base + 1;
+    size_t length = strlen(base);
+    if (length > 4 && strcmp(base + length - 4, ".bas") == 0)
+        length -= 4;
+    snprintf(workload->name, NAME_LENGTH, "%.*s", (int) length, base);
+
+    workload->source = read_whole_file(filename, &workload->source_size);
+    if (workload->source == NULL) {
+        printf("Error reading file '%s'\n", filename);
+        return false;
+    }
+    char input_filename[FILENAME_MAX];
+    const size_t stem = strlen(filename) - (strlen(base) - length);
+    snprintf(input_filename, FILENAME_MAX, "%.*s.in", (int) stem, filename);
+    workload->input = read_whole_file(input_filename, &workload->input_size);
+    if (workload->input == NULL)
+        workload->input_size = 0;
+    return true;
+}
+
+
+bool generate_workload(struct Workload *workload, const struct Generator *generator) {
+    snprintf(workload->name, NAME_LENGTH, "%s", generator->name);
+    FILE *file = open_memstream(&workload->source, &workload->source_size);
+    if (file == NULL)
+        return false;
+    generator->generate(file);
+    fclose(file);
+    workload->input_size = strlen(generator->input);
+    workload->input = malloc(workload->input_size);
+    if (workload->input == NULL)
+        return false;
+    memcpy(workload->input, generator->input, workload->input_size);
+    return true;
+}
+
+
+static void silent_report(void *context, const enum Status status, const char message[]) {
+    (void) context;
+    (void) status;
+    (void) message;
+}
+
+
+/* Translates workload TRANSLATE_RUNS times, then loads its text form the same number of
+ * times, keeping the best times of both */
+bool translate_workload(struct Bench *bench, const struct Workload *workload) {
+    struct Program program;
+    char *text = NULL;
+    size_t text_size = 0;
+
+    init_program(&program);
+    bench->translate_time = 0;
+    for (int run = 0; run < TRANSLATE_RUNS; run++) {
+        FILE *source = fmemopen(workload->source, workload->source_size, "r");
+        if (source == NULL) {
+            free_program(&program);
+            return false;
+        }
+        free_program(&program);
+        const double start = now();
+        const bool translated = translate(&program, source);
+        const double time = now() - start;
+        fclose(source);
+        if (!translated) {
+            printf("Error translating '%s'\n", workload->name);
+            free_program(&program);
+            return false;
+        }
+        if (run == 0 || time < bench->translate_time)
+            bench->translate_time = time;
+    }
+
+    FILE *file = open_memstream(&text, &text_size);
+    if (file == NULL) {
+        free_program(&program);
+        return false;
+    }
+    for (size_t address = 0; address < MEMORY_SIZE; address++)
+        fprintf(file, "%*X\n", WORD_BITS / 4, (uword_t) program_word(&program, address));
+    fclose(file);
+    free_program(&program);
+
+    bench->load_time = 0;
+    for (int run = 0; run < TRANSLATE_RUNS; run++) {
+        const double start = now();
+        const enum Load status = load_sml(bench->program, text, text_size, NULL);
+        const double time = now() - start;
+        if (status != LOAD_SUCCESS) {
+            printf("Error loading '%s'\n", workload->name);
+            free(text);
+            return false;
+        }
+        if (run == 0 || time < bench->load_time)
+            bench->load_time = time;
+    }
+    free(text);
+    bench->program->io = &bench->channel;
+    return true;
+}
+
+
+/* Runs program once with execute_operation counting instructions and keeping output.
+ * Words of program and words written by it are all a run can change, so only they
+ * are restored before next runs */
+bool count_instructions(struct Bench *bench, const char name[]) {
+    bool *dirty = calloc(MEMORY_SIZE, sizeof(bool));
+    struct Simpletron *simpletron = bench->simpletron;
+    enum Status status;
+    if (dirty == NULL)
+        return false;
+
+    *simpletron = *bench->program;
+    bench->io.input_position = 0;
+    bench->io.output_size = 0;
+    bench->instructions = 0;
+    do {
+        bench->instructions++;
+        status = execute_operation(simpletron);
+        size_t last = simpletron->operand;
+        switch (simpletron->operation_code) {
+            case READSTR:
+                last += STRING_LENGTH / CHARS_WORD + 1;
+                /* fall through */
+            case READ:
+            case STORE:
+                for (size_t address = simpletron->operand; address <= last; address++)
+                    dirty[address % MEMORY_SIZE] = true;
+                break;
+            default:
+                break;
+        }
+    } while (status == SUCCESS);
+    if (status != STOP) {
+        printf("Program '%s' terminated abnormally\n", name);
+        free(dirty);
+        return false;
+    }
+
+    bench->expected = malloc(bench->io.output_size + 1);
+    if (bench->expected == NULL) {
+        free(dirty);
+        return false;
+    }
+    memcpy(bench->expected, bench->io.output, bench->io.output_size);
+    bench->expected_size = bench->io.output_size;
+
+    bench->spans_size = 0;
+    for (size_t address = 0; address < MEMORY_SIZE; address++) {
+        if (!dirty[address] && bench->program->memory[address] == 0)
+            continue;
+        if (bench->spans_size > 0 && bench->spans[bench->spans_size - 1].to == address)
+            bench->spans[bench->spans_size - 1].to++;
+        else
+            bench->spans[bench->spans_size++] = (struct Span) {.from=address, .to=address + 1};
+    }
+    free(dirty);
+    return true;
+}
+
+
+static inline void restore(struct Bench *bench) {
+    struct Simpletron *simpletron = bench->simpletron;
+    const struct Simpletron *program = bench->program;
+    for (size_t idx = 0; idx < bench->spans_size; idx++) {
+        memcpy(
+            simpletron->memory + bench->spans[idx].from, program->memory + bench->spans[idx].from,
+            (bench->spans[idx].to - bench->spans[idx].from) * sizeof(word_t)
+        );
+    }
+    simpletron->instruction_counter = program->instruction_counter;
+    simpletron->instruction_register = program->instruction_register;
+    simpletron->operation_code = program->operation_code;
+    simpletron->operand = program->operand;
+    simpletron->accumulator = program->accumulator;
+    simpletron->io = program->io;
+    simpletron->fault = program->fault;
+    bench->io.input_position = 0;
+    bench->io.output_size = 0;
+}
+
+
+/* Runs program repeats times, returns false if any run differs from the counted one */
+bool run_repeated(struct Bench *bench, const struct Engine *engine, const size_t repeats) {
+    for (size_t run = 0; run < repeats; run++) {
+        restore(bench);
+        if (
+            engine->run(bench->simpletron) != STOP || bench->io.output_size != bench->expected_size
+            || memcmp(bench->io.output, bench->expected, bench->expected_size) != 0
+        )
+            return false;
+    }
+    return true;
+}
+
+
+size_t count_engines(void) {
+    size_t size = 0;
+    while (engines[size].name != NULL)
+        size++;
+    return size;
+}
+
+
+/* Returns seconds of one run in sample of repeats runs, negative if engine produced
+ * wrong result */
+double sample(struct Bench *bench, const struct Engine *engine, const size_t repeats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!run_repeated(bench, engine, repeats))
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed(&start, &end) / repeats;
+}
+
+
+static int compare_samples(const void *first, const void *second) {
+    const struct Sample *a = first, *b = second;
+    const double ratio_a = a->ns_per_instruction / a->calibration_ns;
+    const double ratio_b = b->ns_per_instruction / b->calibration_ns;
+    return (ratio_a > ratio_b) - (ratio_a < ratio_b);
+}
+
+
+/*
+ * Measures every engine on program. Samples of engines are interleaved and every round
+ * of them is timed with its own calibration, so changes of machine speed during the
+ * measurement hit all engines alike. The median sample relative to calibration is kept,
+ * so a single lucky or disturbed round does not decide the result.
+ */
+bool measure(struct Bench *bench, struct Result results[], const char name[]) {
+    const size_t num_engines = count_engines();
+    size_t *repeats = malloc(num_engines * sizeof(size_t));
+    struct Sample *samples = malloc(num_engines * SAMPLES * sizeof(struct Sample));
+    if (repeats == NULL || samples == NULL) {
+        free(repeats);
+        free(samples);
+        return false;
+    }
+
+    for (size_t idx = 0; engines[idx].name != NULL; idx++) {
+        const struct Engine *engine = &engines[idx];
+        results[idx] = (struct Result) {.ns_per_instruction=0, .calibration_ns=0};
+        snprintf(results[idx].program, NAME_LENGTH, "%s", name);
+        snprintf(results[idx].engine, NAME_LENGTH, "%s", engine->name);
+
+        /* Runs per sample make it last SAMPLE_TIME, so timer resolution does not matter */
+        *bench->simpletron = *bench->program;
+        bool correct = run_repeated(bench, engine, WARMUP_RUNS);
+        for (repeats[idx] = 1; correct; repeats[idx] *= 2) {
+            const double time = sample(bench, engine, repeats[idx]);
+            correct = time >= 0;
+            if (time * repeats[idx] >= SAMPLE_TIME)
+                break;
+        }
+        if (!correct) {
+            printf("\nEngine '%s' produced wrong result on '%s'\n", engine->name, name);
+            free(repeats);
+            free(samples);
+            return false;
+        }
+    }
+
+    for (int round = 0; round < SAMPLES; round++) {
+        const double calibration = calibrate();
+        for (size_t idx = 0; engines[idx].name != NULL; idx++) {
+            const double ns = sample(bench, &engines[idx], repeats[idx]) * 1e9
+                / bench->instructions;
+            if (ns < 0) {
+                printf("\nEngine '%s' produced wrong result on '%s'\n", engines[idx].name, name);
+                free(repeats);
+                free(samples);
+                return false;
+            }
+            samples[idx * SAMPLES + round] = (struct Sample) {
+                .ns_per_instruction=ns, .calibration_ns=calibration
+            };
+        }
+    }
+    for (size_t idx = 0; idx < num_engines; idx++) {
+        qsort(&samples[idx * SAMPLES], SAMPLES, sizeof(struct Sample), compare_samples);
+        results[idx].ns_per_instruction = samples[idx * SAMPLES + SAMPLES / 2].ns_per_instruction;
+        results[idx].calibration_ns = samples[idx * SAMPLES + SAMPLES / 2].calibration_ns;
+    }
+    free(repeats);
+    free(samples);
+    return true;
+}
+
+
+/* Reads results written by write_result, one per line */
+struct Result *read_baseline(const char filename[], size_t *results_size) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+        return NULL;
+    size_t capacity = 64;
+    struct Result *results = malloc(capacity * sizeof(struct Result));
+    char line[BUFFER_SIZE * 2];
+    *results_size = 0;
+    while (results != NULL && fgets(line, sizeof(line), file) != NULL) {
+        struct Result result;
+        const char *field = strstr(line, "\"ns_per_instruction\": ");
+        const char *calibration = strstr(line, "\"calibration_ns\": ");
+        if (
+            sscanf(line, " {\"program\": \"%63[^\"]\", \"engine\": \"%63[^\"]\"",
+                result.program, result.engine) != 2
+            || field == NULL
+            || sscanf(field, "\"ns_per_instruction\": %lf", &result.ns_per_instruction) != 1
+            || calibration == NULL
+            || sscanf(calibration, "\"calibration_ns\": %lf", &result.calibration_ns) != 1
+            || result.calibration_ns <= 0
+        )
+            continue;
+        if (*results_size == capacity) {
+            struct Result *resized = realloc(results, (capacity *= 2) * sizeof(struct Result));
+            if (resized == NULL)
+                free(results);
+            results = resized;
+            if (results == NULL)
+                break;
+        }
+        results[(*results_size)++] = result;
+    }
+    fclose(file);
+    return results;
+}
+
+
+/* Reads instruction counts written by write_count, one per line */
+struct Count *read_counts(const char filename[], size_t *counts_size) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+        return NULL;
+    size_t capacity = 64;
+    struct Count *counts = malloc(capacity * sizeof(struct Count));
+    char line[BUFFER_SIZE];
+    *counts_size = 0;
+    while (counts != NULL && fgets(line, sizeof(line), file) != NULL) {
+        struct Count count;
+        if (
+            sscanf(line, " {\"program\": \"%63[^\"]\", \"instructions\": %lu",
+                count.program, &count.instructions) != 2
+        )
+            continue;
+        if (*counts_size == capacity) {
+            struct Count *resized = realloc(counts, (capacity *= 2) * sizeof(struct Count));
+            if (resized == NULL)
+                free(counts);
+            counts = resized;
+            if (counts == NULL)
+                break;
+        }
+        counts[(*counts_size)++] = count;
+    }
+    fclose(file);
+    return counts;
+}
+
+
+const struct Count *find_count(
+    const struct Count counts[], const size_t counts_size, const char program[]
+) {
+    for (size_t idx = 0; idx < counts_size; idx++) {
+        if (strcmp(counts[idx].program, program) == 0)
+            return &counts[idx];
+    }
+    return NULL;
+}
+
+
+const struct Result *find_result(
+    const struct Result results[], const size_t results_size, const char program[],
+    const char engine[]
+) {
+    for (size_t idx = 0; idx < results_size; idx++) {
+        if (strcmp(results[idx].program, program) == 0 && strcmp(results[idx].engine, engine) == 0)
+            return &results[idx];
+    }
+    return NULL;
+}
+
+
+/* Result relative to calibration loop timed at the same moment, in ns/instruction of
+ * expected calibration */
+double relative_ns(const struct Result *measured, const struct Result *expected) {
+    return measured->ns_per_instruction / measured->calibration_ns * expected->calibration_ns;
+}
+
+
+/* Counts results slower than their baseline by more than tolerance % */
+size_t count_regressions(
+    const struct Result measured[], const struct Result baseline[], const size_t baseline_size,
+    const double tolerance
+) {
+    size_t regressions = 0;
+    for (size_t engine = 0; engines[engine].name != NULL; engine++) {
+        const struct Result *expected = find_result(
+            baseline, baseline_size, measured[engine].program, measured[engine].engine
+        );
+        if (
+            expected != NULL && relative_ns(&measured[engine], expected)
+            > expected->ns_per_instruction * (1 + tolerance / 100)
+        )
+            regressions++;
+    }
+    return regressions;
+}
+
+
+void write_result(
+    FILE *file, const char separator[], const struct Result *result, const struct Bench *bench
+) {
+    fprintf(
+        file, "%s\n    {\"program\": \"%s\", \"engine\": \"%s\", \"instructions\": %lu, "
+        "\"instructions_per_second\": %.0f, \"ns_per_instruction\": %.3f, "
+        "\"calibration_ns\": %.3f, \"load_ns\": %.0f, \"translate_ns\": %.0f}",
+        separator, result->program, result->engine, bench->instructions,
+        1e9 / result->ns_per_instruction, result->ns_per_instruction, result->calibration_ns,
+        bench->load_time * 1e9, bench->translate_time * 1e9
+    );
+}
+
+
+void write_count(
+    FILE *file, const char separator[], const char program[], const struct Bench *bench
+) {
+    fprintf(
+        file, "%s\n    {\"program\": \"%s\", \"instructions\": %lu}", separator, program,
+        bench->instructions
+    );
+}
+
+
+void free_workload(struct Workload *workload) {
+    free(workload->source);
+    free(workload->input);
+}
+
+
+int main(const int argc, char *argv[]) {
+    const char *baseline_filename = NULL;
+    const char *json_filename = NULL;
+    const char *counts_filename = NULL;
+    const char *counts_json_filename = NULL;
+    bool count_only = false;
+    double tolerance = DEFAULT_TOLERANCE;
+    struct Result *baseline = NULL;
+    struct Count *counts = NULL;
+    size_t baseline_size = 0, regressions = 0, counts_size = 0, changed_counts = 0;
+    struct Workload *workloads = malloc((argc + 3) * sizeof(struct Workload));
+    size_t workloads_size = 0;
+
+    if (workloads == NULL) {
+        puts("Error allocating memory");
+        return 1;
+    }
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-h") == 0 || strcmp(argv[arg], "--help") == 0) {
+            show_help(argv[0]);
+            free(workloads);
+            return 0;
+        } else if (strncmp(argv[arg], BASELINE_OPTION, strlen(BASELINE_OPTION)) == 0) {
+            baseline_filename = argv[arg] + strlen(BASELINE_OPTION);
+        } else if (strncmp(argv[arg], JSON_OPTION, strlen(JSON_OPTION)) == 0) {
+            json_filename = argv[arg] + strlen(JSON_OPTION);
+        } else if (strncmp(argv[arg], TOLERANCE_OPTION, strlen(TOLERANCE_OPTION)) == 0) {
+            tolerance = strtod(argv[arg] + strlen(TOLERANCE_OPTION), NULL);
+        } else if (strncmp(argv[arg], COUNTS_OPTION, strlen(COUNTS_OPTION)) == 0) {
+            counts_filename = argv[arg] + strlen(COUNTS_OPTION);
+        } else if (strncmp(argv[arg], COUNTS_JSON_OPTION, strlen(COUNTS_JSON_OPTION)) == 0) {
+            counts_json_filename = argv[arg] + strlen(COUNTS_JSON_OPTION);
+        } else if (strcmp(argv[arg], COUNT_ONLY_OPTION) == 0) {
+            count_only = true;
+        } else if (read_workload(&workloads[workloads_size], argv[arg])) {
+            workloads_size++;
+        } else {
+            return 1;
+        }
+    }
+    for (const struct Generator *generator = generators; generator->name != NULL; generator++) {
+        if (!generate_workload(&workloads[workloads_size++], generator)) {
+            puts("Error generating workload");
+            return 1;
+        }
+    }
+    if (baseline_filename != NULL) {
+        baseline = read_baseline(baseline_filename, &baseline_size);
+        if (baseline == NULL) {
+            printf("Error reading baseline file '%s'\n", baseline_filename);
+            return 1;
+        }
+    }
+    if (counts_filename != NULL) {
+        counts = read_counts(counts_filename, &counts_size);
+        if (counts == NULL) {
+            printf("Error reading counts file '%s'\n", counts_filename);
+            return 1;
+        }
+    }
+
+    struct Result *results = malloc(count_engines() * sizeof(struct Result));
+    struct Result *retried = malloc(count_engines() * sizeof(struct Result));
+    struct Bench bench = {
+        .program=malloc(sizeof(struct Simpletron)),
+        .simpletron=malloc(sizeof(struct Simpletron))
+    };
+    if (results == NULL || retried == NULL || bench.program == NULL || bench.simpletron == NULL
+            || !init_batch_io(&bench.io, NULL, 0, NULL)) {
+        puts("Error allocating memory");
+        return 1;
+    }
+    bench.channel = batch_io;
+    bench.channel.report = silent_report;
+    bench.channel.context = &bench.io;
+
+    /* Results go to stdout and optionally to file, regressions to stderr */
+    FILE *json_file = NULL;
+    if (json_filename != NULL && (json_file = fopen(json_filename, "w")) == NULL) {
+        printf("Error opening output file '%s'\n", json_filename);
+        return 1;
+    }
+    FILE *counts_file = NULL;
+    if (
+        counts_json_filename != NULL
+        && (counts_file = fopen(counts_json_filename, "w")) == NULL
+    ) {
+        printf("Error opening output file '%s'\n", counts_json_filename);
+        return 1;
+    }
+    const char *separator = "", *counts_separator = "";
+    printf("{\n  \"word_bits\": %d,\n  \"results\": [", WORD_BITS);
+    if (json_file != NULL)
+        fprintf(json_file, "{\n  \"word_bits\": %d,\n  \"results\": [", WORD_BITS);
+    if (counts_file != NULL)
+        fprintf(counts_file, "{\n  \"word_bits\": %d,\n  \"counts\": [", WORD_BITS);
+
+    /* Machine gets to full speed before the first workload */
+    for (int run = 0; !count_only && run < WARMUP_RUNS * SAMPLES; run++)
+        calibrate();
+
+    int result = 0;
+    for (size_t idx = 0; result == 0 && idx < workloads_size; idx++) {
+        const struct Workload *workload = &workloads[idx];
+        bench.io.input = workload->input;
+        bench.io.input_size = workload->input_size;
+        if (!translate_workload(&bench, workload) || !count_instructions(&bench, workload->name)) {
+            result = 1;
+            break;
+        }
+
+        /* Counts depend only on translator and program, any change is reported */
+        if (counts_file != NULL)
+            write_count(counts_file, counts_separator, workload->name, &bench);
+        counts_separator = ",";
+        const struct Count *expected_count = find_count(counts, counts_size, workload->name);
+        if (expected_count != NULL && expected_count->instructions != bench.instructions) {
+            fprintf(
+                stderr, "Instruction count of '%s' changed: %lu, baseline %lu\n",
+                workload->name, bench.instructions, expected_count->instructions
+            );
+            changed_counts++;
+        }
+        if (count_only) {
+            free(bench.expected);
+            continue;
+        }
+
+        if (!measure(&bench, results, workload->name)) {
+            result = 1;
+            free(bench.expected);
+            break;
+        }
+
+        /* Disturbance of machine may slow down a whole measurement, so workload which
+         * seems slower is measured again and the better result of every engine is kept */
+        for (
+            int retry = 0;
+            retry < RETRIES && count_regressions(results, baseline, baseline_size, tolerance) > 0;
+            retry++
+        ) {
+            if (!measure(&bench, retried, workload->name)) {
+                result = 1;
+                break;
+            }
+            for (size_t engine = 0; engines[engine].name != NULL; engine++) {
+                if (
+                    retried[engine].ns_per_instruction / retried[engine].calibration_ns
+                    < results[engine].ns_per_instruction / results[engine].calibration_ns
+                )
+                    results[engine] = retried[engine];
+            }
+        }
+        if (result != 0) {
+            free(bench.expected);
+            break;
+        }
+        for (size_t engine = 0; engines[engine].name != NULL; engine++) {
+            const struct Result *measured = &results[engine];
+            write_result(stdout, separator, measured, &bench);
+            if (json_file != NULL)
+                write_result(json_file, separator, measured, &bench);
+            separator = ",";
+
+            const struct Result *expected = find_result(
+                baseline, baseline_size, measured->program, measured->engine
+            );
+            if (expected == NULL)
+                continue;
+            const double ns = relative_ns(measured, expected);
+            if (ns > expected->ns_per_instruction * (1 + tolerance / 100)) {
+                fprintf(
+                    stderr, "Regression: '%s' on engine '%s' %.3f ns/instruction, "
+                    "baseline %.3f\n", measured->program, measured->engine, ns,
+                    expected->ns_per_instruction
+                );
+                regressions++;
+            }
+        }
+        fflush(stdout);
+        free(bench.expected);
+    }
+    puts("\n  ]\n}");
+    if (json_file != NULL) {
+        fputs("\n  ]\n}\n", json_file);
+        fclose(json_file);
+    }
+    if (counts_file != NULL) {
+        fputs("\n  ]\n}\n", counts_file);
+        fclose(counts_file);
+    }
+    if (changed_counts > 0) {
+        fprintf(stderr, "%lu instruction counts differ from baseline\n", changed_counts);
+        result = 1;
+    }
+    if (regressions > 0) {
+        fprintf(stderr, "%lu results regressed by more than %.0f%%\n", regressions, tolerance);
+        result = 1;
+    }
+
+    for (size_t idx = 0; idx < workloads_size; idx++)
+        free_workload(&workloads[idx]);
+    free(workloads);
+    free(baseline);
+    free(counts);
+    free(results);
+    free(retried);
+    free(bench.io.output);
+    free(bench.program);
+    free(bench.simpletron);
+    return result;
+}
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <math.h>
+#include "simpletron.h"
+#include "decode.h"
+
+
+#define DECODE_CHUNK        256   /* words decoded at first, the table doubles from it */
+
+
+extern inline struct DecodedInstruction decode_word(const word_t);
+
+
+/* Decodes words in range from..to - 1 */
+void decode_memory(
+    const word_t memory[],
+    struct DecodedInstruction code[],
+    const size_t from,
+    const size_t to
+) {
+    for (size_t address = from; address < to; address++)
+        code[address] = decode_word(memory[address]);
+}
+
+
+/* Writes registers kept in locals back to simpletron */
+void sync_state(
+    struct Simpletron *simpletron,
+    const size_t counter,
+    const word_t accumulator,
+    const struct DecodedInstruction *instruction
+) {
+    simpletron->instruction_counter = (word_t) counter;
+    simpletron->accumulator = accumulator;
+    if (instruction != NULL) {
+        simpletron->instruction_register = instruction->instruction_register;
+        simpletron->operation_code = instruction->operation_code;
+        simpletron->operand = instruction->operand;
+    }
+}
+
+
+/* Grows table of decoded words to cover address, words are decoded from memory.
+ * Returns NULL if allocation fails, code is freed then */
+static struct DecodedInstruction *grow_decoded(
+    const word_t memory[], struct DecodedInstruction code[], size_t *size, const size_t address
+) {
+    size_t new_size = *size == 0 ? DECODE_CHUNK : *size * 2;
+    while (new_size <= address)
+        new_size *= 2;
+    if (new_size > MEMORY_SIZE)
+        new_size = MEMORY_SIZE;
+    struct DecodedInstruction *grown = realloc(
+        code, new_size * sizeof(struct DecodedInstruction)
+    );
+    if (grown == NULL) {
+        free(code);
+        return NULL;
+    }
+    decode_memory(memory, grown, *size, new_size);
+    *size = new_size;
+    return grown;
+}
+
+
+/* Runs program from memory decoded in advance. Words are decoded when execution first
+ * gets to their part of memory, and again when program writes to decoded words, so
+ * self-modifying programs behave the same as with execute_operation */
+enum Status run_decoded(struct Simpletron *simpletron) {
+    if (simpletron->instruction_counter < 0)
+        return fault(simpletron, FAULT_COUNTER);
+
+    size_t size = 0;
+    struct DecodedInstruction *code = NULL;
+
+    word_t *memory = simpletron->memory;
+    size_t counter = simpletron->instruction_counter;
+    word_t accumulator = simpletron->accumulator;
+    struct DecodedInstruction previous, instruction = {
+        .instruction_register=simpletron->instruction_register,
+        .operation_code=simpletron->operation_code,
+        .operand=simpletron->operand
+    };
+    const struct DecodedInstruction *current = NULL;
+    enum Status status = SUCCESS;
+    size_t last_address;
+
+    while (status == SUCCESS) {
+        if (counter >= size && counter >= MEMORY_SIZE) {
+            sync_state(simpletron, counter, accumulator, current);
+            status = fault(simpletron, FAULT_COUNTER);
+            break;
+        }
+        if (counter >= size && (code = grow_decoded(memory, code, &size, counter)) == NULL) {
+            sync_state(simpletron, counter, accumulator, current);
+            return fault(simpletron, FAULT_ALLOCATION);
+        }
+        previous = instruction;
+        instruction = code[counter++];
+        current = &instruction;
+
+        switch (instruction.operation_code) {
+            case NOP:
+                break;
+            case READ:
+                /* Input fault leaves registers as they are before reading */
+                sync_state(simpletron, counter, accumulator, current);
+                status = read_value(simpletron, instruction.operand);
+                if (status == SUSPEND)
+                    counter--;
+                if (instruction.operand < size)
+                    code[instruction.operand] = decode_word(memory[instruction.operand]);
+                break;
+            case WRITE:
+                write_value(simpletron, instruction.operand);
+                break;
+            case READSTR:
+                last_address = read_string(simpletron, instruction.operand);
+                if (last_address == SUSPENDED) {
+                    counter--;
+                    status = SUSPEND;
+                    break;
+                }
+                decode_memory(
+                    memory, code, instruction.operand, last_address < size ? last_address + 1 : size
+                );
+                break;
+            case WRITESTR:
+                write_string(simpletron, instruction.operand);
+                break;
+            case LOAD:
+                accumulator = memory[instruction.operand];
+                break;
+            case STORE:
+                memory[instruction.operand] = accumulator;
+                if (instruction.operand < size)
+                    code[instruction.operand] = decode_word(accumulator);
+                break;
+            case ADD:
+                accumulator += memory[instruction.operand];
+                break;
+            case SUBTRACT:
+                accumulator = memory[instruction.operand] - accumulator;
+                break;
+            case DIVIDE:
+                if (accumulator == 0) {
+                    sync_state(simpletron, counter, accumulator, current);
+                    status = fault(simpletron, FAULT_DIVISION);
+                    break;
+                }
+                accumulator = memory[instruction.operand] / accumulator;
+                break;
+            case MULTIPLY:
+                accumulator *= memory[instruction.operand];
+                break;
+            case REMAINDER:
+                if (accumulator == 0) {
+                    sync_state(simpletron, counter, accumulator, current);
+                    status = fault(simpletron, FAULT_DIVISION);
+                    break;
+                }
+                accumulator = memory[instruction.operand] % accumulator;
+                break;
+            case POWER:
+                accumulator = (word_t) pow(memory[instruction.operand], accumulator);
+                break;
+            case BRANCH:
+                counter = instruction.operand;
+                break;
+            case BRANCHNEG:
+                if (accumulator < 0)
+                    counter = instruction.operand;
+                break;
+            case BRANCHZERO:
+                if (accumulator == 0)
+                    counter = instruction.operand;
+                break;
+            case HALT:
+                status = halt(simpletron);
+                break;
+            case NEGATIVE_WORD:
+                /* execute_operation does not decode negative word */
+                current = &previous;
+                sync_state(simpletron, counter, accumulator, current);
+                simpletron->instruction_register = instruction.instruction_register;
+                status = fault(simpletron, FAULT_INSTRUCTION);
+                break;
+            default:
+                sync_state(simpletron, counter, accumulator, current);
+                status = fault(simpletron, FAULT_INSTRUCTION);
+                break;
+        }
+        if (status == SUCCESS && !check_value(accumulator)) {
+            sync_state(simpletron, counter, accumulator, current);
+            status = fault(simpletron, FAULT_ACCUMULATOR);
+        }
+    }
+    if (status != FAIL)
+        sync_state(simpletron, counter, accumulator, current);
+    free(code);
+    return status;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "simpletron.h"
+
+
+#define NEGATIVE_WORD       0xFF  /* Decoded operation code of negative (invalid) word */
+
+struct DecodedInstruction {
+    word_t      instruction_register;   /* raw word, kept for state write back */
+    uint8_t     operation_code;         /* decoded operation */
+    uword_t     operand;                /* decoded operand */
+};
+
+void decode_memory(const word_t [], struct DecodedInstruction [], const size_t, const size_t);
+void sync_state(
+    struct Simpletron *, const size_t, const word_t, const struct DecodedInstruction *
+);
+enum Status run_decoded(struct Simpletron *);
+
+
+/* Defined here so engines can inline it on every write to memory */
+inline struct DecodedInstruction decode_word(const word_t word) {
+    if (word < 0)
+        return (struct DecodedInstruction) {
+            .instruction_register=word, .operation_code=NEGATIVE_WORD, .operand=0
+        };
+    return (struct DecodedInstruction) {
+        .instruction_register=word,
+        .operation_code=(uword_t) word >> OPERAND_BITS,
+        .operand=(uword_t) word & ((1 << OPERAND_BITS) - 1)
+    };
+}
@@ -0,0 +1,39 @@
+#include <string.h>
+#include "simpletron.h"
+#include "engine.h"
+#include "decode.h"
+#include "fuse.h"
+#include "threaded.h"
+#include "jit.h"
+#include "tier.h"
+
+
+const struct Engine engines[] = {
+    {.name="switch", .run=run_switch},
+    {.name="decoded", .run=run_decoded},
+    {.name="fused", .run=run_fused},
+    {.name="threaded", .run=run_threaded},
+    {.name="jit", .run=run_jit},
+    {.name="tiered", .run=run_tiered},
+    {.name=NULL, .run=NULL}
+};
+
+
+/* Searches engine by name, returns NULL if not found */
+const struct Engine *find_engine(const char name[]) {
+    for (const struct Engine *engine = engines; engine->name != NULL; engine++) {
+        if (strcmp(engine->name, name) == 0)
+            return engine;
+    }
+    return NULL;
+}
+
+
+/* Runs program with execute_operation one instruction at a time */
+enum Status run_switch(struct Simpletron *simpletron) {
+    enum Status status;
+    do {
+        status = execute_operation(simpletron);
+    } while (status == SUCCESS);
+    return status;
+}
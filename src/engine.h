@@ -0,0 +1,15 @@
+#pragma once
+
+#include "simpletron.h"
+
+
+struct Engine {
+    const char  *name;
+    /* runs program until STOP or FAIL, or SUSPEND if io has no input for READ yet */
+    enum Status (*run)(struct Simpletron *);
+};
+
+extern const struct Engine engines[];
+
+const struct Engine *find_engine(const char []);
+enum Status run_switch(struct Simpletron *);
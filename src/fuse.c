@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "simpletron.h"
+#include "decode.h"
+#include "fuse.h"
+
+
+#define FUSION_LENGTH       3     /* the longest fused sequence */
+#define UNFUSED             0xFE  /* dispatch code of word with outdated fusion */
+#define FUSE_CHUNK          256   /* words fused at first, the table doubles from it */
+
+static const char *fused_names[FUSED_SIZE] = {
+    [FUSED_LOAD_STORE]="LOAD+STORE",
+    [FUSED_LOAD_ADD_STORE]="LOAD+ADD+STORE",
+    [FUSED_LOAD_SUBTRACT_STORE]="LOAD+SUBTRACT+STORE",
+    [FUSED_LOAD_MULTIPLY_STORE]="LOAD+MULTIPLY+STORE",
+    [FUSED_LOAD_BRANCHNEG]="LOAD+BRANCHNEG",
+    [FUSED_LOAD_BRANCHZERO]="LOAD+BRANCHZERO",
+    [FUSED_ADD_BRANCHNEG]="ADD+BRANCHNEG",
+    [FUSED_ADD_BRANCHZERO]="ADD+BRANCHZERO",
+    [FUSED_SUBTRACT_BRANCHNEG]="SUBTRACT+BRANCHNEG",
+    [FUSED_SUBTRACT_BRANCHZERO]="SUBTRACT+BRANCHZERO",
+    [FUSED_MULTIPLY_BRANCHNEG]="MULTIPLY+BRANCHNEG",
+    [FUSED_MULTIPLY_BRANCHZERO]="MULTIPLY+BRANCHZERO"
+};
+
+
+static size_t fused_length(const size_t fused) {
+    if (fused >= FUSED_LOAD_ADD_STORE && fused <= FUSED_LOAD_MULTIPLY_STORE)
+        return 3;
+    return 2;
+}
+
+
+/* Position of operation in ADD, SUBTRACT, MULTIPLY order of fused operations,
+ * -1 for operations which can fault or can not be fused */
+static int arithmetic_index(const uint8_t operation_code) {
+    switch (operation_code) {
+        case ADD:
+            return 0;
+        case SUBTRACT:
+            return 1;
+        case MULTIPLY:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+
+/* Finds dispatch code of the longest fused sequence starting at address, sequences do
+ * not reach past the first size words */
+uint8_t find_fusion(const struct FusedInstruction code[], const size_t address, const size_t size) {
+    uint8_t operation_codes[FUSION_LENGTH];
+    for (size_t idx = 0; idx < FUSION_LENGTH; idx++)
+        operation_codes[idx] = (
+            address + idx < size ? code[address + idx].instruction.operation_code : NEGATIVE_WORD
+        );
+
+    const int first = arithmetic_index(operation_codes[0]);
+    const int second = arithmetic_index(operation_codes[1]);
+    const bool branch = operation_codes[1] == BRANCHNEG || operation_codes[1] == BRANCHZERO;
+    if (operation_codes[0] == LOAD && second >= 0 && operation_codes[2] == STORE)
+        return FUSED_BASE + FUSED_LOAD_ADD_STORE + second;
+    if (operation_codes[0] == LOAD && operation_codes[1] == STORE)
+        return FUSED_BASE + FUSED_LOAD_STORE;
+    if ((operation_codes[0] == LOAD || first >= 0) && branch)
+        return (
+            FUSED_BASE + FUSED_LOAD_BRANCHNEG + 2 * (first + 1)
+            + (operation_codes[1] == BRANCHZERO)
+        );
+    return operation_codes[0];
+}
+
+
+/* Decodes words in range from..to - 1 of table of size words and finds fusions again
+ * for every sequence containing them */
+void fuse_memory(
+    const word_t memory[],
+    struct FusedInstruction code[],
+    const size_t from,
+    const size_t to,
+    const size_t size
+) {
+    for (size_t address = from; address < to; address++)
+        code[address].instruction = decode_word(memory[address]);
+    const size_t first = from < FUSION_LENGTH ? 0 : from - FUSION_LENGTH + 1;
+    for (size_t address = first; address < to; address++)
+        code[address].operation = find_fusion(code, address, size);
+}
+
+
+static inline bool is_fused(const uint8_t operation) {
+    return operation >= FUSED_BASE && operation < NEGATIVE_WORD;
+}
+
+
+/* Grows table of fused words to cover address. Words are decoded from memory and
+ * sequences reaching them are fused again, newly formed fusions are counted in stats.
+ * Returns NULL if allocation fails, code is freed then */
+static struct FusedInstruction *grow_fused(
+    const word_t memory[], struct FusedInstruction code[], size_t *size, const size_t address,
+    struct FusionStats *stats
+) {
+    size_t new_size = *size == 0 ? FUSE_CHUNK : *size * 2;
+    while (new_size <= address)
+        new_size *= 2;
+    if (new_size > MEMORY_SIZE)
+        new_size = MEMORY_SIZE;
+    struct FusedInstruction *grown = realloc(code, new_size * sizeof(struct FusedInstruction));
+    if (grown == NULL) {
+        free(code);
+        return NULL;
+    }
+
+    /* Sequences at the end of old table could not reach new words before */
+    const size_t first = *size < FUSION_LENGTH ? 0 : *size - FUSION_LENGTH + 1;
+    uint8_t before[FUSION_LENGTH];
+    for (size_t address = first; address < *size; address++)
+        before[address - first] = grown[address].operation;
+    fuse_memory(memory, grown, *size, new_size, new_size);
+    for (size_t address = first; address < new_size; address++) {
+        const uint8_t operation = grown[address].operation;
+        if (is_fused(operation) && (address >= *size || before[address - first] != operation))
+            stats->formed[operation - FUSED_BASE]++;
+    }
+    *size = new_size;
+    return grown;
+}
+
+
+/* Decodes word written to memory, words out of table of size words are decoded when it
+ * grows. Fusions depend only on operation codes, operands are read from cells on
+ * execution, so if the code changed, fusions of sequences containing the word are found
+ * again when they are executed */
+static inline void update_word(
+    const word_t memory[], struct FusedInstruction code[], const size_t size,
+    const size_t address
+) {
+    if (address >= size)
+        return;
+    const struct DecodedInstruction instruction = decode_word(memory[address]);
+    if (instruction.operation_code != code[address].instruction.operation_code) {
+        const size_t first = address < FUSION_LENGTH ? 0 : address - FUSION_LENGTH + 1;
+        for (size_t idx = first; idx <= address; idx++)
+            code[idx].operation = UNFUSED;
+    }
+    code[address].instruction = instruction;
+}
+
+
+/* Operand value of instruction idx of fused sequence */
+#define VALUE(idx)          memory[cell[idx].instruction.operand]
+
+/* Fused sequence ending with store of expression */
+#define FUSED_STORE(fused, expression) \
+    target = cell[fused_length(fused) - 1].instruction.operand; \
+    accumulator = (expression); \
+    last = cell[fused_length(fused) - 1].instruction; \
+    counter += fused_length(fused) - 1; \
+    memory[target] = accumulator; \
+    update_word(memory, code, size, target); \
+    counted.executed[fused]++
+
+/* Fused sequence ending with branch depending on expression */
+#define FUSED_BRANCH(fused, expression, condition) \
+    accumulator = (expression); \
+    last = cell[1].instruction; \
+    counter = (condition) ? last.operand : counter + 1; \
+    counted.executed[fused]++
+
+
+/* Runs program like run_decoded, fused sequences are executed in one dispatch. Words
+ * are fused when execution first gets to their part of memory. Store of fused sequence
+ * is its last instruction, so words it modifies are fused again before they can be
+ * executed */
+enum Status run_fused_counted(struct Simpletron *simpletron, struct FusionStats *stats) {
+    if (simpletron->instruction_counter < 0)
+        return fault(simpletron, FAULT_COUNTER);
+
+    size_t size = 0;
+    struct FusedInstruction *code = NULL;
+    word_t *memory = simpletron->memory;
+
+    struct FusionStats counted;
+    memset(&counted, 0, sizeof(struct FusionStats));
+
+    size_t counter = simpletron->instruction_counter;
+    word_t accumulator = simpletron->accumulator;
+    struct DecodedInstruction previous, last = {
+        .instruction_register=simpletron->instruction_register,
+        .operation_code=simpletron->operation_code,
+        .operand=simpletron->operand
+    };
+    enum Status status = SUCCESS;
+    size_t target;
+
+    while (status == SUCCESS) {
+        if (counter >= size && counter >= MEMORY_SIZE) {
+            sync_state(simpletron, counter, accumulator, &last);
+            status = fault(simpletron, FAULT_COUNTER);
+            break;
+        }
+        if (
+            counter >= size
+            && (code = grow_fused(memory, code, &size, counter, &counted)) == NULL
+        ) {
+            sync_state(simpletron, counter, accumulator, &last);
+            return fault(simpletron, FAULT_ALLOCATION);
+        }
+        const struct FusedInstruction *cell = &code[counter++];
+        previous = last;
+        last = cell->instruction;
+        counted.dispatches++;
+
+        switch (cell->operation) {
+            case NOP:
+                break;
+            case READ:
+                /* Input fault leaves registers as they are before reading */
+                sync_state(simpletron, counter, accumulator, &last);
+                status = read_value(simpletron, last.operand);
+                if (status == SUSPEND)
+                    counter--;
+                update_word(memory, code, size, last.operand);
+                break;
+            case WRITE:
+                write_value(simpletron, last.operand);
+                break;
+            case READSTR:
+                target = read_string(simpletron, last.operand);
+                if (target == SUSPENDED) {
+                    counter--;
+                    status = SUSPEND;
+                    break;
+                }
+                if (last.operand < size)
+                    fuse_memory(
+                        memory, code, last.operand, target < size ? target + 1 : size, size
+                    );
+                break;
+            case WRITESTR:
+                write_string(simpletron, last.operand);
+                break;
+            case LOAD:
+                accumulator = memory[last.operand];
+                break;
+            case STORE:
+                memory[last.operand] = accumulator;
+                update_word(memory, code, size, last.operand);
+                break;
+            case ADD:
+                accumulator += memory[last.operand];
+                break;
+            case SUBTRACT:
+                accumulator = memory[last.operand] - accumulator;
+                break;
+            case DIVIDE:
+                if (accumulator == 0) {
+                    sync_state(simpletron, counter, accumulator, &last);
+                    status = fault(simpletron, FAULT_DIVISION);
+                    break;
+                }
+                accumulator = memory[last.operand] / accumulator;
+                break;
+            case MULTIPLY:
+                accumulator *= memory[last.operand];
+                break;
+            case REMAINDER:
+                if (accumulator == 0) {
+                    sync_state(simpletron, counter, accumulator, &last);
+                    status = fault(simpletron, FAULT_DIVISION);
+                    break;
+                }
+                accumulator = memory[last.operand] % accumulator;
+                break;
+            case POWER:
+                accumulator = (word_t) pow(memory[last.operand], accumulator);
+                break;
+            case BRANCH:
+                counter = last.operand;
+                break;
+            case BRANCHNEG:
+                if (accumulator < 0)
+                    counter = last.operand;
+                break;
+            case BRANCHZERO:
+                if (accumulator == 0)
+                    counter = last.operand;
+                break;
+            case HALT:
+                status = halt(simpletron);
+                break;
+            case FUSED_BASE + FUSED_LOAD_STORE:
+                FUSED_STORE(FUSED_LOAD_STORE, VALUE(0));
+                break;
+            case FUSED_BASE + FUSED_LOAD_ADD_STORE:
+                FUSED_STORE(FUSED_LOAD_ADD_STORE, VALUE(0) + VALUE(1));
+                break;
+            case FUSED_BASE + FUSED_LOAD_SUBTRACT_STORE:
+                FUSED_STORE(FUSED_LOAD_SUBTRACT_STORE, VALUE(1) - VALUE(0));
+                break;
+            case FUSED_BASE + FUSED_LOAD_MULTIPLY_STORE:
+                FUSED_STORE(FUSED_LOAD_MULTIPLY_STORE, VALUE(0) * VALUE(1));
+                break;
+            case FUSED_BASE + FUSED_LOAD_BRANCHNEG:
+                FUSED_BRANCH(FUSED_LOAD_BRANCHNEG, VALUE(0), accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_LOAD_BRANCHZERO:
+                FUSED_BRANCH(FUSED_LOAD_BRANCHZERO, VALUE(0), accumulator == 0);
+                break;
+            case FUSED_BASE + FUSED_ADD_BRANCHNEG:
+                FUSED_BRANCH(FUSED_ADD_BRANCHNEG, accumulator + VALUE(0), accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_ADD_BRANCHZERO:
+                FUSED_BRANCH(FUSED_ADD_BRANCHZERO, accumulator + VALUE(0), accumulator == 0);
+                break;
+            case FUSED_BASE + FUSED_SUBTRACT_BRANCHNEG:
+                FUSED_BRANCH(FUSED_SUBTRACT_BRANCHNEG, VALUE(0) - accumulator, accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_SUBTRACT_BRANCHZERO:
+                FUSED_BRANCH(FUSED_SUBTRACT_BRANCHZERO, VALUE(0) - accumulator, accumulator == 0);
+                break;
+            case FUSED_BASE + FUSED_MULTIPLY_BRANCHNEG:
+                FUSED_BRANCH(FUSED_MULTIPLY_BRANCHNEG, accumulator * VALUE(0), accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_MULTIPLY_BRANCHZERO:
+                FUSED_BRANCH(FUSED_MULTIPLY_BRANCHZERO, accumulator * VALUE(0), accumulator == 0);
+                break;
+            case UNFUSED:
+                /* Find fusion and dispatch the word again */
+                counter--;
+                code[counter].operation = find_fusion(code, counter, size);
+                last = previous;
+                counted.dispatches--;
+                continue;
+            case NEGATIVE_WORD:
+                /* execute_operation does not decode negative word */
+                sync_state(simpletron, counter, accumulator, &previous);
+                simpletron->instruction_register = last.instruction_register;
+                status = fault(simpletron, FAULT_INSTRUCTION);
+                break;
+            default:
+                sync_state(simpletron, counter, accumulator, &last);
+                status = fault(simpletron, FAULT_INSTRUCTION);
+                break;
+        }
+        if (status == SUCCESS && !check_value(accumulator)) {
+            sync_state(simpletron, counter, accumulator, &last);
+            status = fault(simpletron, FAULT_ACCUMULATOR);
+        }
+    }
+    if (status != FAIL)
+        sync_state(simpletron, counter, accumulator, &last);
+    if (stats != NULL)
+        *stats = counted;
+    free(code);
+    return status;
+}
+
+
+enum Status run_fused(struct Simpletron *simpletron) {
+    return run_fused_counted(simpletron, NULL);
+}
+
+
+void write_fusion_stats(FILE *file, const struct FusionStats *stats) {
+    unsigned long instructions = stats->dispatches;
+    for (size_t fused = 0; fused < FUSED_SIZE; fused++)
+        instructions += stats->executed[fused] * (fused_length(fused) - 1);
+
+    fprintf(
+        file, "\n*** Fusion: %lu instructions in %lu dispatches ***\n",
+        instructions, stats->dispatches
+    );
+    fprintf(file, "%-24s%12s%12s\n", "fusion", "formed", "executed");
+    for (size_t fused = 0; fused < FUSED_SIZE; fused++) {
+        if (stats->formed[fused] > 0 || stats->executed[fused] > 0)
+            fprintf(
+                file, "%-24s%12lu%12lu\n",
+                fused_names[fused], stats->formed[fused], stats->executed[fused]
+            );
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdio.h>
+#include "simpletron.h"
+#include "decode.h"
+
+
+/* Sequences executed as one macro-operation */
+enum FusedOperation {
+    FUSED_LOAD_STORE,               /* LOAD a; STORE b */
+    FUSED_LOAD_ADD_STORE,           /* LOAD a; ADD b; STORE c */
+    FUSED_LOAD_SUBTRACT_STORE,
+    FUSED_LOAD_MULTIPLY_STORE,
+    FUSED_LOAD_BRANCHNEG,           /* LOAD a; BRANCHNEG b */
+    FUSED_LOAD_BRANCHZERO,
+    FUSED_ADD_BRANCHNEG,
+    FUSED_ADD_BRANCHZERO,
+    FUSED_SUBTRACT_BRANCHNEG,
+    FUSED_SUBTRACT_BRANCHZERO,
+    FUSED_MULTIPLY_BRANCHNEG,
+    FUSED_MULTIPLY_BRANCHZERO,
+    FUSED_SIZE
+};
+
+#define FUSED_BASE          0x80  /* dispatch code of the first fused operation */
+
+/* Instruction with dispatch code: its own operation code or FUSED_BASE + fused operation
+ * starting at its address. Instruction itself is kept for jumps into fused sequence */
+struct FusedInstruction {
+    struct DecodedInstruction   instruction;
+    uint8_t                     operation;
+};
+
+struct FusionStats {
+    unsigned long   formed[FUSED_SIZE];     /* fused operations found in words reached */
+    unsigned long   executed[FUSED_SIZE];   /* times fused operation was executed */
+    unsigned long   dispatches;             /* executed plain and fused operations */
+};
+
+
+uint8_t find_fusion(const struct FusedInstruction [], const size_t, const size_t);
+void fuse_memory(
+    const word_t [], struct FusedInstruction [], const size_t, const size_t, const size_t
+);
+enum Status run_fused_counted(struct Simpletron *, struct FusionStats *);
+enum Status run_fused(struct Simpletron *);
+void write_fusion_stats(FILE *, const struct FusionStats *);
@@ -0,0 +1,390 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include "simpletron.h"
+#include "decode.h"
+#include "jit.h"
+
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define JIT_ARENA_SIZE      (1 << 20)
+#define MAX_BLOCK_LENGTH    64
+#define MAX_INSTRUCTION     48  /* Upper bound of native code bytes per instruction */
+#define MAX_BLOCK_CODE      (MAX_BLOCK_LENGTH * MAX_INSTRUCTION + MAX_INSTRUCTION)
+#define FAULT_EXIT          0x80000000u  /* Block stopped at instruction which faults */
+
+/* Compiled block takes memory and accumulator, returns address of the next instruction */
+typedef uint32_t (*BlockFunction)(word_t *, word_t *);
+
+struct JitBlock {
+    BlockFunction               function;
+    size_t                      start;                      /* first address */
+    size_t                      end;                        /* address after the last one */
+    struct DecodedInstruction   last;                       /* last instruction in block */
+    size_t                      stores_size;
+    uword_t                     stores[MAX_BLOCK_LENGTH];   /* addresses written by block */
+};
+
+struct Jit {
+    uint8_t                     *arena;                     /* executable pages */
+    size_t                      arena_used;
+    struct JitBlock             **blocks;                   /* block starting at address */
+    uint8_t                     *covered;                   /* number of blocks covering address */
+};
+
+/* Marks address which can't start a block */
+static struct JitBlock not_compilable;
+
+struct Emitter {
+    uint8_t                     *code;
+    size_t                      size;
+};
+
+
+static void emit(struct Emitter *emitter, const size_t size, const uint8_t bytes[]) {
+    memcpy(emitter->code + emitter->size, bytes, size);
+    emitter->size += size;
+}
+
+
+static void emit_u32(struct Emitter *emitter, const uint32_t value) {
+    const uint8_t bytes[] = {value, value >> 8, value >> 16, value >> 24};
+    emit(emitter, sizeof(bytes), bytes);
+}
+
+#define EMIT(emitter, ...) \
+    emit(emitter, sizeof((uint8_t []) {__VA_ARGS__}), (uint8_t []) {__VA_ARGS__})
+
+/* Registers: rdi = memory, rsi = &accumulator, rax = accumulator, rcx and rdx are scratch */
+#define RAX                 0
+#define RCX                 1
+
+/* movsx reg, word [rdi + address * sizeof(word_t)] */
+static void emit_load(struct Emitter *emitter, const int reg, const size_t address) {
+    const uint8_t modrm = 0x80 | reg << 3 | 7;
+#if WORD_BITS == 8
+    EMIT(emitter, 0x48, 0x0F, 0xBE, modrm);
+#elif WORD_BITS == 16
+    EMIT(emitter, 0x48, 0x0F, 0xBF, modrm);
+#elif WORD_BITS == 32
+    EMIT(emitter, 0x48, 0x63, modrm);
+#endif
+    emit_u32(emitter, address * sizeof(word_t));
+}
+
+
+/* mov word [rdi + address * sizeof(word_t)], ax */
+static void emit_store(struct Emitter *emitter, const size_t address) {
+#if WORD_BITS == 8
+    EMIT(emitter, 0x88, 0x87);
+#elif WORD_BITS == 16
+    EMIT(emitter, 0x66, 0x89, 0x87);
+#elif WORD_BITS == 32
+    EMIT(emitter, 0x89, 0x87);
+#endif
+    emit_u32(emitter, address * sizeof(word_t));
+}
+
+
+/* Wraps rax to word_t the same way as assignment to accumulator does */
+static void emit_wrap(struct Emitter *emitter) {
+#if WORD_BITS == 8
+    EMIT(emitter, 0x48, 0x0F, 0xBE, 0xC0);  /* movsx rax, al */
+#elif WORD_BITS == 16
+    EMIT(emitter, 0x48, 0x0F, 0xBF, 0xC0);  /* movsx rax, ax */
+#elif WORD_BITS == 32
+    EMIT(emitter, 0x48, 0x63, 0xC0);        /* movsxd rax, eax */
+#endif
+}
+
+
+/* Saves accumulator and returns address of the next instruction */
+static void emit_exit(struct Emitter *emitter, const uint32_t next) {
+#if WORD_BITS == 8
+    EMIT(emitter, 0x88, 0x06);              /* mov [rsi], al */
+#elif WORD_BITS == 16
+    EMIT(emitter, 0x66, 0x89, 0x06);        /* mov [rsi], ax */
+#elif WORD_BITS == 32
+    EMIT(emitter, 0x89, 0x06);              /* mov [rsi], eax */
+#endif
+    EMIT(emitter, 0xB8);                    /* mov eax, next */
+    emit_u32(emitter, next);
+    EMIT(emitter, 0xC3);                    /* ret */
+}
+
+
+/* Division by zero leaves block at the faulting instruction marked with FAULT_EXIT,
+ * so execute_operation reports it */
+static void emit_division(
+    struct Emitter *emitter, const bool remainder, const size_t address, const size_t operand
+) {
+    EMIT(emitter, 0x48, 0x89, 0xC1);        /* mov rcx, rax */
+    EMIT(emitter, 0x48, 0x85, 0xC9);        /* test rcx, rcx */
+    EMIT(emitter, 0x75, 0x00);              /* jnz over exit */
+    const size_t jump = emitter->size;
+    emit_exit(emitter, address | FAULT_EXIT);
+    emitter->code[jump - 1] = emitter->size - jump;
+    emit_load(emitter, RAX, operand);
+    EMIT(emitter, 0x48, 0x99);              /* cqo */
+    EMIT(emitter, 0x48, 0xF7, 0xF9);        /* idiv rcx */
+    if (remainder)
+        EMIT(emitter, 0x48, 0x89, 0xD0);    /* mov rax, rdx */
+    emit_wrap(emitter);
+}
+
+
+/* Conditional branch: next = condition ? target : address + 1 */
+static void emit_branch(
+    struct Emitter *emitter, const uint8_t cmov, const size_t address, const size_t target
+) {
+    EMIT(emitter, 0x48, 0x85, 0xC0);        /* test rax, rax */
+#if WORD_BITS == 8
+    EMIT(emitter, 0x88, 0x06);
+#elif WORD_BITS == 16
+    EMIT(emitter, 0x66, 0x89, 0x06);
+#elif WORD_BITS == 32
+    EMIT(emitter, 0x89, 0x06);
+#endif
+    EMIT(emitter, 0xB8);                    /* mov eax, address + 1 */
+    emit_u32(emitter, address + 1);
+    EMIT(emitter, 0xB9);                    /* mov ecx, target */
+    emit_u32(emitter, target);
+    EMIT(emitter, 0x0F, cmov, 0xC1);        /* cmovcc eax, ecx */
+    EMIT(emitter, 0xC3);                    /* ret */
+}
+
+
+static bool block_contains(const struct JitBlock *block, const size_t address) {
+    return block != NULL && block != &not_compilable
+        && block->start <= address && address < block->end;
+}
+
+
+static void drop_block(struct Jit *jit, struct JitBlock *block) {
+    for (size_t address = block->start; address < block->end; address++)
+        jit->covered[address]--;
+    jit->blocks[block->start] = NULL;
+    free(block);
+}
+
+
+/* Drops all blocks compiled from word at address */
+static void invalidate(struct Jit *jit, const size_t address) {
+    if (jit->blocks[address] == &not_compilable)
+        jit->blocks[address] = NULL;
+    if (jit->covered[address] == 0)
+        return;
+    const size_t first = address >= MAX_BLOCK_LENGTH ? address - MAX_BLOCK_LENGTH + 1 : 0;
+    for (size_t start = first; start <= address; start++) {
+        if (block_contains(jit->blocks[start], address))
+            drop_block(jit, jit->blocks[start]);
+    }
+}
+
+
+static void flush(struct Jit *jit) {
+    for (size_t address = 0; address < MEMORY_SIZE; address++) {
+        if (jit->blocks[address] != NULL && jit->blocks[address] != &not_compilable)
+            drop_block(jit, jit->blocks[address]);
+        jit->blocks[address] = NULL;
+    }
+    jit->arena_used = 0;
+}
+
+
+static bool is_store_target(const struct JitBlock *block, const size_t address) {
+    for (size_t store = 0; store < block->stores_size; store++) {
+        if (block->stores[store] == address)
+            return true;
+    }
+    return false;
+}
+
+
+/* Compiles straight-line instructions starting at address up to and including
+ * the first branch. Returns NULL if the first instruction can't be compiled */
+static struct JitBlock *compile_block(struct Jit *jit, const word_t memory[], const size_t start) {
+    uint8_t buffer[MAX_BLOCK_CODE];
+    struct Emitter emitter = {.code=buffer, .size=0};
+    struct JitBlock *block = malloc(sizeof(struct JitBlock));
+    if (block == NULL)
+        return NULL;
+    *block = (struct JitBlock) {.start=start, .end=start, .stores_size=0};
+
+#if WORD_BITS == 8
+    EMIT(&emitter, 0x48, 0x0F, 0xBE, 0x06);     /* movsx rax, byte [rsi] */
+#elif WORD_BITS == 16
+    EMIT(&emitter, 0x48, 0x0F, 0xBF, 0x06);     /* movsx rax, word [rsi] */
+#elif WORD_BITS == 32
+    EMIT(&emitter, 0x48, 0x63, 0x06);           /* movsxd rax, dword [rsi] */
+#endif
+
+    bool terminated = false;
+    size_t address = start;
+    for (; address < MEMORY_SIZE && address - start < MAX_BLOCK_LENGTH && !terminated; address++) {
+        /* Word will be modified by this block before execution */
+        if (is_store_target(block, address))
+            break;
+        const struct DecodedInstruction instruction = decode_word(memory[address]);
+        switch (instruction.operation_code) {
+            case NOP:
+                break;
+            case LOAD:
+                emit_load(&emitter, RAX, instruction.operand);
+                break;
+            case STORE:
+                emit_store(&emitter, instruction.operand);
+                block->stores[block->stores_size++] = instruction.operand;
+                break;
+            case ADD:
+                emit_load(&emitter, RCX, instruction.operand);
+                EMIT(&emitter, 0x48, 0x01, 0xC8);          /* add rax, rcx */
+                emit_wrap(&emitter);
+                break;
+            case SUBTRACT:
+                emit_load(&emitter, RCX, instruction.operand);
+                EMIT(&emitter, 0x48, 0x29, 0xC1);          /* sub rcx, rax */
+                EMIT(&emitter, 0x48, 0x89, 0xC8);          /* mov rax, rcx */
+                emit_wrap(&emitter);
+                break;
+            case MULTIPLY:
+                emit_load(&emitter, RCX, instruction.operand);
+                EMIT(&emitter, 0x48, 0x0F, 0xAF, 0xC1);    /* imul rax, rcx */
+                emit_wrap(&emitter);
+                break;
+            case DIVIDE:
+            case REMAINDER:
+                emit_division(
+                    &emitter, instruction.operation_code == REMAINDER, address, instruction.operand
+                );
+                break;
+            case BRANCH:
+                emit_exit(&emitter, instruction.operand);
+                terminated = true;
+                break;
+            case BRANCHNEG:
+                emit_branch(&emitter, 0x48, address, instruction.operand);  /* cmovs */
+                terminated = true;
+                break;
+            case BRANCHZERO:
+                emit_branch(&emitter, 0x44, address, instruction.operand);  /* cmovz */
+                terminated = true;
+                break;
+            default:
+                /* I/O, POWER, HALT and invalid words are left to execute_operation */
+                goto end_of_block;
+        }
+        block->last = instruction;
+    }
+end_of_block:
+    if (address == start) {
+        free(block);
+        return NULL;
+    }
+    block->end = address;
+    if (!terminated)
+        emit_exit(&emitter, block->end);
+
+    if (jit->arena_used + emitter.size > JIT_ARENA_SIZE)
+        flush(jit);
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        free(block);
+        return NULL;
+    }
+    memcpy(jit->arena + jit->arena_used, buffer, emitter.size);
+    mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC);
+    block->function = (BlockFunction) (jit->arena + jit->arena_used);
+    jit->arena_used += emitter.size;
+
+    for (size_t covered = block->start; covered < block->end; covered++)
+        jit->covered[covered]++;
+    return block;
+}
+
+
+/* Runs program compiling basic blocks to x86-64 code on first execution.
+ * I/O, POWER and HALT are executed by execute_operation */
+enum Status run_jit(struct Simpletron *simpletron) {
+    struct Jit jit = {
+        .arena=mmap(
+            NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+        ),
+        .arena_used=0,
+        .blocks=calloc(MEMORY_SIZE, sizeof(struct JitBlock *)),
+        .covered=calloc(MEMORY_SIZE, sizeof(uint8_t))
+    };
+    if (jit.arena == MAP_FAILED || jit.blocks == NULL || jit.covered == NULL) {
+        /* Without compiler memory program still runs, only slower */
+        if (jit.arena != MAP_FAILED)
+            munmap(jit.arena, JIT_ARENA_SIZE);
+        free(jit.blocks);
+        free(jit.covered);
+        return run_decoded(simpletron);
+    }
+
+    enum Status status = SUCCESS;
+    while (status == SUCCESS) {
+        const word_t counter = simpletron->instruction_counter;
+        struct JitBlock *block = NULL;
+        if (counter >= 0 && counter < MEMORY_SIZE) {
+            block = jit.blocks[counter];
+            if (block == NULL) {
+                block = compile_block(&jit, simpletron->memory, counter);
+                jit.blocks[counter] = block == NULL ? &not_compilable : block;
+            }
+        }
+
+        if (block != NULL && block != &not_compilable) {
+            const uint32_t next = block->function(simpletron->memory, &simpletron->accumulator);
+            simpletron->instruction_counter = (word_t) (next & ~FAULT_EXIT);
+            if (next & FAULT_EXIT) {
+                status = execute_operation(simpletron);
+            } else {
+                simpletron->instruction_register = block->last.instruction_register;
+                simpletron->operation_code = block->last.operation_code;
+                simpletron->operand = block->last.operand;
+                /* Accumulator is wrapped to word_t, check is the same as in execute_operation */
+                if (!check_value(simpletron->accumulator))
+                    status = fault(simpletron, FAULT_ACCUMULATOR);
+            }
+            /* Block modifying itself is dropped last, its store list is still in use */
+            bool self_modified = false;
+            size_t self_address = 0;
+            for (size_t store = 0; store < block->stores_size; store++) {
+                if (block_contains(block, block->stores[store])) {
+                    self_modified = true;
+                    self_address = block->stores[store];
+                } else {
+                    invalidate(&jit, block->stores[store]);
+                }
+            }
+            if (self_modified)
+                invalidate(&jit, self_address);
+            continue;
+        }
+
+        status = execute_operation(simpletron);
+        if (simpletron->operation_code == READ || simpletron->operation_code == STORE)
+            invalidate(&jit, simpletron->operand);
+        else if (simpletron->operation_code == READSTR)
+            flush(&jit);
+    }
+
+    flush(&jit);
+    munmap(jit.arena, JIT_ARENA_SIZE);
+    free(jit.blocks);
+    free(jit.covered);
+    return status;
+}
+
+#else
+
+/* JIT compiler supports only x86-64, fall back to interpreter */
+enum Status run_jit(struct Simpletron *simpletron) {
+    return run_decoded(simpletron);
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include "libsimpletron.h"
+
+
+static enum Status silent_read_value(void *context, word_t *value) {
+    (void) context;
+    (void) value;
+    return FAIL;
+}
+
+
+static void silent_write_value(void *context, const word_t value) {
+    (void) context;
+    (void) value;
+}
+
+
+static size_t silent_read_string(void *context, char string[], const size_t size) {
+    (void) context;
+    (void) string;
+    (void) size;
+    return 0;
+}
+
+
+static void silent_write_string(void *context, const char string[]) {
+    (void) context;
+    (void) string;
+}
+
+
+static void silent_report(void *context, const enum Status status, const char message[]) {
+    (void) context;
+    (void) status;
+    (void) message;
+}
+
+
+/* Channel without input, all output is dropped */
+const struct SimpletronIO silent_io = {
+    .read_value=silent_read_value,
+    .write_value=silent_write_value,
+    .read_string=silent_read_string,
+    .write_string=silent_write_string,
+    .report=silent_report,
+    .context=NULL
+};
+
+
+/* Allocates cleared machine, io == NULL selects silent_io */
+struct Simpletron *simpletron_new(const struct SimpletronIO *io) {
+    struct Simpletron *simpletron = malloc(sizeof(struct Simpletron));
+    if (simpletron == NULL)
+        return NULL;
+    reset(simpletron);
+    simpletron->io = io == NULL ? &silent_io : io;
+    return simpletron;
+}
+
+
+void simpletron_free(struct Simpletron *simpletron) {
+    free(simpletron);
+}
+
+
+/* Loads binary memory state or SML text, io of machine is kept */
+enum Load simpletron_load(
+    struct Simpletron *simpletron, const char buffer[], const size_t size, size_t *line
+) {
+    const struct SimpletronIO *io = simpletron->io;
+    const enum Load status = load_sml(simpletron, buffer, size, line);
+    simpletron->io = io;
+    return status;
+}
+
+
+/*
+ * Runs program with engine (NULL for default) until STOP or FAIL, or SUSPEND if io has
+ * no input for READ yet, then the call continues from READ.
+ * With max_steps > 0 at most max_steps instructions are executed one at a time and
+ * SUCCESS is returned if program is still running; next call continues from there.
+ * Engines run until the program stops, so engine must be NULL then, otherwise nothing
+ * runs and FAIL is returned with FAULT_STEPPING.
+ */
+enum Status simpletron_run(
+    struct Simpletron *simpletron, const struct Engine *engine, const unsigned long max_steps
+) {
+    if (max_steps == 0)
+        return (engine == NULL ? engines : engine)->run(simpletron);
+    if (engine != NULL)
+        return fault(simpletron, FAULT_STEPPING);
+
+    enum Status status = SUCCESS;
+    for (unsigned long step = 0; step < max_steps && status == SUCCESS; step++)
+        status = execute_operation(simpletron);
+    return status;
+}
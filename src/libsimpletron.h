@@ -0,0 +1,19 @@
+#pragma once
+
+#include "simpletron.h"
+#include "engine.h"
+
+/*
+ * Interface for running Simpletron inside another program.
+ * Nothing is printed: program I/O goes through the given SimpletronIO,
+ * faults are kept in simpletron->fault and described with describe_fault.
+ * simpletron_run with a step limit executes instructions one at a time with
+ * execute_operation, engine must be NULL for it.
+ */
+
+extern const struct SimpletronIO silent_io;
+
+struct Simpletron *simpletron_new(const struct SimpletronIO *);
+void simpletron_free(struct Simpletron *);
+enum Load simpletron_load(struct Simpletron *, const char [], const size_t, size_t *);
+enum Status simpletron_run(struct Simpletron *, const struct Engine *, const unsigned long);
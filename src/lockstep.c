@@ -0,0 +1,324 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "simpletron.h"
+#include "decode.h"
+#include "lockstep.h"
+
+
+#if defined(__GNUC__)
+
+/* On x86-64 the execution loop is compiled for AVX2 too, the variant is selected at load time */
+#if defined(__x86_64__) && !defined(__clang__)
+#define VECTOR_TARGETS      __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_TARGETS
+#endif
+
+#define WORD_MAX            ((word_t) ((uword_t) -1 >> 1))
+
+/* Lanes waiting longer are not on the path of other lanes, they finish on their own */
+#define STALL_LIMIT         MEMORY_SIZE
+
+/* Takes value in lanes selected by mask, otherwise keeps the old one */
+#define SELECT(mask, value, otherwise)  (((mask) & (value)) | (~(mask) & (otherwise)))
+
+
+/* Checks if any lane of mask is set */
+static inline bool any_lane(const lanes_t *mask) {
+    uint64_t words[sizeof(lanes_t) / sizeof(uint64_t)];
+    uint64_t any = 0;
+    memcpy(words, mask, sizeof(lanes_t));
+    for (size_t idx = 0; idx < sizeof(lanes_t) / sizeof(uint64_t); idx++)
+        any |= words[idx];
+    return any != 0;
+}
+
+
+/* Copies machine to lane */
+static void insert_lane(
+    struct Lockstep *lockstep, struct Simpletron *simpletron, const size_t lane
+) {
+    lockstep->machines[lane] = simpletron;
+    lockstep->running[lane] = -1;
+    lockstep->waited[lane] = 0;
+    for (size_t address = 0; address < MEMORY_SIZE; address++)
+        lockstep->memory[address][lane] = simpletron->memory[address];
+    lockstep->accumulator[lane] = simpletron->accumulator;
+    lockstep->counter[lane] = simpletron->instruction_counter;
+    lockstep->last[lane] = simpletron->instruction_register;
+}
+
+
+/* Copies state of lane back to its machine, which is executed on its own from now on.
+ * Registers are decoded from the last instruction */
+static struct Simpletron *drop_lane(struct Lockstep *lockstep, const size_t lane) {
+    struct Simpletron *simpletron = lockstep->machines[lane];
+    for (size_t address = 0; address < MEMORY_SIZE; address++)
+        simpletron->memory[address] = lockstep->memory[address][lane];
+    simpletron->accumulator = lockstep->accumulator[lane];
+    simpletron->instruction_counter = lockstep->counter[lane];
+    const struct DecodedInstruction instruction = decode_word(lockstep->last[lane]);
+    simpletron->instruction_register = instruction.instruction_register;
+    if (instruction.operation_code != NEGATIVE_WORD) {
+        simpletron->operation_code = instruction.operation_code;
+        simpletron->operand = instruction.operand;
+    }
+    lockstep->running[lane] = 0;
+    lockstep->dropped = true;
+    return simpletron;
+}
+
+
+/* Finishes lanes in mask with fault */
+static void fault_lanes(struct Lockstep *lockstep, const lanes_t *mask, const enum Fault reason) {
+    for (size_t lane = 0; lane < LANES; lane++) {
+        if ((*mask)[lane])
+            lockstep->statuses[lane] = fault(drop_lane(lockstep, lane), reason);
+    }
+}
+
+
+/* Gives free lanes to the next machines of source */
+static void refill_lanes(struct Lockstep *lockstep, lane_source_t source, void *context) {
+    for (size_t lane = 0; lane < LANES; lane++) {
+        if (lockstep->running[lane] || lockstep->machines[lane] == NULL)
+            continue;
+        struct Simpletron *simpletron = source(
+            context, lane, lockstep->machines[lane], lockstep->statuses[lane]
+        );
+        lockstep->machines[lane] = NULL;
+        if (simpletron != NULL)
+            insert_lane(lockstep, simpletron, lane);
+    }
+    lockstep->dropped = false;
+}
+
+
+/*
+ * Executes one instruction in lanes selected by mask, all of them have the same word at
+ * the same address. Returns false if lanes have to execute the instruction on their own.
+ */
+static inline bool step(
+    struct Lockstep *lockstep, const lanes_t *lanes_mask, const word_t word, const word_t address
+) {
+    const struct DecodedInstruction instruction = decode_word(word);
+    const lanes_t mask = *lanes_mask;
+    const lanes_t cell = lockstep->memory[instruction.operand];
+    const lanes_t accumulator = lockstep->accumulator;
+    const lanes_t zero = {0};
+    lanes_t faults;
+
+    switch (instruction.operation_code) {
+        case READSTR:
+        case WRITESTR:
+            return false;
+        case NEGATIVE_WORD:
+            /* execute_operation keeps registers of previous instruction */
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (mask[lane]) {
+                    struct Simpletron *simpletron = drop_lane(lockstep, lane);
+                    simpletron->instruction_counter = address + 1;
+                    simpletron->instruction_register = word;
+                    lockstep->statuses[lane] = fault(simpletron, FAULT_INSTRUCTION);
+                }
+            }
+            return true;
+        default:
+            break;
+    }
+
+    lockstep->counter = SELECT(mask, zero + (word_t) (address + 1), lockstep->counter);
+    lockstep->last = SELECT(mask, zero + word, lockstep->last);
+    switch (instruction.operation_code) {
+        case NOP:
+            break;
+        case READ:
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (!mask[lane])
+                    continue;
+                const struct SimpletronIO *io = lockstep->machines[lane]->io;
+                word_t value = cell[lane];
+                const enum Status status = io->read_value(io->context, &value);
+                lockstep->memory[instruction.operand][lane] = value;
+                if (status == SUSPEND) {
+                    drop_lane(lockstep, lane)->instruction_counter = address;
+                    lockstep->statuses[lane] = SUSPEND;
+                } else if (status != SUCCESS) {
+                    lockstep->statuses[lane] = fault(drop_lane(lockstep, lane), FAULT_INPUT);
+                }
+            }
+            break;
+        case WRITE:
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (!mask[lane])
+                    continue;
+                const struct SimpletronIO *io = lockstep->machines[lane]->io;
+                io->write_value(io->context, cell[lane]);
+            }
+            break;
+        case LOAD:
+            lockstep->accumulator = SELECT(mask, cell, accumulator);
+            break;
+        case STORE:
+            lockstep->memory[instruction.operand] = SELECT(mask, accumulator, cell);
+            break;
+        case ADD:
+            lockstep->accumulator = SELECT(mask, accumulator + cell, accumulator);
+            break;
+        case SUBTRACT:
+            lockstep->accumulator = SELECT(mask, cell - accumulator, accumulator);
+            break;
+        case MULTIPLY:
+            lockstep->accumulator = SELECT(mask, accumulator * cell, accumulator);
+            break;
+        case DIVIDE:
+        case REMAINDER:
+            faults = mask & (accumulator == 0);
+            fault_lanes(lockstep, &faults, FAULT_DIVISION);
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (mask[lane] && !faults[lane])
+                    lockstep->accumulator[lane] = (
+                        instruction.operation_code == DIVIDE
+                        ? cell[lane] / accumulator[lane] : cell[lane] % accumulator[lane]
+                    );
+            }
+            break;
+        case POWER:
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (mask[lane])
+                    lockstep->accumulator[lane] = (word_t) pow(cell[lane], accumulator[lane]);
+            }
+            break;
+        case BRANCH:
+            lockstep->counter = SELECT(mask, zero + instruction.operand, lockstep->counter);
+            break;
+        case BRANCHNEG:
+            lockstep->counter = SELECT(
+                mask & (accumulator < 0), zero + instruction.operand, lockstep->counter
+            );
+            break;
+        case BRANCHZERO:
+            lockstep->counter = SELECT(
+                mask & (accumulator == 0), zero + instruction.operand, lockstep->counter
+            );
+            break;
+        case HALT:
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (mask[lane])
+                    lockstep->statuses[lane] = halt(drop_lane(lockstep, lane));
+            }
+            break;
+        default:
+            fault_lanes(lockstep, &mask, FAULT_INSTRUCTION);
+            break;
+    }
+    return true;
+}
+
+
+/*
+ * Executes lanes until source has no more machines. Every step executes lanes with
+ * the lowest instruction counter that have the same word there, so lanes following
+ * the same path execute together, lanes that diverged at a branch and new machines
+ * join the others when their counters meet. Lanes left behind for STALL_LIMIT steps,
+ * like lanes which exited a loop others still execute, are finished by run_decoded.
+ */
+VECTOR_TARGETS
+static void run_lanes(struct Lockstep *lockstep, lane_source_t source, void *context) {
+    const lanes_t zero = {0};
+    size_t leader = 0;
+
+    for (;;) {
+        if (lockstep->dropped)
+            refill_lanes(lockstep, source, context);
+        if (!lockstep->running[leader]) {
+            for (leader = 0; leader < LANES && !lockstep->running[leader]; leader++);
+            if (leader == LANES)
+                break;
+        }
+
+        word_t address = lockstep->counter[leader];
+        lanes_t mask = lockstep->running & (lockstep->counter == zero + address);
+        const lanes_t waiting = lockstep->running & ~mask;
+        if (any_lane(&waiting)) {
+            word_t counters[LANES];
+            const lanes_t candidates = SELECT(
+                lockstep->running, lockstep->counter, zero + WORD_MAX
+            );
+            memcpy(counters, &candidates, sizeof(lanes_t));
+            for (size_t lane = 0; lane < LANES; lane++)
+                address = counters[lane] < address ? counters[lane] : address;
+            mask = lockstep->running & (lockstep->counter == zero + address);
+        }
+        if (address < 0 || address >= MEMORY_SIZE) {
+            fault_lanes(lockstep, &mask, FAULT_COUNTER);
+            continue;
+        }
+
+        /* Lanes which modified the word wait for the next step */
+        size_t first = 0;
+        for (; !mask[first]; first++);
+        const word_t word = lockstep->memory[address][first];
+        mask &= lockstep->memory[address] == zero + word;
+
+        const lanes_t left = lockstep->running & ~mask;
+        if (!any_lane(&left)) {
+            lockstep->waited = zero;
+        } else {
+            lockstep->waited = SELECT(left, lockstep->waited + 1, zero);
+            const lanes_t stalled = lockstep->waited > zero + STALL_LIMIT;
+            if (any_lane(&stalled)) {
+                for (size_t lane = 0; lane < LANES; lane++) {
+                    if (stalled[lane])
+                        lockstep->statuses[lane] = run_decoded(drop_lane(lockstep, lane));
+                }
+            }
+        }
+
+        if (!step(lockstep, &mask, word, address)) {
+            for (size_t lane = 0; lane < LANES; lane++) {
+                if (mask[lane])
+                    lockstep->statuses[lane] = run_decoded(drop_lane(lockstep, lane));
+            }
+        }
+    }
+}
+
+
+/*
+ * Runs machines of source in lockstep, all of them have to be loaded with the same
+ * program. I/O goes through io of every machine. Machines leave their lanes on HALT
+ * and faults, machines reaching READSTR or WRITESTR or stalled finish with run_decoded.
+ * Final state of every machine is the same as when run alone.
+ */
+void run_lockstep(lane_source_t source, void *context) {
+    struct Lockstep *lockstep = malloc(sizeof(struct Lockstep));
+    if (lockstep == NULL) {
+        struct Simpletron *simpletron = source(context, 0, NULL, STOP);
+        while (simpletron != NULL)
+            simpletron = source(context, 0, simpletron, run_decoded(simpletron));
+        return;
+    }
+
+    for (size_t lane = 0; lane < LANES; lane++) {
+        lockstep->running[lane] = 0;
+        lockstep->machines[lane] = source(context, lane, NULL, STOP);
+        if (lockstep->machines[lane] != NULL)
+            insert_lane(lockstep, lockstep->machines[lane], lane);
+    }
+    lockstep->dropped = false;
+    run_lanes(lockstep, source, context);
+    free(lockstep);
+}
+
+#else
+
+/* Without vector extensions machines are run one after another */
+void run_lockstep(lane_source_t source, void *context) {
+    struct Simpletron *simpletron = source(context, 0, NULL, STOP);
+    while (simpletron != NULL)
+        simpletron = source(context, 0, simpletron, run_decoded(simpletron));
+}
+
+#endif
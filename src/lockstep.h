@@ -0,0 +1,34 @@
+#pragma once
+
+#include "simpletron.h"
+
+
+#define LANES               (32 / sizeof(word_t))  /* machines in one 256-bit vector */
+
+/*
+ * Source of machines for lockstep execution. Gets lane, machine which left it (NULL at
+ * start) with its status, returns machine to run in the lane next, NULL if there are none.
+ */
+typedef struct Simpletron *(*lane_source_t)(
+    void *, const size_t, struct Simpletron *, const enum Status
+);
+
+#if defined(__GNUC__)
+typedef word_t lanes_t __attribute__((vector_size(32)));
+
+/* Machines executed together, memory cell and registers of all lanes are side by side */
+struct Lockstep {
+    lanes_t             memory[MEMORY_SIZE];
+    lanes_t             accumulator;
+    lanes_t             counter;                /* instruction counters */
+    lanes_t             last;                   /* the last executed instructions */
+    lanes_t             running;                /* -1 while lane is executed, else 0 */
+    lanes_t             waited;                 /* steps since lane was executed */
+    struct Simpletron   *machines[LANES];       /* machine of lane, NULL if lane is free */
+    enum Status         statuses[LANES];        /* status of machine which left lane */
+    bool                dropped;                /* some lanes wait for next machine */
+};
+#endif
+
+
+void run_lockstep(lane_source_t, void *);
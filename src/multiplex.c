@@ -0,0 +1,392 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "simpletron.h"
+#include "libsimpletron.h"
+#include "multiplex.h"
+
+
+static void append_output(struct Session *session, const char string[], const size_t length) {
+    if (session->output_size + length > session->output_capacity) {
+        size_t capacity = session->output_capacity == 0 ? 256 : session->output_capacity;
+        while (session->output_size + length > capacity)
+            capacity *= 2;
+        char *output = realloc(session->output, capacity);
+        if (output == NULL)
+            return;
+        session->output = output;
+        session->output_capacity = capacity;
+    }
+    memcpy(session->output + session->output_size, string, length);
+    session->output_size += length;
+}
+
+
+/* Takes the next line of input without newline. Incomplete line is taken only if
+ * buffer is full or input is closed */
+static bool take_line(struct Session *session, char line[], size_t *length) {
+    const char *newline = memchr(session->input, '\n', session->input_size);
+    size_t taken = session->input_size;
+    if (newline != NULL)
+        taken = newline - session->input + 1;
+    else if (session->input_size < SESSION_INPUT_SIZE && !session->input_closed)
+        return false;
+    if (taken == 0)
+        return false;
+
+    *length = newline != NULL ? taken - 1 : taken;
+    if (*length > 0 && session->input[*length - 1] == '\r')
+        (*length)--;
+    memcpy(line, session->input, *length);
+    line[*length] = '\0';
+    memmove(session->input, session->input + taken, session->input_size - taken);
+    session->input_size -= taken;
+    session->prompted = false;
+    return true;
+}
+
+
+static void prompt(struct Session *session) {
+    if (!session->prompted)
+        append_output(session, "<- ", 3);
+    session->prompted = true;
+}
+
+
+static enum Status session_read_value(void *context, word_t *value) {
+    struct Session *session = context;
+    char line[SESSION_INPUT_SIZE + 1], *end;
+    size_t length;
+
+    prompt(session);
+    if (!take_line(session, line, &length))
+        return session->input_closed ? FAIL : SUSPEND;
+    const long parsed_input = strtol(line, &end, 0);
+    if (end == line || parsed_input != (dword_t) parsed_input || !check_value(parsed_input))
+        return FAIL;
+    *value = (word_t) parsed_input;
+    return SUCCESS;
+}
+
+
+static void session_write_value(void *context, const word_t value) {
+    char string[WORD_BITS / 3 + 8];
+    append_output(context, string, sprintf(string, "-> %+0*d\n", WORD_BITS / 4 + 1, value));
+}
+
+
+static size_t session_read_string(void *context, char string[], const size_t size) {
+    struct Session *session = context;
+    char line[SESSION_INPUT_SIZE + 1];
+    size_t length;
+
+    prompt(session);
+    if (!take_line(session, line, &length))
+        return session->input_closed ? 0 : SUSPENDED;
+    length = length < size ? length : size;
+    memcpy(string, line, length);
+    return length;
+}
+
+
+static void session_write_string(void *context, const char string[]) {
+    append_output(context, "-> ", 3);
+    append_output(context, string, strlen(string));
+    append_output(context, "\n", 1);
+}
+
+
+static void session_report(void *context, const enum Status status, const char message[]) {
+    (void) status;
+    append_output(context, message, strlen(message));
+}
+
+
+/* Interactive channel of session, context is the session */
+static const struct SimpletronIO session_io = {
+    .read_value=session_read_value,
+    .write_value=session_write_value,
+    .read_string=session_read_string,
+    .write_string=session_write_string,
+    .report=session_report,
+    .context=NULL
+};
+
+
+static bool set_nonblocking(const int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+
+static void enqueue(struct Session *session) {
+    struct Multiplexer *multiplexer = session->multiplexer;
+    if (session->queued)
+        return;
+    session->queued = true;
+    session->next = NULL;
+    if (multiplexer->last == NULL)
+        multiplexer->first = session;
+    else
+        multiplexer->last->next = session;
+    multiplexer->last = session;
+}
+
+
+static struct Session *dequeue(struct Multiplexer *multiplexer) {
+    struct Session *session = multiplexer->first;
+    multiplexer->first = session->next;
+    if (multiplexer->first == NULL)
+        multiplexer->last = NULL;
+    session->queued = false;
+    return session;
+}
+
+
+/* Session is freed from run queue, after all events which may refer to it are handled */
+static void drop_session(struct Session *session) {
+    session->closing = true;
+    enqueue(session);
+}
+
+
+static void free_session(struct Session *session) {
+    struct Multiplexer *multiplexer = session->multiplexer;
+    epoll_ctl(multiplexer->epoll_fd, EPOLL_CTL_DEL, session->input_fd, NULL);
+    if (session->output_fd != session->input_fd)
+        epoll_ctl(multiplexer->epoll_fd, EPOLL_CTL_DEL, session->output_fd, NULL);
+    close(session->input_fd);
+    if (session->output_fd != session->input_fd)
+        close(session->output_fd);
+    free(session->output);
+    free(session);
+    multiplexer->sessions--;
+}
+
+
+/* Registers file descriptors of session for events it waits for: input while there is
+ * room for it, output while there is unsent output. Socket stays registered for errors */
+static void update_events(struct Session *session) {
+    const int epoll_fd = session->multiplexer->epoll_fd;
+    const bool input = !session->input_closed && session->input_size < SESSION_INPUT_SIZE;
+    const bool output = session->output_sent < session->output_size;
+    struct epoll_event event = {.data.ptr=session};
+
+    if (session->output_fd == session->input_fd) {
+        if (input != session->input_watched || output != session->output_watched) {
+            event.events = (input ? EPOLLIN : 0) | (output ? EPOLLOUT : 0);
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->input_fd, &event);
+        }
+    } else {
+        if (input != session->input_watched) {
+            event.events = EPOLLIN;
+            epoll_ctl(epoll_fd, input ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, session->input_fd, &event);
+        }
+        if (output != session->output_watched) {
+            event.events = EPOLLOUT;
+            epoll_ctl(
+                epoll_fd, output ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, session->output_fd, &event
+            );
+        }
+    }
+    session->input_watched = input;
+    session->output_watched = output;
+}
+
+
+/* Sends as much output as peer takes. Finished session is closed when all is sent,
+ * running session is queued unless peer lags SESSION_OUTPUT_LIMIT behind */
+static void flush_output(struct Session *session) {
+    while (session->output_sent < session->output_size) {
+        const ssize_t sent = write(
+            session->output_fd, session->output + session->output_sent,
+            session->output_size - session->output_sent
+        );
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent < 0) {
+            drop_session(session);
+            return;
+        }
+        session->output_sent += sent;
+    }
+    update_events(session);
+    const size_t unsent = session->output_size - session->output_sent;
+    if (unsent == 0)
+        session->output_size = session->output_sent = 0;
+    if (session->status == STOP || session->status == FAIL) {
+        if (unsent == 0)
+            drop_session(session);
+    } else if (session->status == SUCCESS && unsent <= SESSION_OUTPUT_LIMIT) {
+        enqueue(session);
+    }
+}
+
+
+/* Reads available input. Suspended session runs again once input arrives or is closed */
+static void receive_input(struct Session *session) {
+    while (session->input_size < SESSION_INPUT_SIZE) {
+        const ssize_t received = read(
+            session->input_fd, session->input + session->input_size,
+            SESSION_INPUT_SIZE - session->input_size
+        );
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (received <= 0) {
+            session->input_closed = true;
+            break;
+        }
+        session->input_size += received;
+    }
+    update_events(session);
+    if (session->status == SUSPEND) {
+        session->status = SUCCESS;
+        enqueue(session);
+    }
+}
+
+
+/* Runs session for one slice, program output is sent after it */
+static void run_slice(struct Session *session) {
+    session->status = simpletron_run(&session->simpletron, NULL, SESSION_SLICE);
+    flush_output(session);  /* Also registers for input consumed by the slice */
+}
+
+
+/* Creates session of listening multiplexer for every pending connection */
+static void accept_sessions(struct Multiplexer *multiplexer) {
+    for (;;) {
+        const int fd = accept(multiplexer->listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        if (add_session(multiplexer, fd, fd) == NULL) {
+            close(fd);
+            fputs("Error creating session\n", stderr);
+        }
+    }
+}
+
+
+/* Sessions run copies of program. New sessions are accepted from listen_fd, if it is
+ * not -1 */
+bool init_multiplexer(
+    struct Multiplexer *multiplexer, const struct Simpletron *program, const int listen_fd
+) {
+    memset(multiplexer, 0, sizeof(struct Multiplexer));
+    multiplexer->program = program;
+    multiplexer->listen_fd = listen_fd;
+    multiplexer->epoll_fd = epoll_create1(0);
+    if (multiplexer->epoll_fd < 0)
+        return false;
+    if (listen_fd < 0)
+        return true;
+
+    struct epoll_event event = {.events=EPOLLIN, .data.ptr=NULL};
+    return set_nonblocking(listen_fd)
+        && epoll_ctl(multiplexer->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == 0;
+}
+
+
+/* Starts session reading from input_fd and writing to output_fd, which may be the same
+ * socket. Descriptors are closed with session */
+struct Session *add_session(
+    struct Multiplexer *multiplexer, const int input_fd, const int output_fd
+) {
+    struct Session *session = calloc(1, sizeof(struct Session));
+    if (session == NULL)
+        return NULL;
+    if (!set_nonblocking(input_fd) || !set_nonblocking(output_fd)) {
+        free(session);
+        return NULL;
+    }
+    session->multiplexer = multiplexer;
+    session->simpletron = *multiplexer->program;
+    session->io = session_io;
+    session->io.context = session;
+    session->simpletron.io = &session->io;
+    session->input_fd = input_fd;
+    session->output_fd = output_fd;
+    session->status = SUCCESS;
+    session->input_watched = true;
+
+    struct epoll_event event = {.events=EPOLLIN, .data.ptr=session};
+    if (epoll_ctl(multiplexer->epoll_fd, EPOLL_CTL_ADD, input_fd, &event) != 0) {
+        free(session);
+        return NULL;
+    }
+    multiplexer->sessions++;
+    enqueue(session);
+    return session;
+}
+
+
+/*
+ * Serves sessions until all of them terminate and there is no listening socket.
+ * Events are handled first, then every runnable session gets one slice, so one thread
+ * serves any number of sessions waiting for input. Returns false on epoll error.
+ */
+bool run_multiplexer(struct Multiplexer *multiplexer) {
+    struct epoll_event events[MULTIPLEX_EVENTS];
+
+    while (multiplexer->sessions > 0 || multiplexer->listen_fd >= 0) {
+        const int ready = epoll_wait(
+            multiplexer->epoll_fd, events, MULTIPLEX_EVENTS, multiplexer->first != NULL ? 0 : -1
+        );
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            return false;
+
+        for (int idx = 0; idx < ready; idx++) {
+            struct Session *session = events[idx].data.ptr;
+            const uint32_t flags = events[idx].events;
+            if (session == NULL) {
+                accept_sessions(multiplexer);
+                continue;
+            }
+            if (session->closing)
+                continue;
+            if ((flags & (EPOLLIN | EPOLLHUP)) && !session->input_closed)
+                receive_input(session);
+            if (flags & EPOLLOUT)
+                flush_output(session);
+            /* Peer is gone, output can not be delivered */
+            if (
+                (flags & EPOLLERR)
+                || ((flags & EPOLLHUP) && session->output_fd == session->input_fd)
+            )
+                drop_session(session);
+        }
+
+        /* Sessions queued during the round run in the next one */
+        for (const struct Session *last = multiplexer->last; multiplexer->first != NULL;) {
+            struct Session *session = dequeue(multiplexer);
+            const bool round_end = session == last;
+            if (session->closing)
+                free_session(session);
+            else
+                run_slice(session);
+            if (round_end)
+                break;
+        }
+    }
+    return true;
+}
+
+
+void close_multiplexer(struct Multiplexer *multiplexer) {
+    while (multiplexer->first != NULL)
+        free_session(dequeue(multiplexer));
+    if (multiplexer->listen_fd >= 0)
+        close(multiplexer->listen_fd);
+    close(multiplexer->epoll_fd);
+}
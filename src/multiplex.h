@@ -0,0 +1,51 @@
+#pragma once
+
+#include "simpletron.h"
+
+
+#define SESSION_SLICE       4096          /* instructions a session runs before others get turn */
+#define SESSION_INPUT_SIZE  (STRING_LENGTH + 1)
+#define SESSION_OUTPUT_LIMIT (1 << 16)    /* session with more unsent output waits for peer */
+#define MULTIPLEX_EVENTS    256
+
+/*
+ * Interactive session: machine reading lines from input_fd and writing to output_fd, in
+ * the format of interactive_io. READ without complete line of input suspends the session
+ * until more input arrives.
+ */
+struct Session {
+    struct Multiplexer          *multiplexer;
+    struct Simpletron           simpletron;
+    struct SimpletronIO         io;
+    int                         input_fd;
+    int                         output_fd;      /* may be the same as input_fd */
+    char                        input[SESSION_INPUT_SIZE];
+    size_t                      input_size;
+    bool                        input_closed;
+    bool                        prompted;       /* prompt of pending READ is written */
+    char                        *output;
+    size_t                      output_size;
+    size_t                      output_sent;
+    size_t                      output_capacity;
+    bool                        input_watched;  /* registered for events of input_fd */
+    bool                        output_watched; /* registered for output_fd to be writable */
+    enum Status                 status;         /* SUCCESS runnable, SUSPEND waits for input */
+    struct Session              *next;          /* in run queue */
+    bool                        queued;
+    bool                        closing;        /* freed when taken from run queue */
+};
+
+/* Sessions served from one thread, runnable ones take turns of SESSION_SLICE instructions */
+struct Multiplexer {
+    int                         epoll_fd;
+    int                         listen_fd;      /* new sessions are accepted from it, or -1 */
+    const struct Simpletron     *program;       /* loaded image, copied for every session */
+    struct Session              *first;         /* run queue */
+    struct Session              *last;
+    size_t                      sessions;
+};
+
+bool init_multiplexer(struct Multiplexer *, const struct Simpletron *, const int);
+struct Session *add_session(struct Multiplexer *, const int, const int);
+bool run_multiplexer(struct Multiplexer *);
+void close_multiplexer(struct Multiplexer *);
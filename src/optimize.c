@@ -0,0 +1,529 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simpletron.h"
+#include "translator.h"
+#include "optimize.h"
+
+
+#define LIVENESS_LIMIT      (1 << 22)   /* uint64_t in live sets of all blocks */
+
+
+static word_t opcode_of(const word_t instruction) {
+    return (uword_t) instruction >> OPERAND_BITS;
+}
+
+
+static size_t operand_of(const word_t instruction) {
+    return (uword_t) instruction & ((1 << OPERAND_BITS) - 1);
+}
+
+
+static bool is_branch(const word_t instruction) {
+    const word_t opcode = opcode_of(instruction);
+    return opcode == BRANCH || opcode == BRANCHNEG || opcode == BRANCHZERO;
+}
+
+
+static size_t next_live(const bool removed[], size_t address, const size_t size) {
+    while (address < size && removed[address])
+        address++;
+    return address;
+}
+
+
+/* Returns the instruction executed after jump to address: removed instructions are
+ * skipped, chains of BRANCH are followed. Loops of BRANCH stop at their first one */
+static size_t resolve(
+    const word_t code[], const bool removed[], size_t address, const size_t size
+) {
+    for (size_t hops = 0; hops < size; hops++) {
+        address = next_live(removed, address, size);
+        if (address >= size || opcode_of(code[address]) != BRANCH)
+            return address;
+        const size_t target = operand_of(code[address]);
+        if (next_live(removed, target, size) == address)
+            return address;
+        address = target;
+    }
+    return address;
+}
+
+
+/* Returns where execution goes when conditional branch to target at address is not
+ * taken and the result is still target: following branches to the same target are
+ * passed, as they either go there or fall through */
+static size_t fall_through(
+    const word_t code[], const bool removed[], size_t address, const size_t target,
+    const size_t size
+) {
+    for (size_t hops = 0; hops < size; hops++) {
+        address = resolve(code, removed, address + 1, size);
+        if (
+            address >= size || opcode_of(code[address]) == BRANCH || !is_branch(code[address])
+            || resolve(code, removed, operand_of(code[address]), size) != target
+        )
+            return address;
+    }
+    return address;
+}
+
+
+/* One round of rewriting, returns true if anything changed */
+static bool rewrite(word_t code[], bool removed[], bool targets[], const size_t size) {
+    bool changed = false;
+
+    for (size_t address = 0; address < size; address++)
+        targets[address] = false;
+    for (size_t address = 0; address < size; address++) {
+        if (removed[address] || !is_branch(code[address]))
+            continue;
+        const size_t target = resolve(code, removed, operand_of(code[address]), size);
+        if (target < size)
+            targets[target] = true;
+    }
+
+    for (size_t address = 0; address < size; address++) {
+        if (removed[address])
+            continue;
+        const word_t instruction = code[address];
+        const word_t opcode = opcode_of(instruction);
+
+        if (is_branch(instruction)) {
+            /* Jump threading */
+            const size_t target = resolve(code, removed, operand_of(instruction), size);
+            if (target != operand_of(instruction) && target < size) {
+                code[address] = opcode << OPERAND_BITS | target;
+                changed = true;
+            }
+            /* Branch to where execution goes anyway */
+            const size_t next = opcode == BRANCH
+                ? resolve(code, removed, address + 1, size)
+                : fall_through(code, removed, address, target, size);
+            if (target == next && target != address) {
+                removed[address] = true;
+                changed = true;
+            }
+        } else if (opcode == STORE) {
+            /* STORE t; LOAD t: accumulator already holds t */
+            const size_t next = next_live(removed, address + 1, size);
+            if (
+                next < size && !targets[next] && opcode_of(code[next]) == LOAD
+                && operand_of(code[next]) == operand_of(instruction)
+            ) {
+                removed[next] = true;
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+
+static bool is_data_access(const word_t instruction) {
+    switch (opcode_of(instruction)) {
+        case READ: case WRITE: case LOAD: case STORE: case ADD: case SUBTRACT: case DIVIDE:
+        case MULTIPLY: case REMAINDER: case POWER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/* Sets of live values: bit 0 is accumulator, bit 1 + index is data word words[index] */
+struct Liveness {
+    size_t          *words;     /* sorted addresses of data used by code */
+    size_t          num_words;
+    size_t          set_size;   /* uint64_t in one set */
+};
+
+
+static int compare_addresses(const void *first, const void *second) {
+    const size_t a = *(const size_t *) first, b = *(const size_t *) second;
+    return (a > b) - (a < b);
+}
+
+
+static size_t value_bit(const struct Liveness *liveness, const word_t instruction) {
+    const size_t address = operand_of(instruction);
+    const size_t *word = bsearch(
+        &address, liveness->words, liveness->num_words, sizeof(size_t), compare_addresses
+    );
+    return 1 + (word - liveness->words);
+}
+
+
+static void set_bit(uint64_t set[], const size_t bit, const bool value) {
+    if (value)
+        set[bit / 64] |= (uint64_t) 1 << bit % 64;
+    else
+        set[bit / 64] &= ~((uint64_t) 1 << bit % 64);
+}
+
+
+static bool get_bit(const uint64_t set[], const size_t bit) {
+    return set[bit / 64] >> bit % 64 & 1;
+}
+
+
+/* Checks if instruction only computes value which is not used later. Division and
+ * remainder are kept, they fault on zero divisor */
+static bool is_dead(
+    const struct Liveness *liveness, const word_t instruction, const uint64_t live[]
+) {
+    switch (opcode_of(instruction)) {
+        case STORE:
+            return !get_bit(live, value_bit(liveness, instruction));
+        case LOAD: case ADD: case SUBTRACT: case MULTIPLY: case POWER:
+            return !get_bit(live, 0);
+        default:
+            return false;
+    }
+}
+
+
+/* Changes set of values live after instruction to set of values live before it */
+static void transfer(
+    const struct Liveness *liveness, const word_t instruction, uint64_t live[]
+) {
+    switch (opcode_of(instruction)) {
+        case READ:
+            set_bit(live, value_bit(liveness, instruction), false);
+            break;
+        case WRITE:
+            set_bit(live, value_bit(liveness, instruction), true);
+            break;
+        case LOAD:
+            set_bit(live, 0, false);
+            set_bit(live, value_bit(liveness, instruction), true);
+            break;
+        case STORE:
+            set_bit(live, value_bit(liveness, instruction), false);
+            set_bit(live, 0, true);
+            break;
+        case ADD: case SUBTRACT: case DIVIDE: case MULTIPLY: case REMAINDER: case POWER:
+            set_bit(live, 0, true);
+            set_bit(live, value_bit(liveness, instruction), true);
+            break;
+        case BRANCHNEG: case BRANCHZERO:
+            set_bit(live, 0, true);
+            break;
+        case NOP: case BRANCH: case HALT:
+            break;
+        default:
+            memset(live, 0xFF, liveness->set_size * sizeof(uint64_t));
+    }
+}
+
+
+/* Marks instructions which can not be reached from address 0 */
+static bool mark_unreachable(const word_t code[], bool removed[], const size_t size) {
+    size_t *stack = malloc((2 * size + 1) * sizeof(size_t)), stack_size = 0;
+    if (stack == NULL)
+        return false;
+    for (size_t address = 0; address < size; address++)
+        removed[address] = true;
+
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        const size_t address = stack[--stack_size];
+        if (address >= size || !removed[address])
+            continue;
+        removed[address] = false;
+        const word_t opcode = opcode_of(code[address]);
+        if (is_branch(code[address]))
+            stack[stack_size++] = operand_of(code[address]);
+        if (opcode != BRANCH && opcode != HALT)
+            stack[stack_size++] = address + 1;
+    }
+    free(stack);
+    return true;
+}
+
+
+/* Block of reachable instructions from start to end, entered only at start */
+struct Block {
+    size_t          start;
+    size_t          end;
+    size_t          successors[2];
+    size_t          num_successors;
+    bool            leaves;     /* execution may go past code, everything is live there */
+};
+
+
+/* Splits reachable code to blocks at branch targets and after branches */
+static size_t split_blocks(
+    const word_t code[], const bool removed[], const size_t size, struct Block blocks[],
+    size_t block_of[]
+) {
+    bool *leader = calloc(size + 1, sizeof(bool));
+    size_t num_blocks = 0;
+    if (leader == NULL)
+        return 0;
+    for (size_t address = 0; address < size; address++) {
+        const word_t opcode = opcode_of(code[address]);
+        if (removed[address])
+            continue;
+        if (is_branch(code[address]) && operand_of(code[address]) < size)
+            leader[operand_of(code[address])] = true;
+        if (is_branch(code[address]) || opcode == HALT)
+            leader[address + 1] = true;
+    }
+    for (size_t address = 0; address < size; address++) {
+        if (removed[address])
+            continue;
+        if (address == 0 || leader[address] || removed[address - 1])
+            blocks[num_blocks++] = (struct Block) {.start=address};
+        block_of[address] = num_blocks - 1;
+        blocks[num_blocks - 1].end = address + 1;
+    }
+    free(leader);
+
+    for (size_t idx = 0; idx < num_blocks; idx++) {
+        struct Block *block = &blocks[idx];
+        const word_t last = code[block->end - 1];
+        const word_t opcode = opcode_of(last);
+        size_t next[2], num_next = 0;
+        if (is_branch(last))
+            next[num_next++] = operand_of(last);
+        if (opcode != BRANCH && opcode != HALT)
+            next[num_next++] = block->end;
+        for (size_t succ = 0; succ < num_next; succ++) {
+            if (next[succ] >= size)
+                block->leaves = true;
+            else
+                block->successors[block->num_successors++] = block_of[next[succ]];
+        }
+    }
+    return num_blocks;
+}
+
+
+/* Collects addresses of data used by reachable code */
+static bool collect_words(
+    struct Liveness *liveness, const word_t code[], const bool removed[], const size_t size
+) {
+    liveness->words = malloc((size + 1) * sizeof(size_t));
+    liveness->num_words = 0;
+    if (liveness->words == NULL)
+        return false;
+    for (size_t address = 0; address < size; address++)
+        if (!removed[address] && is_data_access(code[address]))
+            liveness->words[liveness->num_words++] = operand_of(code[address]);
+    qsort(liveness->words, liveness->num_words, sizeof(size_t), compare_addresses);
+    size_t unique = 0;
+    for (size_t idx = 0; idx < liveness->num_words; idx++)
+        if (unique == 0 || liveness->words[unique - 1] != liveness->words[idx])
+            liveness->words[unique++] = liveness->words[idx];
+    liveness->num_words = unique;
+    liveness->set_size = (unique + 1 + 63) / 64;
+    return true;
+}
+
+
+/* Marks instructions computing values that are never used. Values live at the end of
+ * blocks are found by iterating to fixed point, then blocks are walked backwards */
+static void mark_dead_stores(
+    const word_t code[], bool removed[], const struct Block blocks[], const size_t num_blocks,
+    const struct Liveness *liveness
+) {
+    const size_t set_size = liveness->set_size;
+    if (num_blocks > LIVENESS_LIMIT / set_size)
+        return;
+    uint64_t *live_in = calloc(num_blocks * set_size, sizeof(uint64_t));
+    uint64_t *live = malloc(set_size * sizeof(uint64_t));
+    if (live_in == NULL || live == NULL) {
+        free(live_in);
+        free(live);
+        return;
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t idx = num_blocks; idx-- > 0;) {
+            const struct Block *block = &blocks[idx];
+            memset(live, block->leaves ? 0xFF : 0, set_size * sizeof(uint64_t));
+            for (size_t succ = 0; succ < block->num_successors; succ++)
+                for (size_t word = 0; word < set_size; word++)
+                    live[word] |= live_in[block->successors[succ] * set_size + word];
+            for (size_t address = block->end; address-- > block->start;)
+                transfer(liveness, code[address], live);
+            if (memcmp(live, &live_in[idx * set_size], set_size * sizeof(uint64_t)) != 0) {
+                memcpy(&live_in[idx * set_size], live, set_size * sizeof(uint64_t));
+                changed = true;
+            }
+        }
+    }
+
+    for (size_t idx = 0; idx < num_blocks; idx++) {
+        const struct Block *block = &blocks[idx];
+        memset(live, block->leaves ? 0xFF : 0, set_size * sizeof(uint64_t));
+        for (size_t succ = 0; succ < block->num_successors; succ++)
+            for (size_t word = 0; word < set_size; word++)
+                live[word] |= live_in[block->successors[succ] * set_size + word];
+        for (size_t address = block->end; address-- > block->start;) {
+            if (is_dead(liveness, code[address], live))
+                removed[address] = true;
+            else
+                transfer(liveness, code[address], live);
+        }
+    }
+    free(live_in);
+    free(live);
+}
+
+
+/* Drops removed instructions, the rest of code moves up. Jumps to removed instruction go
+ * to the next kept one, branch targets and line labels are moved. Returns number of
+ * removed words */
+static size_t compact(struct Program *program, const bool removed[], size_t moved[]) {
+    const size_t size = program->instruction_ptr;
+    word_t *code = program->code;
+
+    size_t kept = 0;
+    for (size_t address = 0; address <= size; address++) {
+        moved[address] = kept;
+        if (address < size && !removed[address])
+            kept++;
+    }
+    for (size_t address = 0; address < size; address++) {
+        if (removed[address])
+            continue;
+        word_t instruction = code[address];
+        if (is_branch(instruction)) {
+            const size_t target = operand_of(instruction);
+            if (target <= size)
+                instruction = opcode_of(instruction) << OPERAND_BITS | moved[target];
+        }
+        code[moved[address]] = instruction;
+    }
+    for (size_t entry = 0; entry < program->lookup_list_size; entry++) {
+        struct LookupListEntry *label = &program->lookup_list[entry];
+        if (label->type == LINE && label->address <= size)
+            label->address = moved[label->address];
+    }
+    program->instruction_ptr = kept;
+    return size - kept;
+}
+
+
+/*
+ * Rewrites resolved code of program: redundant LOAD after STORE to the same address is
+ * removed, branches to BRANCH go to its target, branches to where execution goes anyway
+ * are removed, including pairs of BRANCHZERO and BRANCHNEG to the same target. Returns
+ * number of removed words, 0 if memory for the pass could not be allocated.
+ */
+size_t peephole(struct Program *program) {
+    const size_t size = program->instruction_ptr;
+    bool *removed = calloc(size + 1, sizeof(bool));
+    bool *targets = calloc(size + 1, sizeof(bool));
+    size_t *moved = malloc((size + 1) * sizeof(size_t));
+    size_t saved = 0;
+    if (removed != NULL && targets != NULL && moved != NULL) {
+        while (rewrite(program->code, removed, targets, size));
+        saved = compact(program, removed, moved);
+    }
+    free(removed);
+    free(targets);
+    free(moved);
+    return saved;
+}
+
+
+/*
+ * Removes code which can not be reached from address 0, and instructions computing
+ * values which are never used: stores to words not read before the next store or HALT,
+ * loads and arithmetic whose accumulator is not used. Memory is not kept for the dump
+ * after HALT. If execution may run past the end of code, everything is live there.
+ * Returns number of removed words.
+ */
+size_t eliminate_dead_code(struct Program *program) {
+    const size_t size = program->instruction_ptr;
+    bool *removed = calloc(size + 1, sizeof(bool));
+    size_t *moved = malloc((size + 1) * sizeof(size_t));
+    struct Block *blocks = malloc((size + 1) * sizeof(struct Block));
+    struct Liveness liveness = {.words=NULL};
+    size_t saved = 0;
+
+    if (
+        removed != NULL && moved != NULL && blocks != NULL
+        && mark_unreachable(program->code, removed, size)
+    ) {
+        /* moved is free until compaction, it maps addresses to blocks */
+        const size_t num_blocks = split_blocks(program->code, removed, size, blocks, moved);
+        if (num_blocks > 0 && collect_words(&liveness, program->code, removed, size))
+            mark_dead_stores(program->code, removed, blocks, num_blocks, &liveness);
+        saved = compact(program, removed, moved);
+    }
+    free(removed);
+    free(moved);
+    free(blocks);
+    free(liveness.words);
+    return saved;
+}
+
+
+/*
+ * Lays out data of optimized program: words which code no longer refers to are dropped,
+ * the rest of variables and constants is packed from MEMORY_SIZE - 1 down in the order of
+ * allocation, and temporaries follow them. Returns number of freed words.
+ */
+size_t pack_data(struct Program *program) {
+    const size_t data_words = MEMORY_SIZE - 1 - program->constants_ptr;
+    const size_t words = data_words + program->stack_size;
+    const size_t lowest = MEMORY_SIZE - words;
+    bool *used = calloc(words + 1, sizeof(bool));
+    size_t *moved = malloc((words + 1) * sizeof(size_t));
+    if (used == NULL || moved == NULL) {
+        free(used);
+        free(moved);
+        return 0;
+    }
+
+    /* Words are numbered from MEMORY_SIZE - 1 down, as in data */
+    for (size_t address = 0; address < (size_t) program->instruction_ptr; address++) {
+        const word_t instruction = program->code[address];
+        if (is_data_access(instruction) && operand_of(instruction) >= lowest)
+            used[MEMORY_SIZE - 1 - operand_of(instruction)] = true;
+    }
+    size_t kept = 0, kept_data = 0;
+    for (size_t word = 0; word < words; word++) {
+        moved[word] = kept;
+        if (!used[word])
+            continue;
+        kept++;
+        if (word < data_words)
+            program->data[kept_data++] = program->data[word];
+    }
+
+    for (size_t address = 0; address < (size_t) program->instruction_ptr; address++) {
+        const word_t instruction = program->code[address];
+        if (is_data_access(instruction) && operand_of(instruction) >= lowest)
+            program->code[address] = opcode_of(instruction) << OPERAND_BITS
+                | (MEMORY_SIZE - 1 - moved[MEMORY_SIZE - 1 - operand_of(instruction)]);
+    }
+    for (size_t entry = 0; entry < program->lookup_list_size; entry++) {
+        struct LookupListEntry *object = &program->lookup_list[entry];
+        if (object->type == LINE)
+            continue;
+        const size_t word = MEMORY_SIZE - 1 - object->address;
+        object->address = used[word] ? MEMORY_SIZE - 1 - moved[word] : (size_t) OBJ_NOT_FOUND;
+    }
+    program->constants_ptr = MEMORY_SIZE - 1 - kept_data;
+    program->stack_size = kept - kept_data;
+    free(used);
+    free(moved);
+    return words - kept;
+}
+
+
+/* Runs peephole and dead code passes while they remove anything */
+void optimize(struct Program *program) {
+    size_t peephole_words, dead_words;
+    do {
+        peephole_words = peephole(program);
+        dead_words = eliminate_dead_code(program);
+        program->saved_words += peephole_words;
+        program->dead_words += dead_words;
+    } while (peephole_words > 0 || dead_words > 0);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include "translator.h"
+
+
+size_t peephole(struct Program *);
+size_t eliminate_dead_code(struct Program *);
+void optimize(struct Program *);
+size_t pack_data(struct Program *);
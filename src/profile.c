@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simpletron.h"
+#include "profile.h"
+
+
+static const char *opcode_names[OPCODES_SIZE] = {
+    [NOP]="NOP", [READ]="READ", [WRITE]="WRITE", [READSTR]="READSTR", [WRITESTR]="WRITESTR",
+    [LOAD]="LOAD", [STORE]="STORE", [ADD]="ADD", [SUBTRACT]="SUBTRACT", [DIVIDE]="DIVIDE",
+    [MULTIPLY]="MULTIPLY", [REMAINDER]="REMAINDER", [POWER]="POWER", [BRANCH]="BRANCH",
+    [BRANCHNEG]="BRANCHNEG", [BRANCHZERO]="BRANCHZERO", [HALT]="HALT"
+};
+
+
+void reset_profile(struct Profile *profile) {
+    memset(profile, 0, sizeof(struct Profile));
+}
+
+
+/* Name of operation code, invalid codes are named by their number */
+static const char *opcode_name(const size_t opcode, char buffer[]) {
+    if (opcode_names[opcode] != NULL)
+        return opcode_names[opcode];
+    sprintf(buffer, "INVALID_%02lX", (unsigned long) opcode);
+    return buffer;
+}
+
+
+/*
+ * Runs program with execute_operation, counting every executed instruction.
+ * Instruction is counted before it runs, so the one which faults is counted too.
+ * Kept apart from the engines, so they pay nothing for profiling.
+ */
+enum Status run_profiled(struct Simpletron *simpletron, struct Profile *profile) {
+    enum Status status;
+    do {
+        const word_t address = simpletron->instruction_counter;
+        if (address < 0 || address >= MEMORY_SIZE)
+            return execute_operation(simpletron);  /* nothing to count, faults */
+
+        const uint8_t operation_code = (uword_t) simpletron->memory[address] >> OPERAND_BITS;
+        profile->total++;
+        profile->opcodes[operation_code]++;
+        profile->addresses[address]++;
+        status = execute_operation(simpletron);
+        if (status == SUSPEND) {
+            /* READ runs again when input is ready and is counted then */
+            profile->total--;
+            profile->opcodes[operation_code]--;
+            profile->addresses[address]--;
+        }
+        if (status != SUCCESS)
+            break;
+        if (operation_code == BRANCHNEG || operation_code == BRANCHZERO) {
+            if (simpletron->instruction_counter != address + 1)
+                profile->taken[operation_code]++;
+            else
+                profile->not_taken[operation_code]++;
+        }
+    } while (status == SUCCESS);
+    return status;
+}
+
+
+static double percent(const unsigned long count, const unsigned long total) {
+    return total == 0 ? 0.0 : 100.0 * count / total;
+}
+
+
+/* Returns the most executed address not listed yet, MEMORY_SIZE if there are none */
+static size_t hottest_address(const struct Profile *profile, const bool listed[]) {
+    size_t hottest = MEMORY_SIZE;
+    for (size_t address = 0; address < MEMORY_SIZE; address++) {
+        if (
+            !listed[address] && profile->addresses[address] > 0
+            && (hottest == MEMORY_SIZE || profile->addresses[address] > profile->addresses[hottest])
+        )
+            hottest = address;
+    }
+    return hottest;
+}
+
+
+void write_profile_text(FILE *file, const struct Profile *profile) {
+    char name[OPCODE_NAME_LENGTH];
+    bool *listed = calloc(MEMORY_SIZE, sizeof(bool));  /* too large for stack with wide words */
+
+    fprintf(file, "\n*** Profile: %lu instructions executed ***\n", profile->total);
+    fprintf(file, "%-12s%12s%9s\n", "operation", "count", "%");
+    for (size_t opcode = 0; opcode < OPCODES_SIZE; opcode++) {
+        if (profile->opcodes[opcode] == 0)
+            continue;
+        fprintf(
+            file, "%-12s%12lu%8.2f%%", opcode_name(opcode, name), profile->opcodes[opcode],
+            percent(profile->opcodes[opcode], profile->total)
+        );
+        if (opcode == BRANCHNEG || opcode == BRANCHZERO)
+            fprintf(
+                file, "  taken %lu, not taken %lu",
+                profile->taken[opcode], profile->not_taken[opcode]
+            );
+        fputs("\n", file);
+    }
+
+    fprintf(file, "\n%-12s%12s%9s\n", "address", "count", "%");
+    for (size_t idx = 0; listed != NULL && idx < PROFILE_HOTTEST; idx++) {
+        const size_t address = hottest_address(profile, listed);
+        if (address == MEMORY_SIZE)
+            break;
+        listed[address] = true;
+        fprintf(
+            file, "%0*lX%*s%12lu%8.2f%%\n", MEM_ADDR_WIDTH, address, 12 - MEM_ADDR_WIDTH, "",
+            profile->addresses[address], percent(profile->addresses[address], profile->total)
+        );
+    }
+    free(listed);
+}
+
+
+void write_profile_json(FILE *file, const struct Profile *profile) {
+    char name[OPCODE_NAME_LENGTH];
+    const char *separator = "";
+
+    fprintf(file, "{\n  \"total\": %lu,\n  \"opcodes\": {", profile->total);
+    for (size_t opcode = 0; opcode < OPCODES_SIZE; opcode++) {
+        if (profile->opcodes[opcode] == 0)
+            continue;
+        fprintf(
+            file, "%s\n    \"%s\": %lu", separator, opcode_name(opcode, name),
+            profile->opcodes[opcode]
+        );
+        separator = ",";
+    }
+    fputs("\n  },\n  \"branches\": {", file);
+    separator = "";
+    const int branches[] = {BRANCHNEG, BRANCHZERO};
+    for (size_t idx = 0; idx < sizeof(branches) / sizeof(int); idx++) {
+        fprintf(
+            file, "%s\n    \"%s\": {\"taken\": %lu, \"not_taken\": %lu}", separator,
+            opcode_names[branches[idx]], profile->taken[branches[idx]],
+            profile->not_taken[branches[idx]]
+        );
+        separator = ",";
+    }
+    fputs("\n  },\n  \"addresses\": {", file);
+    separator = "";
+    for (size_t address = 0; address < MEMORY_SIZE; address++) {
+        if (profile->addresses[address] == 0)
+            continue;
+        fprintf(file, "%s\n    \"%lu\": %lu", separator, address, profile->addresses[address]);
+        separator = ",";
+    }
+    fputs("\n  }\n}\n", file);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+#include "simpletron.h"
+
+#define OPCODES_SIZE        (1 << OPCODE_BITS)
+#define PROFILE_HOTTEST     16  /* addresses listed in text report */
+#define OPCODE_NAME_LENGTH  16  /* INVALID_ and number of invalid operation code */
+
+
+/* Execution counters collected by run_profiled */
+struct Profile {
+    unsigned long total;                        /* executed instructions */
+    unsigned long opcodes[OPCODES_SIZE];        /* executions by operation code */
+    unsigned long addresses[MEMORY_SIZE];       /* executions by address of instruction */
+    unsigned long taken[OPCODES_SIZE];          /* conditional branches taken */
+    unsigned long not_taken[OPCODES_SIZE];      /* conditional branches not taken */
+};
+
+
+void reset_profile(struct Profile *);
+enum Status run_profiled(struct Simpletron *, struct Profile *);
+void write_profile_text(FILE *, const struct Profile *);
+void write_profile_json(FILE *, const struct Profile *);
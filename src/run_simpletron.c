@@ -1,37 +1,362 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "simpletron.h"
+#include "engine.h"
+#include "batch_io.h"
+#include "profile.h"
+#include "fuse.h"
+#include "trace.h"
+
+
+#define ENGINE_OPTION       "--engine="
+#define BATCH_OPTION        "--batch"
+#define INPUT_OPTION        "--input="
+#define PROFILE_OPTION      "--profile"
+#define PROFILE_JSON_OPTION "--profile-json="
+#define FUSION_OPTION       "--fusion-stats"
+#define RECORD_OPTION       "--record="
+#define REPLAY_OPTION       "--replay="
+#define DUMP_OPTION         "--dump="
+#define CORE_OPTION         "--core="
+
+
+static const char *const dump_modes[] = {
+    [DUMP_FULL]="full", [DUMP_SPARSE]="sparse", [DUMP_CHANGED]="changed", [DUMP_NONE]="none"
+};
 
 
 void show_help(char executableName[]) {
     puts("Usage: ");
-    printf("\t%s\t\t\tto enter program from keyboard\n", executableName);
-    printf("\t%s FILENAME\tto read program from file\n", executableName);
+    printf("\t%s [OPTIONS]\t\tto enter program from keyboard\n", executableName);
+    printf("\t%s [OPTIONS] FILENAME\tto read program from file\n", executableName);
+    puts("Options:");
+    printf("\t%sNAME\texecution engine:", ENGINE_OPTION);
+    for (const struct Engine *engine = engines; engine->name != NULL; engine++)
+        printf(" %s", engine->name);
+    printf(" (default: %s)\n", engines[0].name);
+    printf(
+        "\t%s\t\tno prompts and state dumps, values are read from input in bulk\n",
+        BATCH_OPTION
+    );
+    printf("\t%sFILE\tread batch input from FILE instead of stdin\n", INPUT_OPTION);
+    printf(
+        "\t%s\t\tcount executed instructions with switch engine, report goes to stderr\n",
+        PROFILE_OPTION
+    );
+    printf("\t%sFILE\twrite profile report in JSON to FILE\n", PROFILE_JSON_OPTION);
+    printf("\t%s\trun with fused engine, fusion counters go to stderr\n", FUSION_OPTION);
+    printf(
+        "\t%sFILE\trecord I/O with instruction counts to trace FILE, with switch engine\n",
+        RECORD_OPTION
+    );
+    printf(
+        "\t%sFILE\trun with input from trace FILE and check output against it\n",
+        REPLAY_OPTION
+    );
+    printf("\t%sMODE\tstate dumps before and after run:", DUMP_OPTION);
+    for (size_t mode = 0; mode < sizeof(dump_modes) / sizeof(dump_modes[0]); mode++)
+        printf(" %s", dump_modes[mode]);
+    puts(" (default: full)");
+    puts("\t\t\tsparse skips rows of zeros, changed prints words changed since load");
+    printf("\t%sFILE\twrite registers and memory to core FILE after run\n", CORE_OPTION);
+    puts("\t--word-bits=N\tword width, taken from image header if not set (default: 16)");
+}
+
+
+/* Profiling and recording options, plain run if all are unset */
+struct ProfileOptions {
+    bool        text;
+    const char  *json_filename;
+    bool        fusion;         /* counters of fused engine */
+    const char  *record_filename;  /* trace of I/O, never combined with profiling */
+};
+
+
+/* Runs program counting instructions, its I/O goes to trace file */
+enum Status record(struct Simpletron *simpletron, const char filename[]) {
+    struct Trace trace;
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL || !open_record(&trace, file, simpletron->io)) {
+        fprintf(stderr, "Error opening trace file '%s'\n", filename);
+        if (file != NULL)
+            fclose(file);
+        return FAIL;
+    }
+    struct SimpletronIO io = record_io;
+    io.context = &trace;
+    simpletron->io = &io;
+    const enum Status status = run_traced(simpletron, NULL, &trace);
+    simpletron->io = trace.io;
+    if (!close_record(&trace, status))
+        fprintf(stderr, "Error writing trace file '%s'\n", filename);
+    fclose(file);
+    return status;
+}
+
+
+/* Runs program with input from trace and reports differences of output,
+ * engines other than switch can not check instruction counts */
+int replay(const char filename[], const struct Engine *engine, const char trace_filename[]) {
+    struct Trace trace;
+    FILE *file = fopen(trace_filename, "rb");
+    if (file == NULL || !open_replay(&trace, file)) {
+        fprintf(stderr, "Error reading trace file '%s'\n", trace_filename);
+        if (file != NULL)
+            fclose(file);
+        return 1;
+    }
+    fclose(file);
+    struct Simpletron *simpletron = malloc(sizeof(struct Simpletron));
+    if (simpletron == NULL || !read_file_sml(simpletron, filename)) {
+        free(simpletron);
+        close_replay(&trace, FAIL);
+        return 1;
+    }
+
+    struct SimpletronIO io = replay_io;
+    io.context = &trace;
+    simpletron->io = &io;
+    const enum Status status = run_traced(
+        simpletron, engine == &engines[0] ? NULL : engine, &trace
+    );
+    const bool matched = close_replay(&trace, status);
+    if (matched)
+        printf("Replay matched trace: %lu events\n", trace.events);
+    else
+        printf(
+            "Replay differs from trace: %lu mismatches, first at %s\n",
+            trace.mismatches, trace.mismatch
+        );
+    if (!trace.counted)
+        puts("Instruction counts were not checked");
+    free(simpletron);
+    return matched ? 0 : 1;
+}
+
+
+/* Runs program with engine, or with profiling loop if profiling is requested */
+enum Status execute(
+    struct Simpletron *simpletron,
+    const struct Engine *engine,
+    const struct ProfileOptions *options
+) {
+    if (options->record_filename != NULL)
+        return record(simpletron, options->record_filename);
+    if (!options->text && options->json_filename == NULL) {
+        if (!options->fusion)
+            return engine->run(simpletron);
+        struct FusionStats stats;
+        const enum Status status = run_fused_counted(simpletron, &stats);
+        write_fusion_stats(stderr, &stats);
+        return status;
+    }
+
+    struct Profile *profile = malloc(sizeof(struct Profile));
+    if (profile == NULL) {
+        fputs("Error allocating profile\n", stderr);
+        return FAIL;
+    }
+    reset_profile(profile);
+    const enum Status status = run_profiled(simpletron, profile);
+    if (options->text)
+        write_profile_text(stderr, profile);
+    if (options->json_filename != NULL) {
+        FILE *file = fopen(options->json_filename, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Error opening profile file '%s'\n", options->json_filename);
+        } else {
+            write_profile_json(file, profile);
+            fclose(file);
+        }
+    }
+    free(profile);
+    return status;
+}
+
+
+bool find_dump_mode(const char name[], enum Dump *mode) {
+    for (size_t idx = 0; idx < sizeof(dump_modes) / sizeof(dump_modes[0]); idx++) {
+        if (strcmp(name, dump_modes[idx]) == 0) {
+            *mode = idx;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool save_core(const struct Simpletron *simpletron, const char filename[]) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        printf("Error opening core file '%s'\n", filename);
+        return false;
+    }
+    const bool written = write_core(file, simpletron);
+    if (fclose(file) != 0 || !written) {
+        printf("Error writing core file '%s'\n", filename);
+        return false;
+    }
+    return true;
+}
+
+
+/* Runs program without prompts and state dumps, core file is written if name is set */
+int run_batch(
+    struct Simpletron *simpletron,
+    const struct Engine *engine,
+    const char filename[],
+    const char input_filename[],
+    const struct ProfileOptions *profile,
+    const char core_filename[]
+) {
+    FILE *input_file = stdin;
+    if (input_filename != NULL && (input_file = fopen(input_filename, "r")) == NULL) {
+        fprintf(stderr, "Error opening input file '%s'\n", input_filename);
+        return 1;
+    }
+    struct BatchIO *batch = malloc(sizeof(struct BatchIO));
+    if (batch == NULL || !open_batch_io(batch, input_file, stdout)) {
+        fputs("Error reading input\n", stderr);
+        return 1;
+    }
+    if (input_file != stdin)
+        fclose(input_file);
+
+    struct SimpletronIO io = batch_io;
+    io.context = batch;
+    if (!read_file_sml(simpletron, filename)) {
+        close_batch_io(batch);
+        free(batch);
+        return 1;
+    }
+    simpletron->io = &io;
+    const enum Status status = execute(simpletron, engine, profile);
+    close_batch_io(batch);
+    free(batch);
+    if (core_filename != NULL && !save_core(simpletron, core_filename))
+        return 1;
+    return status == STOP ? 0 : 1;
 }
 
 
 int main(const int argc, char *argv[]) {
-    struct Simpletron simpletron;
-    enum Status status;
-    if (argc == 1) {
-        input_sml(&simpletron);
-    } else if (argc == 2) {
-        if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+    const struct Engine *engine = &engines[0];
+    const char *filename = NULL;
+    const char *input_filename = NULL;
+    bool batch = false;
+    const char *replay_filename = NULL;
+    enum Dump dump = DUMP_FULL;
+    const char *core_filename = NULL;
+    struct ProfileOptions profile = {
+        .text=false, .json_filename=NULL, .fusion=false, .record_filename=NULL
+    };
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-h") == 0 || strcmp(argv[arg], "--help") == 0) {
+            show_help(argv[0]);
+            return 0;
+        } else if (strncmp(argv[arg], ENGINE_OPTION, strlen(ENGINE_OPTION)) == 0) {
+            engine = find_engine(argv[arg] + strlen(ENGINE_OPTION));
+            if (engine == NULL) {
+                printf("Unknown engine '%s'\n", argv[arg] + strlen(ENGINE_OPTION));
+                show_help(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], BATCH_OPTION) == 0) {
+            batch = true;
+        } else if (strncmp(argv[arg], INPUT_OPTION, strlen(INPUT_OPTION)) == 0) {
+            input_filename = argv[arg] + strlen(INPUT_OPTION);
+            batch = true;
+        } else if (strcmp(argv[arg], PROFILE_OPTION) == 0) {
+            profile.text = true;
+        } else if (strncmp(argv[arg], PROFILE_JSON_OPTION, strlen(PROFILE_JSON_OPTION)) == 0) {
+            profile.json_filename = argv[arg] + strlen(PROFILE_JSON_OPTION);
+        } else if (strcmp(argv[arg], FUSION_OPTION) == 0) {
+            profile.fusion = true;
+        } else if (strncmp(argv[arg], RECORD_OPTION, strlen(RECORD_OPTION)) == 0) {
+            profile.record_filename = argv[arg] + strlen(RECORD_OPTION);
+        } else if (strncmp(argv[arg], REPLAY_OPTION, strlen(REPLAY_OPTION)) == 0) {
+            replay_filename = argv[arg] + strlen(REPLAY_OPTION);
+        } else if (strncmp(argv[arg], DUMP_OPTION, strlen(DUMP_OPTION)) == 0) {
+            if (!find_dump_mode(argv[arg] + strlen(DUMP_OPTION), &dump)) {
+                printf("Unknown dump mode '%s'\n", argv[arg] + strlen(DUMP_OPTION));
+                show_help(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[arg], CORE_OPTION, strlen(CORE_OPTION)) == 0) {
+            core_filename = argv[arg] + strlen(CORE_OPTION);
+        } else if (filename == NULL) {
+            filename = argv[arg];
+        } else {
             show_help(argv[0]);
             return 0;
         }
-        reset(&simpletron);
-        read_file_sml(&simpletron, argv[1]);
-        print_state(&simpletron);
-    } else {
-        show_help(argv[0]);
-        return 0;
-    }
-
-    do {
-        status = execute_operation(&simpletron);
-    } while (status == SUCCESS);
-    print_state(&simpletron);
-    return 0;
+    }
+
+    if ((batch || replay_filename != NULL) && filename == NULL) {
+        puts("Program file is required in batch and replay mode");
+        return 1;
+    }
+    if (replay_filename != NULL)
+        return replay(filename, engine, replay_filename);
+    if ((profile.text || profile.json_filename != NULL) && engine != &engines[0]) {
+        printf("Profiling runs with %s engine only\n", engines[0].name);
+        return 1;
+    }
+    /* Trace needs instruction counts, which only the switch loop of record keeps */
+    if (profile.record_filename != NULL && engine != &engines[0]) {
+        printf("Recording runs with %s engine only\n", engines[0].name);
+        return 1;
+    }
+    if (
+        profile.record_filename != NULL
+        && (profile.text || profile.json_filename != NULL || profile.fusion)
+    ) {
+        puts("Recording can not be combined with profiling or fusion stats");
+        return 1;
+    }
+
+    /* Memory of wide words does not fit on stack */
+    struct Simpletron *simpletron = malloc(sizeof(struct Simpletron));
+    if (simpletron == NULL) {
+        puts("Error allocating memory");
+        return 1;
+    }
+    if (batch) {
+        const int result = run_batch(
+            simpletron, engine, filename, input_filename, &profile, core_filename
+        );
+        free(simpletron);
+        return result;
+    }
+
+    if (filename == NULL) {
+        input_sml(simpletron);
+    } else if (!read_file_sml(simpletron, filename)) {
+        free(simpletron);
+        return 1;
+    }
+
+    /* Changed words are found against copy of memory taken after load */
+    word_t *loaded = NULL;
+    if (dump == DUMP_CHANGED) {
+        loaded = malloc(sizeof(simpletron->memory));
+        if (loaded == NULL) {
+            puts("Error allocating memory");
+            free(simpletron);
+            return 1;
+        }
+        memcpy(loaded, simpletron->memory, sizeof(simpletron->memory));
+    } else if (filename != NULL) {
+        dump_state(simpletron, dump, NULL);
+    }
+
+    execute(simpletron, engine, &profile);
+    dump_state(simpletron, dump, loaded);
+    free(loaded);
+    const bool written = core_filename == NULL || save_core(simpletron, core_filename);
+    free(simpletron);
+    return written ? 0 : 1;
 }
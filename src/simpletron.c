@@ -1,6 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "simpletron.h"
 
 
@@ -11,9 +15,9 @@ void simpletron_greet(void) {
         "*** (or data word) at a time. I will type the ***\n"
         "*** location number and a question mark (?). ***\n"
         "*** You then type the hexadecimal word for that  ***\n"
-        "*** location. Type the sentinel %X to stop entering ***\n"
+        "*** location. Type the sentinel %lX to stop entering ***\n"
         "*** your program. ***\n\n",
-        STOP_VALUE
+        (long) STOP_VALUE
     );
 }
 
@@ -24,11 +28,13 @@ void soft_reset(struct Simpletron *simpletron) {
     simpletron->instruction_register = 0;
     simpletron->operation_code = 0;
     simpletron->operand = 0;
+    simpletron->fault = FAULT_NONE;
 }
 
 
 void reset(struct Simpletron *simpletron) {
     soft_reset(simpletron);
+    simpletron->io = &interactive_io;
     for (size_t counter = 0; counter < MEMORY_SIZE; simpletron->memory[counter++] = 0);
 }
 
@@ -52,71 +58,245 @@ enum Status user_input(word_t *value) {
 }
 
 
-enum Status execute_operation(struct Simpletron *simpletron) {
-    if (simpletron->instruction_counter < 0 || simpletron->instruction_counter >= MEMORY_SIZE) {
-        printf("*** instructionCounter is not in range 0..%d ***\n", MEMORY_SIZE);
-        puts(ERRMSG);
-        return FAIL;
+static enum Status interactive_read_value(void *context, word_t *value) {
+    (void) context;
+    printf("%s", "<- ");
+    return user_input(value);
+}
+
+
+static void interactive_write_value(void *context, const word_t value) {
+    (void) context;
+    printf("-> %+0*d\n", WORD_BITS / 4 + 1, value);
+}
+
+
+static size_t interactive_read_string(void *context, char string[], const size_t size) {
+    int strchar;
+    size_t length = 0;
+
+    (void) context;
+    printf("%s", "<- ");
+    while ((strchar = getchar()) != '\n' && strchar != EOF) {
+        if (length < size)
+            string[length++] = (char) strchar;
     }
+    return length;
+}
 
-    /* Decode instruction */
-    simpletron->instruction_register = simpletron->memory[simpletron->instruction_counter++];
-    if (simpletron->instruction_register < 0) {
-        printf(
-                "*** Invalid instruction %d at %d ***\n",
+
+static void interactive_write_string(void *context, const char string[]) {
+    (void) context;
+    printf("-> %s\n", string);
+}
+
+
+static void interactive_report(void *context, const enum Status status, const char message[]) {
+    (void) context;
+    (void) status;
+    printf("%s", message);
+}
+
+
+const struct SimpletronIO interactive_io = {
+    .read_value=interactive_read_value,
+    .write_value=interactive_write_value,
+    .read_string=interactive_read_string,
+    .write_string=interactive_write_string,
+    .report=interactive_report,
+    .context=NULL
+};
+
+
+/* Writes description of the last fault to message, returns its length */
+size_t describe_fault(const struct Simpletron *simpletron, char message[], const size_t size) {
+    int length = 0;
+
+    switch (simpletron->fault) {
+        case FAULT_NONE:
+            length = snprintf(message, size, "%s", "");
+            break;
+        case FAULT_COUNTER:
+            length = snprintf(
+                message, size, "*** instructionCounter is not in range 0..%d ***\n", MEMORY_SIZE
+            );
+            break;
+        case FAULT_INSTRUCTION:
+            if (simpletron->instruction_register < 0) {
+                length = snprintf(
+                    message, size, "*** Invalid instruction %d at %d ***\n",
+                    simpletron->instruction_register, simpletron->instruction_counter - 1
+                );
+                break;
+            }
+            length = snprintf(
+                message, size, "*** Invalid instruction %X at %X ***\n",
                 simpletron->instruction_register, simpletron->instruction_counter - 1
             );
-        return FAIL;
+            break;
+        case FAULT_INPUT:
+            length = snprintf(
+                message, size, "*** Invalid input. Should be in decimal range %ld..%ld ***\n",
+                (long) -MAX_VALUE + 1, (long) MAX_VALUE - 1
+            );
+            break;
+        case FAULT_DIVISION:
+            length = snprintf(
+                message, size, "*** Attempt to divide by zero at %d ***\n",
+                simpletron->instruction_counter - 1
+            );
+            break;
+        case FAULT_ACCUMULATOR:
+            length = snprintf(
+                message, size, "*** Accumulator value %d is not in range %ld..%ld ***\n",
+                simpletron->accumulator, (long) MAX_VALUE, (long) -MAX_VALUE
+            );
+            break;
+        case FAULT_ALLOCATION:
+            length = snprintf(message, size, "*** Not enough memory to run program ***\n");
+            break;
+        case FAULT_STEPPING:
+            length = snprintf(
+                message, size, "*** Engine can not run limited number of steps ***\n"
+            );
+            break;
     }
-    simpletron->operation_code = (uword_t) simpletron->instruction_register >> OPERAND_BITS;
-    simpletron->operand = (uword_t) simpletron->instruction_register & ((1 << OPERAND_BITS) - 1);
+    if (length < 0)
+        return 0;
+    return (size_t) length < size ? (size_t) length : size - 1;
+}
 
-    /* Execute instruction */
-    size_t memptr = simpletron->operand;
+
+/* Records fault and reports it. Invalid input and negative words do not terminate message */
+enum Status fault(struct Simpletron *simpletron, const enum Fault fault) {
+    char message[MESSAGE_LENGTH + sizeof(ERRMSG) + 1];
+
+    simpletron->fault = fault;
+    const size_t length = describe_fault(simpletron, message, MESSAGE_LENGTH);
+    if (
+        fault != FAULT_INPUT
+        && !(fault == FAULT_INSTRUCTION && simpletron->instruction_register < 0)
+    )
+        sprintf(message + length, "%s\n", ERRMSG);
+    simpletron->io->report(simpletron->io->context, FAIL, message);
+    return FAIL;
+}
+
+
+enum Status halt(const struct Simpletron *simpletron) {
+    simpletron->io->report(simpletron->io->context, STOP, SUCCESSMSG "\n");
+    return STOP;
+}
+
+
+enum Status read_value(struct Simpletron *simpletron, const size_t address) {
+    const enum Status status = simpletron->io->read_value(
+        simpletron->io->context, &simpletron->memory[address]
+    );
+    if (status == SUSPEND)
+        return SUSPEND;
+    if (status != SUCCESS)
+        return fault(simpletron, FAULT_INPUT);
+    return SUCCESS;
+}
+
+
+void write_value(const struct Simpletron *simpletron, const size_t address) {
+    simpletron->io->write_value(simpletron->io->context, simpletron->memory[address]);
+}
+
+
+/* Packs string to memory starting at address, returns address of the last modified word */
+size_t store_string(
+    struct Simpletron *simpletron, size_t address, const char string[], const size_t length
+) {
+    size_t word_idx = 0;
+
+    simpletron->memory[address] = 0;
+    for (size_t idx = 0; idx < length; idx++) {
+        simpletron->memory[address] |= ((uint8_t) string[idx]) << (8 * word_idx++);
+        if (word_idx >= CHARS_WORD) {
+            if (address + 1 >= MEMORY_SIZE)
+                break;
+            word_idx = 0;
+            address++;
+            simpletron->memory[address] = 0;
+        }
+    }
+    simpletron->memory[address] &= ((uint8_t) 0) << word_idx; /* Force terminate string */
+    return address;
+}
+
+
+/* Reads string to memory starting at address, returns address of the last modified word,
+ * SUSPENDED if input is not ready */
+size_t read_string(struct Simpletron *simpletron, const size_t address) {
+    char string[STRING_LENGTH];
+    const size_t length = simpletron->io->read_string(
+        simpletron->io->context, string, STRING_LENGTH
+    );
+    if (length == SUSPENDED)
+        return SUSPENDED;
+    return store_string(simpletron, address, string, length);
+}
+
+
+void write_string(const struct Simpletron *simpletron, size_t address) {
+    char string[STRING_LENGTH + 1];
+    size_t length = 0;
     int strchar;
     size_t word_idx = 0;
 
+    while (
+        length < STRING_LENGTH
+        && (strchar = (int8_t) (simpletron->memory[address] >> (8 * word_idx++))) != 0
+    ) {
+        string[length++] = (char) strchar;
+        if (word_idx >= CHARS_WORD) {
+            word_idx = 0;
+            if (++address >= MEMORY_SIZE)
+                break;
+        }
+    }
+    string[length] = '\0';
+    simpletron->io->write_string(simpletron->io->context, string);
+}
+
+
+enum Status execute_operation(struct Simpletron *simpletron) {
+    if (simpletron->instruction_counter < 0 || simpletron->instruction_counter >= MEMORY_SIZE)
+        return fault(simpletron, FAULT_COUNTER);
+
+    /* Decode instruction */
+    simpletron->instruction_register = simpletron->memory[simpletron->instruction_counter++];
+    if (simpletron->instruction_register < 0)
+        return fault(simpletron, FAULT_INSTRUCTION);
+    simpletron->operation_code = (uword_t) simpletron->instruction_register >> OPERAND_BITS;
+    simpletron->operand = (uword_t) simpletron->instruction_register & ((1 << OPERAND_BITS) - 1);
+
+    /* Execute instruction */
     switch (simpletron->operation_code) {
         case NOP:
             break;
-        case READ:
-            printf("%s", "<- ");
-            if (user_input(&simpletron->memory[simpletron->operand]) != SUCCESS) {
-                printf(
-                    "*** Invalid input. Should be in decimal range %d..%d ***\n",
-                    -MAX_VALUE + 1, MAX_VALUE - 1
-                );
-                return FAIL;
-            }
+        case READ: {
+            const enum Status status = read_value(simpletron, simpletron->operand);
+            if (status == SUSPEND)
+                simpletron->instruction_counter--;
+            if (status != SUCCESS)
+                return status;
             break;
+        }
         case WRITE:
-            printf("-> %+0*d\n", WORD_BITS / 4 + 1, simpletron->memory[simpletron->operand]);
+            write_value(simpletron, simpletron->operand);
             break;
         case READSTR:
-            printf("%s", "<- ");
-            word_idx = 0;
-            simpletron->memory[memptr] = 0;
-            while ((strchar = getchar()) != '\n') {
-                simpletron->memory[memptr] |= ((uint8_t) strchar) << (8 * word_idx++);
-                if (word_idx >= CHARS_WORD) {
-                    word_idx = 0;
-                    memptr++;
-                    simpletron->memory[memptr] = 0;
-                }
+            if (read_string(simpletron, simpletron->operand) == SUSPENDED) {
+                simpletron->instruction_counter--;
+                return SUSPEND;
             }
-            simpletron->memory[memptr] &= ((uint8_t) 0) << word_idx; /* Force terminate string */
             break;
         case WRITESTR:
-            printf("%s", "-> ");
-            word_idx = 0;
-            while ((strchar = (int8_t) (simpletron->memory[memptr] >> (8 * word_idx++))) != 0) {
-                putchar(strchar);
-                if (word_idx >= CHARS_WORD) {
-                    word_idx = 0;
-                    memptr++;
-                }
-            }
-            putchar('\n');
+            write_string(simpletron, simpletron->operand);
             break;
         case LOAD:
             simpletron->accumulator = simpletron->memory[simpletron->operand];
@@ -133,35 +313,21 @@ enum Status execute_operation(struct Simpletron *simpletron) {
             );
             break;
         case DIVIDE:
-            if (simpletron->accumulator != 0) {
-                simpletron->accumulator = (
-                    simpletron->memory[simpletron->operand] / simpletron->accumulator
-                );
-            } else {
-                printf(
-                    "*** Attempt to divide by zero at %d ***\n",
-                    simpletron->instruction_counter - 1
-                );
-                puts(ERRMSG);
-                return FAIL;
-            }
+            if (simpletron->accumulator == 0)
+                return fault(simpletron, FAULT_DIVISION);
+            simpletron->accumulator = (
+                simpletron->memory[simpletron->operand] / simpletron->accumulator
+            );
             break;
         case MULTIPLY:
             simpletron->accumulator *= simpletron->memory[simpletron->operand];
             break;
         case REMAINDER:
-            if (simpletron->accumulator != 0) {
-                simpletron->accumulator = (
-                    simpletron->memory[simpletron->operand] % simpletron->accumulator
-                );
-            } else {
-                printf(
-                    "*** Attempt to divide by zero at %d ***\n",
-                    simpletron->instruction_counter - 1
-                );
-                puts(ERRMSG);
-                return FAIL;
-            }
+            if (simpletron->accumulator == 0)
+                return fault(simpletron, FAULT_DIVISION);
+            simpletron->accumulator = (
+                simpletron->memory[simpletron->operand] % simpletron->accumulator
+            );
             break;
         case POWER:
             simpletron->accumulator = (word_t) pow(
@@ -182,28 +348,17 @@ enum Status execute_operation(struct Simpletron *simpletron) {
             }
             break;
         case HALT:
-            puts(SUCCESSMSG);
-            return STOP;
+            return halt(simpletron);
         default:
-            printf(
-                "*** Invalid instruction %X at %X ***\n",
-                simpletron->instruction_register, simpletron->instruction_counter - 1
-            );
-            puts(ERRMSG);
-            return FAIL;
+            return fault(simpletron, FAULT_INSTRUCTION);
     }
     if (check_value(simpletron->accumulator))
         return SUCCESS;
-    printf(
-    "*** Accumulator value %d is not in range %d..%d ***\n",
-        simpletron->accumulator, MAX_VALUE, -MAX_VALUE
-    );
-    puts(ERRMSG);
-    return FAIL;
+    return fault(simpletron, FAULT_ACCUMULATOR);
 }
 
 
-void print_state(const struct Simpletron *simpletron) {
+static void print_registers(const struct Simpletron *simpletron) {
     printf("accumulator:\t\t%0*X\n", WORD_BITS / 4, (uword_t) simpletron->accumulator);
     printf(
         "instructionCounter:\t%*X\n", WORD_BITS / 4, (uword_t) simpletron->instruction_counter
@@ -213,21 +368,101 @@ void print_state(const struct Simpletron *simpletron) {
     );
     printf("operationCode:\t\t%*X\n", WORD_BITS / 4, (uword_t) simpletron->operation_code);
     printf("operand:\t\t%*X\n", WORD_BITS / 4, (uword_t) simpletron->operand);
-    puts("\nMEMORY:");
+}
+
+
+static void print_columns(void) {
     printf("%*s", MEM_ADDR_WIDTH, "");
     for (size_t counter = 0; counter < MAX_COLS; counter++)
         printf("%*lX", SPACES + WORD_BITS / 4, counter);
     puts("");
+}
+
+
+/* Row of memory is formatted whole and written with one call */
+static void print_row(const word_t memory[], const size_t row) {
+    char line[MEM_ADDR_WIDTH + MAX_COLS * (SPACES + WORD_BITS / 4) + 2];
+    int length = sprintf(line, "%*lX", MEM_ADDR_WIDTH, row);
+    for (size_t col = 0; col < MAX_COLS; col++)
+        length += sprintf(
+            line + length, "%*s%0*X", SPACES, "", WORD_BITS / 4,
+            (uword_t) memory[row * MAX_COLS + col]
+        );
+    line[length++] = '\n';
+    fwrite(line, 1, length, stdout);
+}
+
+
+static bool zero_row(const word_t memory[], const size_t row) {
+    for (size_t col = 0; col < MAX_COLS; col++)
+        if (memory[row * MAX_COLS + col] != 0)
+            return false;
+    return true;
+}
+
 
-    for (size_t counter = 0; counter < MEMORY_SIZE; counter++) {
-        if (counter % MAX_COLS == 0) {
-            if (counter > 0)
-                puts("");
-            printf("%*lX", MEM_ADDR_WIDTH, counter / MAX_COLS);
+void print_state(const struct Simpletron *simpletron) {
+    dump_state(simpletron, DUMP_FULL, NULL);
+}
+
+
+/*
+ * Prints registers and memory. DUMP_SPARSE skips rows of zeros, every skipped run is
+ * marked with one line of '*'. DUMP_CHANGED prints words which differ from loaded,
+ * as address, loaded and current value. DUMP_NONE prints nothing.
+ */
+void dump_state(const struct Simpletron *simpletron, const enum Dump mode, const word_t loaded[]) {
+    if (mode == DUMP_NONE)
+        return;
+    print_registers(simpletron);
+
+    if (mode == DUMP_CHANGED) {
+        size_t changed = 0;
+        puts("\nMEMORY CHANGED SINCE LOAD:");
+        for (size_t counter = 0; counter < MEMORY_SIZE; counter++) {
+            if (simpletron->memory[counter] == loaded[counter])
+                continue;
+            printf(
+                "%0*lX%*s%0*X -> %0*X\n", MEM_ADDR_WIDTH, counter, SPACES, "",
+                WORD_BITS / 4, (uword_t) loaded[counter],
+                WORD_BITS / 4, (uword_t) simpletron->memory[counter]
+            );
+            changed++;
+        }
+        printf("%lu words changed\n\n", changed);
+        return;
+    }
+
+    puts("\nMEMORY:");
+    print_columns();
+    bool skipped = false;
+    for (size_t row = 0; row < MEMORY_SIZE / MAX_COLS; row++) {
+        if (mode == DUMP_SPARSE && zero_row(simpletron->memory, row)) {
+            if (!skipped)
+                puts("*");
+            skipped = true;
+            continue;
         }
-        printf("%*s%0*X", SPACES, "", WORD_BITS / 4, (uword_t) simpletron->memory[counter]);
+        skipped = false;
+        print_row(simpletron->memory, row);
     }
-    puts("\n");
+    puts("");
+}
+
+
+/*
+ * Writes registers and memory as core file. Memory is written as image, so segments
+ * hold only non-zero ranges and core files of runs may be compared with cmp.
+ */
+bool write_core(FILE *file, const struct Simpletron *simpletron) {
+    const uint32_t fields[4] = {CORE_MAGIC, CORE_VERSION, WORD_BITS, simpletron->fault};
+    const word_t registers[5] = {
+        simpletron->accumulator, simpletron->instruction_counter,
+        simpletron->instruction_register, simpletron->operation_code, simpletron->operand
+    };
+    return fwrite(fields, sizeof(uint32_t), 4, file) == 4
+        && fwrite(registers, sizeof(word_t), 5, file) == 5
+        && write_image(file, simpletron->memory, MEMORY_SIZE);
 }
 
 
@@ -252,47 +487,249 @@ void input_sml(struct Simpletron *simpletron) {
 }
 
 
-void read_file_sml(struct Simpletron *simpletron, const char *filename) {
-    word_t header;
-    size_t result = 0;
+/* Detects format of program in buffer by its first words */
+enum Format sml_format(const char buffer[], const size_t size) {
+    word_t header[2];
+    if (size < sizeof(word_t))
+        return FORMAT_TEXT;
+    memcpy(header, buffer, sizeof(word_t));
+    if (header[0] != HEADER)
+        return FORMAT_TEXT;
+    if (size < 2 * sizeof(word_t))
+        return FORMAT_MEMORY;
+    memcpy(&header[1], buffer + sizeof(word_t), sizeof(word_t));
+    return header[1] == HEADER ? FORMAT_IMAGE : FORMAT_MEMORY;
+}
+
+
+/* Reads field of image, returns false if buffer is too short */
+static bool read_field(
+    void *field, const size_t field_size, const char buffer[], const size_t size, size_t *position
+) {
+    if (size - *position < field_size)
+        return false;
+    memcpy(field, buffer + *position, field_size);
+    *position += field_size;
+    return true;
+}
+
+
+/* Copies segments of image to memory, every segment is checked against memory and buffer */
+static enum Load load_image(word_t memory[], const char buffer[], const size_t size) {
+    size_t position = 2 * sizeof(word_t);
+    uint32_t version, word_bits, segments;
+
+    if (
+        !read_field(&version, sizeof(uint32_t), buffer, size, &position)
+        || !read_field(&word_bits, sizeof(uint32_t), buffer, size, &position)
+        || !read_field(&segments, sizeof(uint32_t), buffer, size, &position)
+    )
+        return LOAD_INVALID;
+    if (version != IMAGE_VERSION || word_bits != WORD_BITS)
+        return LOAD_VERSION;
+
+    for (uint32_t segment = 0; segment < segments; segment++) {
+        uint32_t address, length;
+        if (
+            !read_field(&address, sizeof(uint32_t), buffer, size, &position)
+            || !read_field(&length, sizeof(uint32_t), buffer, size, &position)
+        )
+            return LOAD_INVALID;
+        if (address > MEMORY_SIZE || length > MEMORY_SIZE - address)
+            return LOAD_OVERFLOW;
+        if (!read_field(&memory[address], length * sizeof(word_t), buffer, size, &position))
+            return LOAD_INVALID;
+    }
+    return position == size ? LOAD_SUCCESS : LOAD_INVALID;
+}
+
+
+/* Writes parts of memory as image, runs of zeros shorter than IMAGE_GAP stay inside
+ * segments. Parts are in order of address and do not overlap */
+bool write_image_parts(FILE *file, const struct ImagePart parts[], const size_t count) {
+    const word_t header[2] = {HEADER, HEADER};
+    const uint32_t fields[2] = {IMAGE_VERSION, WORD_BITS};
+    uint32_t segments = 0;
+
+    for (size_t pass = 0; pass < 2; pass++) {
+        if (
+            pass == 1
+            && (
+                fwrite(header, sizeof(word_t), 2, file) != 2
+                || fwrite(fields, sizeof(uint32_t), 2, file) != 2
+                || fwrite(&segments, sizeof(uint32_t), 1, file) != 1
+            )
+        )
+            return false;
+        for (size_t part = 0; part < count; part++) {
+            const word_t *memory = parts[part].words;
+            const size_t size = parts[part].length;
+            for (size_t start = 0, end; start < size; start = end) {
+                for (; start < size && memory[start] == 0; start++);
+                if (start == size)
+                    break;
+                size_t zeros = 0;
+                for (end = start; end < size && zeros < IMAGE_GAP; end++)
+                    zeros = memory[end] == 0 ? zeros + 1 : 0;
+                end -= zeros;
+                if (pass == 0) {
+                    segments++;
+                    continue;
+                }
+                const uint32_t segment[2] = {parts[part].address + start, end - start};
+                if (
+                    fwrite(segment, sizeof(uint32_t), 2, file) != 2
+                    || fwrite(&memory[start], sizeof(word_t), end - start, file) != end - start
+                )
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+/* Writes memory as image */
+bool write_image(FILE *file, const word_t memory[], const size_t size) {
+    const struct ImagePart part = {.address=0, .words=memory, .length=size};
+    return write_image_parts(file, &part, 1);
+}
+
+
+/*
+ * Loads image, binary memory state or SML text from buffer.
+ * Number of the wrong line of SML text goes to line.
+ */
+enum Load load_sml(
+    struct Simpletron *simpletron, const char buffer[], const size_t size, size_t *line
+) {
+    size_t counter = 0;
+
     reset(simpletron);
+    if (line != NULL)
+        *line = 0;
+    if (size < sizeof(word_t))
+        return LOAD_EMPTY;
+
+    switch (sml_format(buffer, size)) {
+        case FORMAT_IMAGE:
+            return load_image(simpletron->memory, buffer, size);
+        case FORMAT_MEMORY: {
+            const size_t words = size / sizeof(word_t) - 1;
+            if (words > MEMORY_SIZE)
+                return LOAD_OVERFLOW;
+            memcpy(simpletron->memory, buffer + sizeof(word_t), words * sizeof(word_t));
+            return LOAD_SUCCESS;
+        }
+        case FORMAT_TEXT:
+            break;
+    }
+
+    for (size_t start = 0, end, number = 1; start < size; start = end + 1, number++) {
+        char s[USER_INPUT_LENGTH];
+        const char *newline = memchr(buffer + start, '\n', size - start);
+        end = newline == NULL ? size : (size_t) (newline - buffer);
+        if (line != NULL)
+            *line = number;
+        if (end - start >= USER_INPUT_LENGTH)
+            return LOAD_INVALID;
+        if (counter >= MEMORY_SIZE)
+            return LOAD_OVERFLOW;
+        memcpy(s, buffer + start, end - start);
+        s[end - start] = '\0';
+        const dword_t input = strtol(s, NULL, 16);
+        if (!check_value(input))
+            return LOAD_INVALID;
+        simpletron->memory[counter++] = (word_t) input;
+    }
+    if (line != NULL)
+        *line = 0;
+    return LOAD_SUCCESS;
+}
+
 
+/* Reads whole file from stream when it can not be mapped */
+static char *read_stream(FILE *file, size_t *size) {
+    size_t capacity = 4096, result;
+    char *buffer = malloc(capacity);
+
+    *size = 0;
+    while (buffer != NULL && (result = fread(buffer + *size, 1, capacity - *size, file)) > 0) {
+        *size += result;
+        if (*size == capacity) {
+            char *resized = realloc(buffer, capacity *= 2);
+            if (resized == NULL)
+                free(buffer);
+            buffer = resized;
+        }
+    }
+    if (buffer != NULL && ferror(file)) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+
+bool read_file_sml(struct Simpletron *simpletron, const char *filename) {
+    const char *notices[] = {
+        [FORMAT_TEXT]="Got text Simpletron Machine Language file\n",
+        [FORMAT_MEMORY]="Got binary Simpletron memory state\n",
+        [FORMAT_IMAGE]="Got Simpletron image\n"
+    };
     FILE *file = fopen(filename, "rb");
     if (file == NULL) {
         printf("Error opening file '%s'\n\n",  filename);
-        exit(1);
+        return false;
+    }
+
+    /* Regular files are mapped, other files (pipes, devices) are read */
+    struct stat file_stat;
+    size_t size = 0;
+    char *buffer = NULL;
+    void *mapping = MAP_FAILED;
+    if (
+        fstat(fileno(file), &file_stat) == 0
+        && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0
+    ) {
+        size = (size_t) file_stat.st_size;
+        mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
     }
-    result = fread(&header, sizeof(word_t), 1, file);
-    if (result == 0) {
+    if (mapping != MAP_FAILED)
+        buffer = mapping;
+    else
+        buffer = read_stream(file, &size);
+    fclose(file);
+    if (buffer == NULL) {
         printf("Error reading file '%s'\n\n",  filename);
-        exit(1);
+        return false;
     }
-    if (header == HEADER) { /* binary file */
-        puts("Got binary Simpletron memory state");
-        while (!feof(file)) {
-            result = fread(
-                &simpletron->memory[simpletron->instruction_counter++],
-                sizeof(word_t),
-                1,
-                file
-            );
-            if (result == 0 && !feof(file)) puts("Error reading file");
-        }
-    } else {
-        fclose(file);
-        puts("Got text Simpletron Machine Language file");
-        file = fopen(filename, "r");
-        dword_t input;
-        char s[USER_INPUT_LENGTH];
-        while (!feof(file)) {
-            if (fgets(s, USER_INPUT_LENGTH, file) != NULL) {
-                input = strtol(s, NULL, 16);
-                if (check_value(input)) {
-                    simpletron->memory[simpletron->instruction_counter++] = (word_t) input;
-                } else printf("Invalid input: %s\n", s);
-            }
-        }
+
+    size_t line;
+    const enum Load status = load_sml(simpletron, buffer, size, &line);
+    switch (status) {
+        case LOAD_SUCCESS:
+            fputs(notices[sml_format(buffer, size)], stderr);
+            break;
+        case LOAD_EMPTY:
+            printf("Error reading file '%s'\n\n",  filename);
+            break;
+        case LOAD_OVERFLOW:
+            printf("Program in file '%s' does not fit in memory\n\n", filename);
+            break;
+        case LOAD_VERSION:
+            printf("Image in file '%s' has unsupported version or word size\n\n", filename);
+            break;
+        case LOAD_INVALID:
+            if (line > 0)
+                printf("Invalid input at line %lu of file '%s'\n\n", line, filename);
+            else
+                printf("Invalid image in file '%s'\n\n", filename);
+            break;
     }
-    fclose(file);
-    soft_reset(simpletron);
+    if (mapping != MAP_FAILED)
+        munmap(mapping, size);
+    else
+        free(buffer);
+    return status == LOAD_SUCCESS;
 }
@@ -4,7 +4,9 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#ifndef WORD_BITS
 #define WORD_BITS           16  /* Instruction == one word */
+#endif
 #define OPCODE_BITS         8
 
 #if WORD_BITS == 8
@@ -27,7 +29,7 @@ typedef int64_t dword_t;
 #define CHARS_WORD          (WORD_BITS / 8) /* Number of chars in one word */
 
 #define USER_INPUT_LENGTH   (2 + 1 + WORD_BITS)  /* max width for 0b00000000, 2 for 0b, 1 for \0 */
-#define MAX_VALUE           (1 << WORD_BITS)
+#define MAX_VALUE           ((dword_t) 1 << WORD_BITS)
 #define STOP_VALUE          MAX_VALUE
 
 /* Instructions */
@@ -57,9 +59,65 @@ typedef int64_t dword_t;
 #define SPACES              2
 #define MEM_ADDR_WIDTH      (1 + OPERAND_BITS / 4)
 
+#define STRING_LENGTH       1024  /* max length of string read by READSTR */
+#define MESSAGE_LENGTH      256   /* max length of fault description */
+
 #define ERRMSG              "\n*** Simpletron execution abnormally terminated ***\n"
 #define SUCCESSMSG          "\n*** Simpletron execution terminated ***\n"
 
+/* SUSPEND: READ or READSTR waits for input, instruction_counter points at it and the
+ * machine continues from there when run again */
+enum Status {STOP, SUCCESS, FAIL, SUSPEND};
+
+enum Fault {
+    FAULT_NONE, FAULT_COUNTER, FAULT_INSTRUCTION, FAULT_INPUT, FAULT_DIVISION, FAULT_ACCUMULATOR,
+    FAULT_ALLOCATION, /* engine could not allocate its tables */
+    FAULT_STEPPING    /* engine was asked to stop after some steps, which only switch does */
+};
+
+/* Result of loading program from buffer */
+enum Load {LOAD_SUCCESS, LOAD_EMPTY, LOAD_INVALID, LOAD_OVERFLOW, LOAD_VERSION};
+
+/*
+ * Program formats:
+ * text     one hexadecimal word per line
+ * memory   HEADER, then memory state from address 0
+ * image    HEADER, HEADER, uint32 IMAGE_VERSION, uint32 WORD_BITS, uint32 number of segments,
+ *          every segment is uint32 address, uint32 length and length words.
+ *          Byte order is the one of the machine.
+ */
+enum Format {FORMAT_TEXT, FORMAT_MEMORY, FORMAT_IMAGE};
+
+/* Words of memory written to image from address */
+struct ImagePart {
+    size_t          address;
+    const word_t    *words;
+    size_t          length;
+};
+
+/*
+ * State dumps: every word, rows with non-zero words, words changed since load, nothing.
+ * Core file has uint32 CORE_MAGIC, uint32 CORE_VERSION, uint32 WORD_BITS, uint32 fault,
+ * words accumulator, instruction counter, instruction register, operation code, operand,
+ * then memory as image.
+ */
+enum Dump {DUMP_FULL, DUMP_SPARSE, DUMP_CHANGED, DUMP_NONE};
+#define CORE_MAGIC          0x45524F43  /* "CORE" in little endian */
+#define CORE_VERSION        1
+
+#define SUSPENDED           ((size_t) -1)  /* read_string result when input is not ready */
+
+/* Input/output channel used by READ, WRITE, READSTR, WRITESTR and for diagnostics.
+ * Channel without input ready returns SUSPEND from read_value, SUSPENDED from read_string */
+struct SimpletronIO {
+    enum Status (*read_value)(void *, word_t *);                /* value for READ */
+    void        (*write_value)(void *, const word_t);           /* value of WRITE */
+    size_t      (*read_string)(void *, char [], const size_t);  /* line for READSTR */
+    void        (*write_string)(void *, const char []);         /* string of WRITESTR */
+    void        (*report)(void *, const enum Status, const char []);  /* halt and fault messages */
+    void        *context;
+};
+
 struct Simpletron {
     word_t memory[MEMORY_SIZE];     /* memory array */
     word_t instruction_counter;     /* current location in memory */
@@ -67,20 +125,36 @@ struct Simpletron {
     word_t operation_code;          /* current decoded operation */
     word_t operand;                 /* current decoded operand */
     word_t accumulator;             /* accumulator register */
+    const struct SimpletronIO *io;  /* input/output channel */
+    enum Fault fault;               /* reason of the last abnormal termination */
 };
 
-enum Status {STOP, SUCCESS, FAIL};
-
 
 void simpletron_greet(void);
 void soft_reset(struct Simpletron *);
 void reset(struct Simpletron *);
 bool check_value(dword_t);
 enum Status user_input(word_t *);
+extern const struct SimpletronIO interactive_io;
+
+size_t describe_fault(const struct Simpletron *, char [], const size_t);
+enum Status fault(struct Simpletron *, const enum Fault);
+enum Status halt(const struct Simpletron *);
+enum Status read_value(struct Simpletron *, const size_t);
+void write_value(const struct Simpletron *, const size_t);
+size_t store_string(struct Simpletron *, size_t, const char [], const size_t);
+size_t read_string(struct Simpletron *, size_t);
+void write_string(const struct Simpletron *, size_t);
 enum Status execute_operation(struct Simpletron *);
 void print_state(const struct Simpletron *);
+void dump_state(const struct Simpletron *, const enum Dump, const word_t []);
+bool write_core(FILE *, const struct Simpletron *);
 void input_sml(struct Simpletron *);
-void read_file_sml(struct Simpletron *, const char *);
+enum Format sml_format(const char [], const size_t);
+bool write_image(FILE *, const word_t [], const size_t);
+bool write_image_parts(FILE *, const struct ImagePart [], const size_t);
+enum Load load_sml(struct Simpletron *, const char [], const size_t, size_t *);
+bool read_file_sml(struct Simpletron *, const char *);
 
 
 inline void flush_input(void) {
@@ -88,4 +162,7 @@ inline void flush_input(void) {
     while ((strchar = getchar()) != EOF && strchar != '\n') {}
 }
 
-#define HEADER              ((word_t) ((1 << WORD_BITS) - 1))
+#define HEADER              ((word_t) (uword_t) -1)
+#define IMAGE_VERSION       1
+/* Runs of zeros shorter than header of segment are kept inside segment */
+#define IMAGE_GAP           (2 * sizeof(uint32_t) / sizeof(word_t))
@@ -0,0 +1,334 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "simpletron.h"
+#include "engine.h"
+#include "batch_io.h"
+#include "lockstep.h"
+
+
+#define ENGINE_OPTION       "--engine="
+#define THREADS_OPTION      "--threads="
+#define LOCKSTEP_OPTION     "--lockstep"
+#define DEFAULT_ENGINE      "threaded"
+#define FAIL_FIELD          "FAIL"
+
+struct Row {
+    const char                  *input;         /* values of row, not terminated */
+    size_t                      input_size;
+    char                        *output;        /* comma separated outputs */
+    size_t                      output_size;
+    enum Status                 status;
+};
+
+/* Rows of worker. Owner takes rows from the bottom, other workers steal from the top */
+struct WorkQueue {
+    pthread_mutex_t             lock;
+    size_t                      *rows;
+    size_t                      top;
+    size_t                      bottom;
+};
+
+struct Batch {
+    const struct Simpletron     *program;       /* loaded image, copied for every row */
+    const struct Engine         *engine;       /* NULL to run rows in lockstep */
+    struct Row                  *rows;
+    struct WorkQueue            *queues;
+    size_t                      workers;
+};
+
+/* Machine of worker executing one row, used as context of its io */
+struct Lane {
+    struct BatchIO              io;
+    struct SimpletronIO         channel;
+    struct Simpletron           simpletron;
+    size_t                      row;            /* row being executed */
+};
+
+struct Worker {
+    struct Batch                *batch;
+    size_t                      id;
+    struct Lane                 *lanes;         /* LANES in lockstep, else one */
+};
+
+
+void show_help(char executableName[]) {
+    puts("Usage:");
+    printf("\t%s [OPTIONS] PROGRAM INPUT.csv OUTPUT.csv\n", executableName);
+    puts("Runs PROGRAM once for every row of INPUT.csv, values of row are used by READ.");
+    puts("Outputs of every row are written to the same row of OUTPUT.csv,");
+    printf("'%s' is added to rows terminated abnormally.\n", FAIL_FIELD);
+    puts("Options:");
+    printf("\t%sNAME\texecution engine (default: %s)\n", ENGINE_OPTION, DEFAULT_ENGINE);
+    printf("\t%sN\tnumber of worker threads (default: number of cores)\n", THREADS_OPTION);
+    printf(
+        "\t%s\trun %lu rows at once in vector lanes, instead of engine\n",
+        LOCKSTEP_OPTION, (unsigned long) LANES
+    );
+}
+
+
+/* Faults are reported with row number */
+static void row_report(void *context, const enum Status status, const char message[]) {
+    const struct Lane *lane = context;
+    if (status == FAIL)
+        fprintf(stderr, "Row %lu: %s", lane->row + 1, message);
+}
+
+
+/* Takes row from own queue or steals one from other workers */
+bool take_row(struct Batch *batch, const size_t worker, size_t *row) {
+    struct WorkQueue *queue = &batch->queues[worker];
+    pthread_mutex_lock(&queue->lock);
+    if (queue->top < queue->bottom) {
+        *row = queue->rows[--queue->bottom];
+        pthread_mutex_unlock(&queue->lock);
+        return true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    for (size_t offset = 1; offset < batch->workers; offset++) {
+        struct WorkQueue *victim = &batch->queues[(worker + offset) % batch->workers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->top < victim->bottom) {
+            *row = victim->rows[victim->top++];
+            pthread_mutex_unlock(&victim->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return false;
+}
+
+
+/* Saves output of row: values on one line separated by commas */
+void save_output(struct Row *row, const struct BatchIO *io, const enum Status status) {
+    row->status = status;
+    row->output = malloc(io->output_size + sizeof(FAIL_FIELD) + 2);
+    if (row->output == NULL) {
+        row->output_size = 0;
+        return;
+    }
+    memcpy(row->output, io->output, io->output_size);
+    row->output_size = io->output_size;
+    for (size_t idx = 0; idx < row->output_size; idx++) {
+        if (row->output[idx] == '\n')
+            row->output[idx] = ',';
+    }
+    if (row->output_size > 0)
+        row->output_size--;  /* Trailing separator */
+    if (status != STOP) {
+        if (row->output_size > 0)
+            row->output[row->output_size++] = ',';
+        memcpy(row->output + row->output_size, FAIL_FIELD, strlen(FAIL_FIELD));
+        row->output_size += strlen(FAIL_FIELD);
+    }
+    row->output[row->output_size++] = '\n';
+}
+
+
+/* Prepares machine of lane for row */
+void load_row(struct Lane *lane, const struct Batch *batch) {
+    const struct Row *row = &batch->rows[lane->row];
+    lane->io.input = row->input;
+    lane->io.input_size = row->input_size;
+    lane->io.input_position = 0;
+    lane->io.output_size = 0;
+    lane->simpletron = *batch->program;
+    lane->simpletron.io = &lane->channel;
+}
+
+
+/* Source of lanes: saves output of finished row and loads the next one */
+struct Simpletron *next_row(
+    void *context, const size_t index, struct Simpletron *finished, const enum Status status
+) {
+    struct Worker *worker = context;
+    struct Lane *lane = &worker->lanes[index];
+    if (finished != NULL)
+        save_output(&worker->batch->rows[lane->row], &lane->io, status);
+    if (!take_row(worker->batch, worker->id, &lane->row))
+        return NULL;
+    load_row(lane, worker->batch);
+    return &lane->simpletron;
+}
+
+
+void *run_worker(void *argument) {
+    struct Worker *worker = argument;
+    struct Batch *batch = worker->batch;
+    const size_t lanes_size = batch->engine == NULL ? LANES : 1;
+
+    worker->lanes = malloc(lanes_size * sizeof(struct Lane));
+    for (size_t idx = 0; worker->lanes != NULL && idx < lanes_size; idx++) {
+        struct Lane *lane = &worker->lanes[idx];
+        if (!init_batch_io(&lane->io, NULL, 0, NULL)) {
+            worker->lanes = NULL;
+            break;
+        }
+        lane->channel = batch_io;
+        lane->channel.report = row_report;
+        lane->channel.context = lane;
+    }
+    if (worker->lanes == NULL) {
+        fputs("Error allocating worker\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Lanes are refilled with rows as soon as they halt */
+    if (batch->engine == NULL) {
+        run_lockstep(next_row, worker);
+    } else {
+        struct Simpletron *simpletron = next_row(worker, 0, NULL, STOP);
+        while (simpletron != NULL)
+            simpletron = next_row(worker, 0, simpletron, batch->engine->run(simpletron));
+    }
+    for (size_t idx = 0; idx < lanes_size; idx++)
+        free(worker->lanes[idx].io.output);
+    free(worker->lanes);
+    return NULL;
+}
+
+
+/* Splits input to rows, empty line is row without values */
+struct Row *split_rows(const char input[], const size_t input_size, size_t *rows_size) {
+    size_t capacity = 1024;
+    struct Row *rows = malloc(capacity * sizeof(struct Row));
+    *rows_size = 0;
+    for (size_t start = 0, end; rows != NULL && start < input_size; start = end + 1) {
+        for (end = start; end < input_size && input[end] != '\n'; end++);
+        size_t length = end - start;
+        if (length > 0 && input[start + length - 1] == '\r')
+            length--;
+        if (*rows_size == capacity) {
+            capacity *= 2;
+            struct Row *resized = realloc(rows, capacity * sizeof(struct Row));
+            if (resized == NULL) {
+                free(rows);
+                return NULL;
+            }
+            rows = resized;
+        }
+        rows[(*rows_size)++] = (struct Row) {.input=&input[start], .input_size=length};
+    }
+    return rows;
+}
+
+
+int main(const int argc, char *argv[]) {
+    const char *engine_name = DEFAULT_ENGINE;
+    bool lockstep = false;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *filenames[3];
+    size_t filenames_size = 0;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-h") == 0 || strcmp(argv[arg], "--help") == 0) {
+            show_help(argv[0]);
+            return 0;
+        } else if (strncmp(argv[arg], ENGINE_OPTION, strlen(ENGINE_OPTION)) == 0) {
+            engine_name = argv[arg] + strlen(ENGINE_OPTION);
+        } else if (strncmp(argv[arg], THREADS_OPTION, strlen(THREADS_OPTION)) == 0) {
+            workers = strtol(argv[arg] + strlen(THREADS_OPTION), NULL, 10);
+        } else if (strcmp(argv[arg], LOCKSTEP_OPTION) == 0) {
+            lockstep = true;
+        } else if (filenames_size < 3) {
+            filenames[filenames_size++] = argv[arg];
+        } else {
+            show_help(argv[0]);
+            return 1;
+        }
+    }
+    if (filenames_size != 3 || workers < 1) {
+        show_help(argv[0]);
+        return 1;
+    }
+
+    struct Batch batch = {.engine=find_engine(engine_name), .workers=workers};
+    if (batch.engine == NULL) {
+        printf("Unknown engine '%s'\n", engine_name);
+        return 1;
+    }
+    if (lockstep)
+        batch.engine = NULL;
+
+    struct Simpletron *program = malloc(sizeof(struct Simpletron));
+    if (program == NULL) {
+        puts("Error allocating memory");
+        return 1;
+    }
+    if (!read_file_sml(program, filenames[0]))
+        return 1;
+    batch.program = program;
+
+    FILE *input_file = fopen(filenames[1], "r");
+    struct BatchIO input;
+    if (input_file == NULL || !open_batch_io(&input, input_file, NULL)) {
+        printf("Error reading input file '%s'\n", filenames[1]);
+        return 1;
+    }
+    fclose(input_file);
+
+    size_t rows_size;
+    batch.rows = split_rows(input.input, input.input_size, &rows_size);
+    batch.queues = malloc(batch.workers * sizeof(struct WorkQueue));
+    struct Worker *workers_list = malloc(batch.workers * sizeof(struct Worker));
+    pthread_t *threads = malloc(batch.workers * sizeof(pthread_t));
+    size_t *queue_rows = malloc((rows_size + 1) * sizeof(size_t));
+    if (batch.rows == NULL || batch.queues == NULL || workers_list == NULL || threads == NULL
+            || queue_rows == NULL) {
+        puts("Error allocating memory");
+        return 1;
+    }
+
+    /* Consecutive rows go to the same worker, reversed so owner takes them in order */
+    for (size_t worker = 0; worker < batch.workers; worker++) {
+        const size_t first = rows_size * worker / batch.workers;
+        const size_t last = rows_size * (worker + 1) / batch.workers;
+        struct WorkQueue *queue = &batch.queues[worker];
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->rows = &queue_rows[first];
+        queue->top = 0;
+        queue->bottom = last - first;
+        for (size_t row = first; row < last; row++)
+            queue_rows[row] = last - 1 - (row - first);
+    }
+
+    for (size_t worker = 0; worker < batch.workers; worker++) {
+        workers_list[worker] = (struct Worker) {.batch=&batch, .id=worker};
+        if (pthread_create(&threads[worker], NULL, run_worker, &workers_list[worker]) != 0) {
+            puts("Error starting worker thread");
+            return 1;
+        }
+    }
+    for (size_t worker = 0; worker < batch.workers; worker++)
+        pthread_join(threads[worker], NULL);
+
+    FILE *output_file = fopen(filenames[2], "w");
+    if (output_file == NULL) {
+        printf("Error opening output file '%s'\n", filenames[2]);
+        return 1;
+    }
+    size_t failed = 0;
+    for (size_t row = 0; row < rows_size; row++) {
+        fwrite(batch.rows[row].output, 1, batch.rows[row].output_size, output_file);
+        if (batch.rows[row].status != STOP)
+            failed++;
+        free(batch.rows[row].output);
+    }
+    fclose(output_file);
+
+    for (size_t worker = 0; worker < batch.workers; worker++)
+        pthread_mutex_destroy(&batch.queues[worker].lock);
+    free(queue_rows);
+    free(threads);
+    free(workers_list);
+    free(batch.queues);
+    free(batch.rows);
+    close_batch_io(&input);
+    free(program);
+    return failed == 0 ? 0 : 1;
+}
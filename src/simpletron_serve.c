@@ -0,0 +1,99 @@
+#define _POSIX_C_SOURCE 200809L
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "simpletron.h"
+#include "multiplex.h"
+
+
+#define STDIO_OPTION        "--stdio"
+
+
+void show_help(char executableName[]) {
+    puts("Usage:");
+    printf("\t%s PROGRAM SOCKET\n", executableName);
+    printf("\t%s %s PROGRAM\n", executableName, STDIO_OPTION);
+    puts("Every connection to Unix socket SOCKET is an interactive session of PROGRAM,");
+    puts("all sessions are served from one thread. Sessions waiting for input cost");
+    puts("no CPU time, running ones take turns.");
+    printf("\t%s\tserve one session on stdin and stdout instead\n", STDIO_OPTION);
+}
+
+
+/* Returns listening socket bound to path, -1 on error */
+int listen_unix(const char path[]) {
+    struct sockaddr_un address = {.sun_family=AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (
+        fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0
+        || listen(fd, SOMAXCONN) != 0
+    ) {
+        printf("Error listening on socket '%s'\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+int main(const int argc, char *argv[]) {
+    if (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)) {
+        show_help(argv[0]);
+        return 0;
+    }
+    if (argc != 3) {
+        show_help(argv[0]);
+        return 1;
+    }
+    const bool stdio = strcmp(argv[1], STDIO_OPTION) == 0;
+
+    struct Simpletron *program = malloc(sizeof(struct Simpletron));
+    if (program == NULL) {
+        puts("Error allocating memory");
+        return 1;
+    }
+    if (!read_file_sml(program, stdio ? argv[2] : argv[1])) {
+        free(program);
+        return 1;
+    }
+
+    /* Gone peers are noticed by write errors */
+    struct sigaction ignore = {.sa_handler=SIG_IGN};
+    sigaction(SIGPIPE, &ignore, NULL);
+
+    const int listen_fd = stdio ? -1 : listen_unix(argv[2]);
+    if (!stdio && listen_fd < 0) {
+        free(program);
+        return 1;
+    }
+    struct Multiplexer multiplexer;
+    if (!init_multiplexer(&multiplexer, program, listen_fd)) {
+        puts("Error starting multiplexer");
+        free(program);
+        return 1;
+    }
+    if (stdio && add_session(&multiplexer, STDIN_FILENO, STDOUT_FILENO) == NULL) {
+        puts("Error creating session");
+        close_multiplexer(&multiplexer);
+        free(program);
+        return 1;
+    }
+
+    const bool served = run_multiplexer(&multiplexer);
+    if (!served)
+        perror("Error waiting for events");
+    close_multiplexer(&multiplexer);
+    free(program);
+    return served ? 0 : 1;
+}
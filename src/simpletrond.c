@@ -0,0 +1,731 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "simpletron.h"
+#include "engine.h"
+#include "batch_io.h"
+#include "libsimpletron.h"
+
+
+#define ENGINE_OPTION       "--engine="
+#define THREADS_OPTION      "--threads="
+#define MAX_STEPS_OPTION    "--max-steps="
+#define DEFAULT_ENGINE      "threaded"
+#define DEFAULT_MAX_STEPS   100000000     /* per job, so endless program does not hold worker */
+#define CACHE_SLOTS         1024          /* hash table size */
+#define CACHE_LIMIT         4096          /* programs kept at once */
+#define PROGRAM_LIMIT       (1 << 24)     /* max size of submitted program */
+#define LINE_LENGTH         (1 << 16)     /* max length of request line */
+#define INPUT_LIMIT         (LINE_LENGTH + PROGRAM_LIMIT)  /* received, not yet parsed */
+#define OUTPUT_LIMIT        (1 << 16)     /* client with more unsent answers sends no requests */
+#define DAEMON_EVENTS       256           /* epoll events handled at once */
+
+/* Loaded program, never changed once cached */
+struct CachedProgram {
+    uint64_t                    hash;           /* of submitted bytes */
+    word_t                      memory[MEMORY_SIZE];
+    struct CachedProgram        *next;          /* in slot */
+};
+
+/* Programs by content hash, so clients submit program once and run it by id */
+struct Cache {
+    pthread_mutex_t             lock;
+    struct CachedProgram        *slots[CACHE_SLOTS];
+    size_t                      size;
+};
+
+enum Request {REQUEST_LOAD, REQUEST_RUN};
+
+/* Connection of client. Its requests are parsed by the event loop and handed to workers
+ * one at a time, so idle connections hold no worker and answers keep order of requests */
+struct Client {
+    int                         fd;
+    char                        *input;         /* received, not yet parsed */
+    size_t                      input_size;
+    size_t                      input_capacity;
+    bool                        input_closed;
+    char                        *output;        /* answers not yet sent */
+    size_t                      output_size;
+    size_t                      output_sent;
+    size_t                      output_capacity;
+    uint32_t                    events;         /* registered for */
+    bool                        busy;           /* request is with a worker */
+    bool                        closing;        /* closed once request with worker is done */
+    enum Request                request;        /* with worker */
+    char                        *data;          /* program of LOAD, values of RUN */
+    size_t                      data_size;
+    uint64_t                    id;             /* program of RUN */
+    char                        *answer;        /* written by worker */
+    size_t                      answer_size;
+    struct Client               *next;          /* in queue */
+};
+
+struct Queue {
+    struct Client               *first;
+    struct Client               *last;
+};
+
+struct Daemon {
+    const struct Engine         *engine;
+    unsigned long               max_steps;      /* 0 runs engine without limit */
+    struct Cache                cache;
+    int                         epoll_fd;
+    pthread_mutex_t             lock;           /* of queues */
+    pthread_cond_t              ready;          /* request is queued for workers */
+    struct Queue                requests;
+    struct Queue                answers;        /* clients with request done by worker */
+    int                         wake_fds[2];    /* pipe waking event loop for answers */
+};
+
+/* Worker keeps its machine and channel from job to job */
+struct Worker {
+    struct Daemon               *daemon;
+    struct Simpletron           *simpletron;
+    struct BatchIO              io;
+    struct SimpletronIO         channel;
+};
+
+
+void show_help(char executableName[]) {
+    puts("Usage:");
+    printf("\t%s [OPTIONS] SOCKET\n", executableName);
+    puts("Runs jobs submitted over Unix socket SOCKET. Requests are lines:");
+    puts("\tLOAD SIZE\tfollowed by SIZE bytes of program (text or image),");
+    puts("\t\t\tanswer 'OK ID', program is cached by content hash ID,");
+    puts("\t\t\tother program with the same ID is refused");
+    puts("\tRUN ID VALUES\truns cached program with input VALUES separated by commas,");
+    puts("\t\t\tanswer 'STOP OUTPUTS' or 'FAIL OUTPUTS', outputs separated by commas");
+    puts("Errors are answered with 'ERROR MESSAGE', job running too long with 'ERROR step limit'.");
+    puts("Requests of one connection are answered in order, by any free worker.");
+    puts("Options:");
+    printf("\t%sN\tsteps of one job, 0 for no limit (default: %d)\n", MAX_STEPS_OPTION,
+           DEFAULT_MAX_STEPS);
+    printf("\t%sNAME\texecution engine, other than switch with %s0 only\n", ENGINE_OPTION,
+           MAX_STEPS_OPTION);
+    printf("\t\t\t(default: %s, %s without step limit)\n", engines[0].name, DEFAULT_ENGINE);
+    printf("\t%sN\tnumber of worker threads (default: number of cores)\n", THREADS_OPTION);
+}
+
+
+/* FNV-1a */
+uint64_t hash_bytes(const char bytes[], const size_t size) {
+    uint64_t hash = 0xCBF29CE484222325u;
+    for (size_t idx = 0; idx < size; idx++) {
+        hash ^= (unsigned char) bytes[idx];
+        hash *= 0x100000001B3u;
+    }
+    return hash;
+}
+
+
+const struct CachedProgram *find_program(struct Cache *cache, const uint64_t hash) {
+    pthread_mutex_lock(&cache->lock);
+    const struct CachedProgram *program = cache->slots[hash % CACHE_SLOTS];
+    while (program != NULL && program->hash != hash)
+        program = program->next;
+    pthread_mutex_unlock(&cache->lock);
+    return program;
+}
+
+
+/* Checks that program cached under hash is the one loaded into simpletron */
+bool same_program(const struct CachedProgram *program, const struct Simpletron *simpletron) {
+    return memcmp(program->memory, simpletron->memory, sizeof(program->memory)) == 0;
+}
+
+
+/* Loads submitted program into cache, unless it is there already. Program is loaded even
+ * if its hash is cached, so hash collision is refused instead of running the other program.
+ * Writes error message and returns false on failure */
+bool cache_program(
+    struct Cache *cache, struct Simpletron *simpletron, const char buffer[], const size_t size,
+    uint64_t *hash, char error[]
+) {
+    *hash = hash_bytes(buffer, size);
+    size_t line;
+    switch (load_sml(simpletron, buffer, size, &line)) {
+        case LOAD_SUCCESS:
+            break;
+        case LOAD_EMPTY:
+            strcpy(error, "empty program");
+            return false;
+        case LOAD_OVERFLOW:
+            strcpy(error, "program does not fit in memory");
+            return false;
+        case LOAD_VERSION:
+            strcpy(error, "unsupported image version or word size");
+            return false;
+        case LOAD_INVALID:
+            sprintf(error, "invalid program at line %lu", (unsigned long) line);
+            return false;
+    }
+    const struct CachedProgram *found = find_program(cache, *hash);
+    if (found != NULL) {
+        if (same_program(found, simpletron))
+            return true;
+        strcpy(error, "other program with the same id is cached");
+        return false;
+    }
+
+    struct CachedProgram *program = malloc(sizeof(struct CachedProgram));
+    if (program == NULL) {
+        strcpy(error, "out of memory");
+        return false;
+    }
+    program->hash = *hash;
+    memcpy(program->memory, simpletron->memory, sizeof(program->memory));
+
+    /* Other worker may have cached the same program meanwhile */
+    pthread_mutex_lock(&cache->lock);
+    struct CachedProgram **slot = &cache->slots[*hash % CACHE_SLOTS];
+    const struct CachedProgram *cached = *slot;
+    while (cached != NULL && cached->hash != *hash)
+        cached = cached->next;
+    bool result = true;
+    if (cached != NULL) {
+        if (!same_program(cached, simpletron)) {
+            strcpy(error, "other program with the same id is cached");
+            result = false;
+        }
+        free(program);
+    } else if (cache->size == CACHE_LIMIT) {
+        free(program);
+        strcpy(error, "program cache is full");
+        result = false;
+    } else {
+        program->next = *slot;
+        *slot = program;
+        cache->size++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+
+/* Runs job on machine of worker: memory is copied from cache, registers are cleared.
+ * SUCCESS is returned when job is still running after step limit of daemon */
+enum Status run_job(
+    struct Worker *worker, const struct CachedProgram *program, const char input[],
+    const size_t input_size
+) {
+    struct Simpletron *simpletron = worker->simpletron;
+    memcpy(simpletron->memory, program->memory, sizeof(simpletron->memory));
+    soft_reset(simpletron);
+    simpletron->io = &worker->channel;
+    worker->io.input = input;
+    worker->io.input_size = input_size;
+    worker->io.input_position = 0;
+    worker->io.output_size = 0;
+    const struct Daemon *daemon = worker->daemon;
+    return simpletron_run(
+        simpletron, daemon->max_steps == 0 ? daemon->engine : NULL, daemon->max_steps
+    );
+}
+
+
+/* Faults are answered with status, nothing is printed */
+static void job_report(void *context, const enum Status status, const char message[]) {
+    (void) context;
+    (void) status;
+    (void) message;
+}
+
+
+/* Answers outputs of job on one line separated by commas */
+void answer_job(FILE *output, const struct BatchIO *io, const enum Status status) {
+    fputs(status == STOP ? "STOP " : "FAIL ", output);
+    for (size_t idx = 0; idx < io->output_size; idx++) {
+        const char c = io->output[idx];
+        if (c != '\n')
+            fputc(c, output);
+        else if (idx + 1 < io->output_size)
+            fputc(',', output);
+    }
+    fputc('\n', output);
+}
+
+
+static void push(struct Queue *queue, struct Client *client) {
+    client->next = NULL;
+    if (queue->last != NULL)
+        queue->last->next = client;
+    else
+        queue->first = client;
+    queue->last = client;
+}
+
+
+static struct Client *pop(struct Queue *queue) {
+    struct Client *client = queue->first;
+    queue->first = client->next;
+    if (queue->first == NULL)
+        queue->last = NULL;
+    return client;
+}
+
+
+/* Runs request of client on machine of worker, its answer is one line */
+void answer_request(struct Worker *worker, struct Client *client) {
+    struct Daemon *daemon = worker->daemon;
+    char error[MESSAGE_LENGTH];
+    FILE *answer = open_memstream(&client->answer, &client->answer_size);
+    if (answer == NULL) {
+        client->answer = NULL;
+        return;
+    }
+
+    if (client->request == REQUEST_LOAD) {
+        uint64_t hash;
+        if (cache_program(
+            &daemon->cache, worker->simpletron, client->data, client->data_size, &hash, error
+        ))
+            fprintf(answer, "OK %016llX\n", (unsigned long long) hash);
+        else
+            fprintf(answer, "ERROR %s\n", error);
+    } else {
+        const struct CachedProgram *program = find_program(&daemon->cache, client->id);
+        if (program == NULL) {
+            fputs("ERROR unknown program\n", answer);
+        } else {
+            const enum Status status = run_job(worker, program, client->data, client->data_size);
+            if (status == SUCCESS)
+                fputs("ERROR step limit\n", answer);
+            else
+                answer_job(answer, &worker->io, status);
+        }
+    }
+    fclose(answer);
+}
+
+
+/* Takes queued requests and queues their answers for the event loop */
+void *run_worker(void *argument) {
+    struct Worker *worker = argument;
+    struct Daemon *daemon = worker->daemon;
+    const char wake = 0;
+    for (;;) {
+        pthread_mutex_lock(&daemon->lock);
+        while (daemon->requests.first == NULL)
+            pthread_cond_wait(&daemon->ready, &daemon->lock);
+        struct Client *client = pop(&daemon->requests);
+        pthread_mutex_unlock(&daemon->lock);
+
+        answer_request(worker, client);
+        pthread_mutex_lock(&daemon->lock);
+        push(&daemon->answers, client);
+        pthread_mutex_unlock(&daemon->lock);
+        /* Full pipe wakes the loop already */
+        if (write(daemon->wake_fds[1], &wake, 1) < 0 && errno != EAGAIN)
+            puts("Error waking event loop");
+    }
+    return NULL;
+}
+
+
+static bool set_nonblocking(const int fd) {
+    const int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+
+/* Appends to answers not yet sent, returns false if memory runs out */
+static bool append_output(struct Client *client, const char string[], const size_t length) {
+    if (client->output_size + length > client->output_capacity) {
+        size_t capacity = client->output_capacity == 0 ? 256 : client->output_capacity;
+        while (client->output_size + length > capacity)
+            capacity *= 2;
+        char *output = realloc(client->output, capacity);
+        if (output == NULL)
+            return false;
+        client->output = output;
+        client->output_capacity = capacity;
+    }
+    memcpy(client->output + client->output_size, string, length);
+    client->output_size += length;
+    return true;
+}
+
+
+/* Answers error and closes client once it is sent */
+static void refuse(struct Client *client, const char message[]) {
+    append_output(client, message, strlen(message));
+    client->input_closed = true;
+    client->input_size = 0;
+}
+
+
+/* Removes line and data of size bytes after it from input */
+static void consume(struct Client *client, const size_t size) {
+    client->input_size -= size;
+    memmove(client->input, client->input + size, client->input_size);
+}
+
+
+/* Parses requests of client until one is queued for workers. Incomplete request waits
+ * for more input, unless input is closed */
+static void serve_requests(struct Daemon *daemon, struct Client *client) {
+    static char line[LINE_LENGTH + 1];
+
+    while (
+        !client->busy && !client->closing && client->input_size > 0
+        && client->output_size - client->output_sent <= OUTPUT_LIMIT
+    ) {
+        const char *newline = memchr(client->input, '\n', client->input_size);
+        size_t length = newline != NULL ? (size_t) (newline - client->input) : client->input_size;
+        if (length >= LINE_LENGTH) {
+            refuse(client, "ERROR request line is too long\n");
+            break;
+        }
+        if (newline == NULL && !client->input_closed)
+            break;
+        memcpy(line, client->input, length);
+        const size_t line_size = length + (newline != NULL);
+        if (length > 0 && line[length - 1] == '\r')
+            length--;
+        line[length] = '\0';
+
+        unsigned long size;
+        unsigned long long id;
+        int offset = 0;
+        if (sscanf(line, "LOAD %lu", &size) == 1) {
+            if (size > PROGRAM_LIMIT || (
+                client->input_size - line_size < size && client->input_closed
+            )) {
+                refuse(client, "ERROR program is too large or truncated\n");
+                break;
+            }
+            if (client->input_size - line_size < size)
+                break;
+            client->request = REQUEST_LOAD;
+            client->data = malloc(size);
+            client->data_size = size;
+            if (client->data != NULL)
+                memcpy(client->data, client->input + line_size, size);
+            consume(client, line_size + size);
+        } else if (sscanf(line, "RUN %llx%n", &id, &offset) == 1) {
+            client->request = REQUEST_RUN;
+            client->id = id;
+            client->data_size = length - offset;
+            client->data = malloc(client->data_size + 1);
+            if (client->data != NULL)
+                memcpy(client->data, line + offset, client->data_size);
+            consume(client, line_size);
+        } else {
+            if (length > 0)
+                append_output(client, "ERROR unknown request\n", 22);
+            consume(client, line_size);
+            continue;
+        }
+
+        if (client->data == NULL) {
+            refuse(client, "ERROR out of memory\n");
+            break;
+        }
+        client->busy = true;
+        pthread_mutex_lock(&daemon->lock);
+        push(&daemon->requests, client);
+        pthread_cond_signal(&daemon->ready);
+        pthread_mutex_unlock(&daemon->lock);
+    }
+}
+
+
+/* Reads available input, as long as it fits in INPUT_LIMIT */
+static void receive_input(struct Client *client) {
+    while (!client->input_closed) {
+        if (client->input_size == client->input_capacity) {
+            if (client->input_capacity == INPUT_LIMIT)
+                break;
+            size_t capacity = client->input_capacity == 0 ? 4096 : client->input_capacity * 2;
+            if (capacity > INPUT_LIMIT)
+                capacity = INPUT_LIMIT;
+            char *input = realloc(client->input, capacity);
+            if (input == NULL)
+                break;
+            client->input = input;
+            client->input_capacity = capacity;
+        }
+        const ssize_t received = read(
+            client->fd, client->input + client->input_size,
+            client->input_capacity - client->input_size
+        );
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (received <= 0)
+            client->input_closed = true;
+        else
+            client->input_size += received;
+    }
+}
+
+
+/* Sends as much of answers as peer takes, client whose peer is gone is closing */
+static void flush_output(struct Client *client) {
+    while (client->output_sent < client->output_size) {
+        const ssize_t sent = write(
+            client->fd, client->output + client->output_sent,
+            client->output_size - client->output_sent
+        );
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent < 0) {
+            client->closing = true;
+            client->output_sent = client->output_size;
+            break;
+        }
+        client->output_sent += sent;
+    }
+    if (client->output_sent == client->output_size)
+        client->output_size = client->output_sent = 0;
+}
+
+
+static void free_client(struct Daemon *daemon, struct Client *client) {
+    epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client->input);
+    free(client->output);
+    free(client->data);
+    free(client->answer);
+    free(client);
+}
+
+
+/*
+ * Serves client after its events or answer: parses requests, sends answers and
+ * registers for events client waits for. Client is freed when no request of it is
+ * with a worker and it is closing, or its input is closed and all answers are sent.
+ */
+static void update_client(struct Daemon *daemon, struct Client *client) {
+    serve_requests(daemon, client);
+    flush_output(client);
+    const bool unsent = client->output_sent < client->output_size;
+    if (!client->busy && (client->closing || (client->input_closed && !unsent))) {
+        free_client(daemon, client);
+        return;
+    }
+
+    /* Input is read only while client may send requests, so peers flooding requests
+     * wait for answers */
+    const bool idle = !client->busy && client->output_size <= OUTPUT_LIMIT;
+    const uint32_t events = (
+        (!client->input_closed && (idle || client->input_size < LINE_LENGTH) ? EPOLLIN : 0)
+        | (unsent ? EPOLLOUT : 0)
+    );
+    if (events != client->events) {
+        struct epoll_event event = {.events=events, .data.ptr=client};
+        epoll_ctl(daemon->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+        client->events = events;
+    }
+}
+
+
+/* Gives clients answers of their requests done by workers */
+static void take_answers(struct Daemon *daemon) {
+    char wakes[64];
+    while (read(daemon->wake_fds[0], wakes, sizeof(wakes)) > 0);
+
+    pthread_mutex_lock(&daemon->lock);
+    struct Client *client = daemon->answers.first;
+    daemon->answers.first = daemon->answers.last = NULL;
+    pthread_mutex_unlock(&daemon->lock);
+    while (client != NULL) {
+        struct Client *next = client->next;
+        client->busy = false;
+        if (client->answer == NULL)
+            append_output(client, "ERROR out of memory\n", 20);
+        else if (!client->closing)
+            append_output(client, client->answer, client->answer_size);
+        free(client->answer);
+        free(client->data);
+        client->answer = client->data = NULL;
+        update_client(daemon, client);
+        client = next;
+    }
+}
+
+
+static void accept_clients(struct Daemon *daemon, const int listen_fd) {
+    for (;;) {
+        const int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+            return;
+        struct Client *client = calloc(1, sizeof(struct Client));
+        struct epoll_event event = {.events=EPOLLIN, .data.ptr=client};
+        if (
+            client == NULL || !set_nonblocking(fd)
+            || epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0
+        ) {
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        client->events = EPOLLIN;
+    }
+}
+
+
+/* Event loop: accepts clients, reads their requests and sends answers, workers run
+ * requests meanwhile. Returns only on epoll error */
+void run_daemon(struct Daemon *daemon, const int listen_fd) {
+    struct epoll_event events[DAEMON_EVENTS];
+    for (;;) {
+        const int ready = epoll_wait(daemon->epoll_fd, events, DAEMON_EVENTS, -1);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            return;
+
+        for (int idx = 0; idx < ready; idx++) {
+            struct Client *client = events[idx].data.ptr;
+            if (client == NULL) {
+                accept_clients(daemon, listen_fd);
+                continue;
+            }
+            if ((void *) client == daemon) {
+                take_answers(daemon);
+                continue;
+            }
+            if (events[idx].events & (EPOLLIN | EPOLLHUP))
+                receive_input(client);
+            /* Peer is gone, answers can not be delivered */
+            if (events[idx].events & EPOLLERR) {
+                client->closing = true;
+                client->output_size = client->output_sent = 0;
+            }
+            update_client(daemon, client);
+        }
+    }
+}
+
+
+/* Returns listening socket bound to path, -1 on error */
+int listen_unix(const char path[]) {
+    struct sockaddr_un address = {.sun_family=AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (
+        fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0
+        || listen(fd, SOMAXCONN) != 0
+    ) {
+        printf("Error listening on socket '%s'\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+int main(const int argc, char *argv[]) {
+    const char *engine_name = NULL;
+    unsigned long max_steps = DEFAULT_MAX_STEPS;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *socket_path = NULL;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "-h") == 0 || strcmp(argv[arg], "--help") == 0) {
+            show_help(argv[0]);
+            return 0;
+        } else if (strncmp(argv[arg], ENGINE_OPTION, strlen(ENGINE_OPTION)) == 0) {
+            engine_name = argv[arg] + strlen(ENGINE_OPTION);
+        } else if (strncmp(argv[arg], THREADS_OPTION, strlen(THREADS_OPTION)) == 0) {
+            workers = strtol(argv[arg] + strlen(THREADS_OPTION), NULL, 10);
+        } else if (strncmp(argv[arg], MAX_STEPS_OPTION, strlen(MAX_STEPS_OPTION)) == 0) {
+            max_steps = strtoul(argv[arg] + strlen(MAX_STEPS_OPTION), NULL, 10);
+        } else if (socket_path == NULL) {
+            socket_path = argv[arg];
+        } else {
+            show_help(argv[0]);
+            return 1;
+        }
+    }
+    if (socket_path == NULL || workers < 1) {
+        show_help(argv[0]);
+        return 1;
+    }
+
+    if (engine_name == NULL)
+        engine_name = max_steps == 0 ? DEFAULT_ENGINE : engines[0].name;
+
+    static struct Daemon daemon;
+    daemon.engine = find_engine(engine_name);
+    daemon.max_steps = max_steps;
+    if (daemon.engine == NULL) {
+        printf("Unknown engine '%s'\n", engine_name);
+        return 1;
+    }
+    if (max_steps > 0 && daemon.engine != &engines[0]) {
+        printf("Engine '%s' can not limit steps, use %s0\n", engine_name, MAX_STEPS_OPTION);
+        return 1;
+    }
+    pthread_mutex_init(&daemon.cache.lock, NULL);
+    pthread_mutex_init(&daemon.lock, NULL);
+    pthread_cond_init(&daemon.ready, NULL);
+
+    /* Clients closing connection early are noticed by write errors */
+    struct sigaction ignore = {.sa_handler=SIG_IGN};
+    sigaction(SIGPIPE, &ignore, NULL);
+
+    struct Worker *workers_list = calloc(workers, sizeof(struct Worker));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    if (workers_list == NULL || threads == NULL) {
+        puts("Error allocating memory");
+        return 1;
+    }
+    const int listen_fd = listen_unix(socket_path);
+    if (listen_fd < 0)
+        return 1;
+    daemon.epoll_fd = epoll_create1(0);
+    struct epoll_event listen_event = {.events=EPOLLIN, .data.ptr=NULL};
+    struct epoll_event wake_event = {.events=EPOLLIN, .data.ptr=&daemon};
+    if (
+        daemon.epoll_fd < 0 || pipe(daemon.wake_fds) != 0 || !set_nonblocking(listen_fd)
+        || !set_nonblocking(daemon.wake_fds[0]) || !set_nonblocking(daemon.wake_fds[1])
+        || epoll_ctl(daemon.epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) != 0
+        || epoll_ctl(daemon.epoll_fd, EPOLL_CTL_ADD, daemon.wake_fds[0], &wake_event) != 0
+    ) {
+        puts("Error starting event loop");
+        return 1;
+    }
+
+    for (long worker = 0; worker < workers; worker++) {
+        struct Worker *current = &workers_list[worker];
+        current->daemon = &daemon;
+        current->simpletron = malloc(sizeof(struct Simpletron));
+        if (current->simpletron == NULL || !init_batch_io(&current->io, NULL, 0, NULL)) {
+            puts("Error allocating worker");
+            return 1;
+        }
+        current->channel = batch_io;
+        current->channel.report = job_report;
+        current->channel.context = &current->io;
+        if (pthread_create(&threads[worker], NULL, run_worker, current) != 0) {
+            puts("Error starting worker thread");
+            return 1;
+        }
+    }
+
+    run_daemon(&daemon, listen_fd);
+    puts("Error waiting for events");
+    return 1;
+}
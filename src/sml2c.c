@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simpletron.h"
+#include "decode.h"
+
+
+/* Runtime support shared by native and interpreted programs */
+static const char *runtime[] = {
+    "static word_t memory[MEMORY_SIZE];",
+    "static word_t accumulator;",
+    "",
+    "static inline int fault(const char message[], const long value) {",
+    "    printf(message, value);",
+    "    puts(ERRMSG);",
+    "    return EXIT_FAILURE;",
+    "}",
+    "",
+    "static inline int read_value(word_t *value) {",
+    "    char s[USER_INPUT_LENGTH];",
+    "    printf(\"%s\", \"<- \");",
+    "    if (fgets(s, USER_INPUT_LENGTH, stdin) == NULL)",
+    "        s[0] = '\\0';",
+    "    const dword_t parsed_input = (word_t) strtol(s, NULL, 0);",
+    "    if (labs(parsed_input) < MAX_VALUE) {",
+    "        *value = (word_t) parsed_input;",
+    "        return 1;",
+    "    }",
+    "    printf(",
+    "        \"*** Invalid input. Should be in decimal range %ld..%ld ***\\n\",",
+    "        -MAX_VALUE + 1, MAX_VALUE - 1",
+    "    );",
+    "    return 0;",
+    "}",
+    "",
+    "static inline void write_value(const word_t value) {",
+    "    printf(\"-> %+0*d\\n\", WORD_BITS / 4 + 1, value);",
+    "}",
+    "",
+    "static inline void read_string(size_t address) {",
+    "    int strchar;",
+    "    size_t word_idx = 0;",
+    "    printf(\"%s\", \"<- \");",
+    "    memory[address] = 0;",
+    "    while ((strchar = getchar()) != '\\n' && strchar != EOF) {",
+    "        memory[address] |= ((uint8_t) strchar) << (8 * word_idx++);",
+    "        if (word_idx >= CHARS_WORD) {",
+    "            if (address + 1 >= MEMORY_SIZE)",
+    "                break;",
+    "            word_idx = 0;",
+    "            address++;",
+    "            memory[address] = 0;",
+    "        }",
+    "    }",
+    "    memory[address] &= ((uint8_t) 0) << word_idx;",
+    "}",
+    "",
+    "static inline void write_string(size_t address) {",
+    "    int strchar;",
+    "    size_t word_idx = 0;",
+    "    printf(\"%s\", \"-> \");",
+    "    while ((strchar = (int8_t) (memory[address] >> (8 * word_idx++))) != 0) {",
+    "        putchar(strchar);",
+    "        if (word_idx >= CHARS_WORD) {",
+    "            word_idx = 0;",
+    "            if (++address >= MEMORY_SIZE)",
+    "                break;",
+    "        }",
+    "    }",
+    "    putchar('\\n');",
+    "}",
+    NULL
+};
+
+/* Interpreter for programs modifying their own code */
+static const char *interpreter[] = {
+    "static int run(void) {",
+    "    size_t counter = 0;",
+    "    for (;;) {",
+    "        if (counter >= MEMORY_SIZE)",
+    "            return fault(\"*** instructionCounter is not in range 0..%ld ***\\n\", MEMORY_SIZE);",
+    "        const word_t instruction = memory[counter++];",
+    "        if (instruction < 0) {",
+    "            printf(\"*** Invalid instruction %d at %d ***\\n\", instruction, (int) counter - 1);",
+    "            return EXIT_FAILURE;",
+    "        }",
+    "        const size_t operand = (uword_t) instruction & ((1 << OPERAND_BITS) - 1);",
+    "        switch ((uword_t) instruction >> OPERAND_BITS) {",
+    "            case NOP: break;",
+    "            case READ: if (!read_value(&memory[operand])) return EXIT_FAILURE; break;",
+    "            case WRITE: write_value(memory[operand]); break;",
+    "            case READSTR: read_string(operand); break;",
+    "            case WRITESTR: write_string(operand); break;",
+    "            case LOAD: accumulator = memory[operand]; break;",
+    "            case STORE: memory[operand] = accumulator; break;",
+    "            case ADD: accumulator += memory[operand]; break;",
+    "            case SUBTRACT: accumulator = memory[operand] - accumulator; break;",
+    "            case DIVIDE:",
+    "                if (accumulator == 0)",
+    "                    return fault(\"*** Attempt to divide by zero at %ld ***\\n\", counter - 1);",
+    "                accumulator = memory[operand] / accumulator;",
+    "                break;",
+    "            case MULTIPLY: accumulator *= memory[operand]; break;",
+    "            case REMAINDER:",
+    "                if (accumulator == 0)",
+    "                    return fault(\"*** Attempt to divide by zero at %ld ***\\n\", counter - 1);",
+    "                accumulator = memory[operand] % accumulator;",
+    "                break;",
+    "            case POWER: accumulator = (word_t) pow(memory[operand], accumulator); break;",
+    "            case BRANCH: counter = operand; break;",
+    "            case BRANCHNEG: if (accumulator < 0) counter = operand; break;",
+    "            case BRANCHZERO: if (accumulator == 0) counter = operand; break;",
+    "            case HALT: puts(SUCCESSMSG); return EXIT_SUCCESS;",
+    "            default:",
+    "                printf(\"*** Invalid instruction %X at %X ***\\n\", instruction, (int) counter - 1);",
+    "                puts(ERRMSG);",
+    "                return EXIT_FAILURE;",
+    "        }",
+    "    }",
+    "}",
+    NULL
+};
+
+
+void show_help(char executableName[]) {
+    puts("Usage:");
+    printf("\t%s\tFILENAME.sml OUTFILE.c\n", executableName);
+    puts("Compile result with host C compiler, e.g. cc -O2 OUTFILE.c -lm");
+}
+
+
+void write_lines(FILE *file, const char *lines[]) {
+    for (const char **line = lines; *line != NULL; line++)
+        fprintf(file, "%s\n", *line);
+}
+
+
+/* Writes C string literal */
+void write_literal(FILE *file, const char string[]) {
+    fputc('"', file);
+    for (const char *c = string; *c != '\0'; c++) {
+        if (*c == '\n')
+            fputs("\\n", file);
+        else if (*c == '"' || *c == '\\')
+            fprintf(file, "\\%c", *c);
+        else
+            fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+
+/* Checks if execution continues with the next word after instruction */
+bool is_sequential(const uint8_t operation_code) {
+    switch (operation_code) {
+        case NOP: case READ: case WRITE: case READSTR: case WRITESTR: case LOAD: case STORE:
+        case ADD: case SUBTRACT: case DIVIDE: case MULTIPLY: case REMAINDER: case POWER:
+        case BRANCHNEG: case BRANCHZERO:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/* Marks instructions reachable from address 0 */
+void find_code(const struct DecodedInstruction code[], bool reachable[], bool target[]) {
+    size_t *worklist = malloc((MEMORY_SIZE + 1) * sizeof(size_t));
+    size_t worklist_size = 0;
+    worklist[worklist_size++] = 0;
+    reachable[0] = true;
+
+    while (worklist_size > 0) {
+        const size_t address = worklist[--worklist_size];
+        const struct DecodedInstruction instruction = code[address];
+        size_t successors[2];
+        size_t successors_size = 0;
+        switch (instruction.operation_code) {
+            case BRANCH:
+            case BRANCHNEG:
+            case BRANCHZERO:
+                successors[successors_size++] = instruction.operand;
+                target[instruction.operand] = true;
+                break;
+            default:
+                break;
+        }
+        if (is_sequential(instruction.operation_code))
+            successors[successors_size++] = address + 1;
+        for (size_t successor = 0; successor < successors_size; successor++) {
+            if (successors[successor] < MEMORY_SIZE && !reachable[successors[successor]]) {
+                reachable[successors[successor]] = true;
+                worklist[worklist_size++] = successors[successor];
+            }
+        }
+    }
+    free(worklist);
+}
+
+
+/* Checks if program writes to reachable instructions */
+bool is_self_modifying(const struct DecodedInstruction code[], const bool reachable[]) {
+    for (size_t address = 0; address < MEMORY_SIZE; address++) {
+        if (!reachable[address])
+            continue;
+        switch (code[address].operation_code) {
+            case READ:
+            case STORE:
+                if (reachable[code[address].operand])
+                    return true;
+                break;
+            case READSTR:
+                /* String length is not known in advance */
+                for (size_t written = code[address].operand; written < MEMORY_SIZE; written++) {
+                    if (reachable[written])
+                        return true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+
+/* Writes C statements for instruction */
+void write_instruction(FILE *file, const size_t address, const struct DecodedInstruction instruction) {
+    const size_t operand = instruction.operand;
+    switch (instruction.operation_code) {
+        case NOP:
+            fputs("    ;\n", file);
+            break;
+        case READ:
+            fprintf(file, "    if (!read_value(&memory[0x%lX])) return EXIT_FAILURE;\n", operand);
+            break;
+        case WRITE:
+            fprintf(file, "    write_value(memory[0x%lX]);\n", operand);
+            break;
+        case READSTR:
+            fprintf(file, "    read_string(0x%lX);\n", operand);
+            break;
+        case WRITESTR:
+            fprintf(file, "    write_string(0x%lX);\n", operand);
+            break;
+        case LOAD:
+            fprintf(file, "    accumulator = memory[0x%lX];\n", operand);
+            break;
+        case STORE:
+            fprintf(file, "    memory[0x%lX] = accumulator;\n", operand);
+            break;
+        case ADD:
+            fprintf(file, "    accumulator += memory[0x%lX];\n", operand);
+            break;
+        case SUBTRACT:
+            fprintf(file, "    accumulator = memory[0x%lX] - accumulator;\n", operand);
+            break;
+        case MULTIPLY:
+            fprintf(file, "    accumulator *= memory[0x%lX];\n", operand);
+            break;
+        case DIVIDE:
+        case REMAINDER:
+            fprintf(
+                file,
+                "    if (accumulator == 0)\n"
+                "        return fault(\"*** Attempt to divide by zero at %%ld ***\\n\", %lu);\n"
+                "    accumulator = memory[0x%lX] %c accumulator;\n",
+                address, operand, instruction.operation_code == DIVIDE ? '/' : '%'
+            );
+            break;
+        case POWER:
+            fprintf(file, "    accumulator = (word_t) pow(memory[0x%lX], accumulator);\n", operand);
+            break;
+        case BRANCH:
+            fprintf(file, "    goto L_%04lX;\n", operand);
+            break;
+        case BRANCHNEG:
+            fprintf(file, "    if (accumulator < 0) goto L_%04lX;\n", operand);
+            break;
+        case BRANCHZERO:
+            fprintf(file, "    if (accumulator == 0) goto L_%04lX;\n", operand);
+            break;
+        case HALT:
+            fputs("    puts(SUCCESSMSG);\n    return EXIT_SUCCESS;\n", file);
+            break;
+        case NEGATIVE_WORD:
+            fprintf(
+                file,
+                "    printf(\"*** Invalid instruction %%d at %%d ***\\n\", %d, %lu);\n"
+                "    return EXIT_FAILURE;\n",
+                instruction.instruction_register, address
+            );
+            break;
+        default:
+            fprintf(
+                file,
+                "    printf(\"*** Invalid instruction %%X at %%X ***\\n\", %d, %lu);\n"
+                "    puts(ERRMSG);\n"
+                "    return EXIT_FAILURE;\n",
+                instruction.instruction_register, address
+            );
+            break;
+    }
+}
+
+
+int main(const int argc, char *argv[]) {
+    if (argc != 3 || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
+        show_help(argv[0]);
+        return 0;
+    }
+
+    struct Simpletron *simpletron = malloc(sizeof(struct Simpletron));
+    struct DecodedInstruction *code = malloc(MEMORY_SIZE * sizeof(struct DecodedInstruction));
+    bool *reachable = calloc(MEMORY_SIZE, sizeof(bool));
+    bool *target = calloc(MEMORY_SIZE, sizeof(bool));
+    if (simpletron == NULL || code == NULL || reachable == NULL || target == NULL) {
+        puts("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    if (!read_file_sml(simpletron, argv[1]))
+        exit(EXIT_FAILURE);
+    decode_memory(simpletron->memory, code, 0, MEMORY_SIZE);
+    find_code(code, reachable, target);
+    const bool self_modifying = is_self_modifying(code, reachable);
+
+    FILE *file = fopen(argv[2], "w");
+    if (file == NULL) {
+        puts("Error opening output file");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "/* Generated by sml2c from %s */\n", argv[1]);
+    fputs(
+        "#include <math.h>\n#include <stdint.h>\n#include <stdio.h>\n#include <stdlib.h>\n\n",
+        file
+    );
+    fprintf(
+        file,
+        "typedef int%d_t word_t;\ntypedef uint%d_t uword_t;\ntypedef int%d_t dword_t;\n\n",
+        WORD_BITS, WORD_BITS, 2 * WORD_BITS
+    );
+    fprintf(file, "#define WORD_BITS %d\n", WORD_BITS);
+    fprintf(file, "#define OPERAND_BITS %d\n", OPERAND_BITS);
+    fprintf(file, "#define MEMORY_SIZE %ldL\n", (long) MEMORY_SIZE);
+    fprintf(file, "#define CHARS_WORD %d\n", CHARS_WORD);
+    fprintf(file, "#define USER_INPUT_LENGTH %d\n", USER_INPUT_LENGTH);
+    fprintf(file, "#define MAX_VALUE %ldL\n", (long) MAX_VALUE);
+    fputs("#define ERRMSG ", file);
+    write_literal(file, ERRMSG);
+    fputs("\n#define SUCCESSMSG ", file);
+    write_literal(file, SUCCESSMSG);
+    fputs("\n\n", file);
+    if (self_modifying) {
+        const int opcodes[] = {
+            NOP, READ, WRITE, READSTR, WRITESTR, LOAD, STORE, ADD, SUBTRACT, DIVIDE,
+            MULTIPLY, REMAINDER, POWER, BRANCH, BRANCHNEG, BRANCHZERO, HALT
+        };
+        const char *names[] = {
+            "NOP", "READ", "WRITE", "READSTR", "WRITESTR", "LOAD", "STORE", "ADD", "SUBTRACT",
+            "DIVIDE", "MULTIPLY", "REMAINDER", "POWER", "BRANCH", "BRANCHNEG", "BRANCHZERO", "HALT"
+        };
+        for (size_t opcode = 0; opcode < sizeof(opcodes) / sizeof(int); opcode++)
+            fprintf(file, "#define %s 0x%02X\n", names[opcode], opcodes[opcode]);
+        fputs("\n", file);
+    }
+    write_lines(file, runtime);
+
+    fputs("\nstatic void load(void) {\n", file);
+    for (size_t address = 0; address < MEMORY_SIZE; address++) {
+        if (simpletron->memory[address] != 0)
+            fprintf(file, "    memory[0x%lX] = %d;\n", address, simpletron->memory[address]);
+    }
+    fputs("}\n\n", file);
+
+    if (self_modifying) {
+        /* Code can change at run time, keep interpreting it */
+        puts("Program modifies its own code, using embedded interpreter");
+        write_lines(file, interpreter);
+    } else {
+        fputs("static int run(void) {\n", file);
+        for (size_t address = 0; address < MEMORY_SIZE; address++) {
+            if (!reachable[address])
+                continue;
+            if (target[address])
+                fprintf(file, "L_%04lX:\n", address);
+            write_instruction(file, address, code[address]);
+        }
+        if (reachable[MEMORY_SIZE - 1] && is_sequential(code[MEMORY_SIZE - 1].operation_code)) {
+            fputs(
+                "    return fault(\"*** instructionCounter is not in range 0..%ld ***\\n\", "
+                "MEMORY_SIZE);\n",
+                file
+            );
+        }
+        fputs("}\n", file);
+    }
+    fputs("\nint main(void) {\n    load();\n    return run();\n}\n", file);
+    fclose(file);
+
+    free(simpletron);
+    free(code);
+    free(reachable);
+    free(target);
+    return 0;
+}
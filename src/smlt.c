@@ -5,81 +5,67 @@
 #include "simpletron.h"
 
 
+#define IMAGE_OPTION        "--image"
+
+
 int main(const int argc, char *argv[]) {
-    if (argc != 3 || strcmp(argv[0], "--help") == 0 || strcmp(argv[0], "-h") == 0) {
+    const bool image = argc == 4 && strcmp(argv[1], IMAGE_OPTION) == 0;
+    if ((argc != 3 && !image) || strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0) {
         puts("Usage:");
-        printf("\t%s\tFILENAME.bas OUTFILE.sml\n", argv[0]);
+        printf("\t%s\t[%s] FILENAME.bas OUTFILE.sml\n", argv[0], IMAGE_OPTION);
+        printf("\t%s\twrite compact binary image instead of text\n", IMAGE_OPTION);
+        puts("\t--word-bits=N\tword width of program (default: 16)");
         return 0;
     }
+    const char *input_filename = argv[argc - 2];
+    const char *output_filename = argv[argc - 1];
 
-    FILE *program_file = fopen(argv[1], "r");
+    FILE *program_file = fopen(input_filename, "r");
     if (program_file == NULL) {
         puts("Error opening input file");
         exit(1);
     }
 
     struct Program program;
-    char buffer[BUFFER_SIZE];
-    int line_number = 0;
-    union Identifier identifier;
-    word_t address;
-
     init_program(&program);
-
-    while (!feof(program_file)) {
-        if (fgets(buffer, BUFFER_SIZE, program_file) != NULL) {
-            line_number++;
-
-            /* Remove trailing newline symbols before tokenization */
-            buffer[strcspn(buffer, "\r\n")] = '\0';
-            strip(buffer, buffer);
-
-            /* Skip empty string */
-            if (strlen(buffer) == 0) continue;
-            if (!parse_line(&program, buffer, line_number)) {
-                printf("Error at line %d\n", line_number);
-                printf("%s\n", buffer);
-                fclose(program_file);
-                exit(EXIT_FAILURE);
-            }
-        }
+    if (!translate(&program, program_file)) {
+        fclose(program_file);
+        free_program(&program);
+        exit(EXIT_FAILURE);
     }
     fclose(program_file);
+    fprintf(
+        stderr, "Words saved by optimizer: %lu (peephole %lu, dead code %lu)\n",
+        (unsigned long) (program.saved_words + program.dead_words),
+        (unsigned long) program.saved_words, (unsigned long) program.dead_words
+    );
+    const size_t used = program.instruction_ptr + data_size(&program) + program.stack_size;
+    fprintf(
+        stderr, "Memory: %lu words of code, %lu of data, %lu of temporaries, %lu free, "
+        "%lu unused words of data dropped\n", (unsigned long) program.instruction_ptr,
+        (unsigned long) data_size(&program), (unsigned long) program.stack_size,
+        (unsigned long) (MEMORY_SIZE - used), (unsigned long) program.packed_words
+    );
 
-    /* Fill missing pointers */
-    for (
-        size_t missing_ref_list_ptr = 0;
-        missing_ref_list_ptr < program.missing_ref_list_size; 
-        missing_ref_list_ptr++
-    ) {
-        identifier.value = program.missing_ref_list[missing_ref_list_ptr].label;
-        address = search_entry(&program, identifier, LINE);
-        if (address == OBJ_NOT_FOUND) {
-            printf("Unresolved label %d\n", program.missing_ref_list[missing_ref_list_ptr].label);
+    if (image) {
+        FILE *image_file = fopen(output_filename, "wb");
+        if (image_file == NULL || !write_program_image(image_file, &program)) {
+            puts("Error writing output file");
             exit(1);
         }
-        program.memory[program.missing_ref_list[missing_ref_list_ptr].address] |= address;
-    }
-
-    /* Fill stack offsets */
-    for (
-        size_t stack_offsets_ptr = 0;
-        stack_offsets_ptr < program.stack_offset_list_size; 
-        stack_offsets_ptr++
-    ) {
-        program.memory[program.stack_offset_list[stack_offsets_ptr].address] |= (
-            program.constants_ptr - program.stack_offset_list[stack_offsets_ptr].offset
-        );
+        fclose(image_file);
+        free_program(&program);
+        return 0;
     }
 
-    FILE *sml_file = fopen(argv[2], "w");
+    FILE *sml_file = fopen(output_filename, "w");
     char char_instruction[WORD_BITS / 4 + 2];
     for (int instructionPtr = 0; instructionPtr < MEMORY_SIZE; instructionPtr++) {
-        sprintf(
-            char_instruction, "%*X\n", WORD_BITS / 4, (uword_t) program.memory[instructionPtr]
-        );
+        const word_t instruction = program_word(&program, instructionPtr);
+        sprintf(char_instruction, "%*X\n", WORD_BITS / 4, (uword_t) instruction);
         fprintf(sml_file, "%s", char_instruction);
     }
     fclose(sml_file);
+    free_program(&program);
     return 0;
 }
@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <math.h>
+#include "simpletron.h"
+#include "decode.h"
+#include "threaded.h"
+
+
+#if defined(__GNUC__)
+
+#define THREAD_CHUNK        256   /* words threaded at first, the table doubles from it */
+
+/* Threaded instruction: address of handler and decoded instruction */
+struct ThreadedInstruction {
+    const void                  *handler;
+    struct DecodedInstruction   instruction;
+};
+
+
+/* Grows table of threaded words to cover address, words are threaded from memory.
+ * Extra cell after the table gets end_handler, or grow_handler if the table does not
+ * cover all memory yet. Returns NULL if allocation fails, code is freed then */
+static struct ThreadedInstruction *grow_threaded(
+    const word_t memory[], struct ThreadedInstruction code[], size_t *size, const size_t address,
+    const void *const handlers[], const void *grow_handler, const void *end_handler
+) {
+    size_t new_size = *size == 0 ? THREAD_CHUNK : *size * 2;
+    while (new_size <= address)
+        new_size *= 2;
+    if (new_size > MEMORY_SIZE)
+        new_size = MEMORY_SIZE;
+    struct ThreadedInstruction *grown = realloc(
+        code, (new_size + 1) * sizeof(struct ThreadedInstruction)
+    );
+    if (grown == NULL) {
+        free(code);
+        return NULL;
+    }
+    for (size_t idx = *size; idx < new_size; idx++) {
+        grown[idx].instruction = decode_word(memory[idx]);
+        grown[idx].handler = handlers[grown[idx].instruction.operation_code];
+    }
+    grown[new_size].instruction = decode_word(0);
+    grown[new_size].handler = new_size < MEMORY_SIZE ? grow_handler : end_handler;
+    *size = new_size;
+    return grown;
+}
+
+
+/* Runs program with direct threading (computed goto). Words are translated to handler
+ * addresses when execution first gets to their part of memory, writes to memory
+ * translate modified words again. Extra cell after the table grows it when reached, or
+ * catches instruction counter running out of memory, so no range check is needed on
+ * dispatch, only branches check their target */
+enum Status run_threaded(struct Simpletron *simpletron) {
+    if (simpletron->instruction_counter < 0 || simpletron->instruction_counter >= MEMORY_SIZE)
+        return fault(simpletron, FAULT_COUNTER);
+
+    const void *handlers[1 << OPCODE_BITS];
+    for (size_t operation_code = 0; operation_code < (1 << OPCODE_BITS); operation_code++)
+        handlers[operation_code] = &&op_invalid;
+    handlers[NOP] = &&op_nop;
+    handlers[READ] = &&op_read;
+    handlers[WRITE] = &&op_write;
+    handlers[READSTR] = &&op_readstr;
+    handlers[WRITESTR] = &&op_writestr;
+    handlers[LOAD] = &&op_load;
+    handlers[STORE] = &&op_store;
+    handlers[ADD] = &&op_add;
+    handlers[SUBTRACT] = &&op_subtract;
+    handlers[DIVIDE] = &&op_divide;
+    handlers[MULTIPLY] = &&op_multiply;
+    handlers[REMAINDER] = &&op_remainder;
+    handlers[POWER] = &&op_power;
+    handlers[BRANCH] = &&op_branch;
+    handlers[BRANCHNEG] = &&op_branchneg;
+    handlers[BRANCHZERO] = &&op_branchzero;
+    handlers[HALT] = &&op_halt;
+    handlers[NEGATIVE_WORD] = &&op_negative;
+
+    size_t size = 0;
+    struct ThreadedInstruction *code = NULL;
+
+    /* Words out of the table are threaded when it grows */
+#define THREAD(address) \
+    do { \
+        if ((address) < size) { \
+            code[address].instruction = decode_word(memory[address]); \
+            code[address].handler = handlers[code[address].instruction.operation_code]; \
+        } \
+    } while (0)
+
+    word_t *memory = simpletron->memory;
+    const struct ThreadedInstruction *current = NULL;
+    size_t target = simpletron->instruction_counter;  /* address execution continues at */
+    struct DecodedInstruction instruction = {
+        .instruction_register=simpletron->instruction_register,
+        .operation_code=simpletron->operation_code,
+        .operand=simpletron->operand
+    };
+    struct DecodedInstruction previous;
+    word_t accumulator = simpletron->accumulator;
+    size_t last_address;
+    enum Status status;
+
+#define SYNC_AT(address) \
+    do { \
+        simpletron->instruction_counter = (word_t) (address); \
+        simpletron->accumulator = accumulator; \
+        simpletron->instruction_register = instruction.instruction_register; \
+        simpletron->operation_code = instruction.operation_code; \
+        simpletron->operand = instruction.operand; \
+    } while (0)
+#define SYNC_STATE() SYNC_AT(current - code)
+#define DISPATCH() \
+    do { \
+        previous = instruction; \
+        instruction = current->instruction; \
+        goto *(current++)->handler; \
+    } while (0)
+#define JUMP(address) \
+    do { \
+        if ((address) >= size) { \
+            target = (address); \
+            goto grow; \
+        } \
+        current = &code[address]; \
+    } while (0)
+    /* Accumulator is kept as word_t, check is the same as in execute_operation */
+#define CHECK_ACCUMULATOR() \
+    do { \
+        if (!check_value(accumulator)) { \
+            SYNC_STATE(); \
+            status = fault(simpletron, FAULT_ACCUMULATOR); \
+            goto exit; \
+        } \
+    } while (0)
+
+grow:
+    code = grow_threaded(
+        memory, code, &size, target, handlers, &&table_end, &&counter_out_of_range
+    );
+    if (code == NULL) {
+        SYNC_AT(target);
+        return fault(simpletron, FAULT_ALLOCATION);
+    }
+    current = &code[target];
+    DISPATCH();
+
+op_nop:
+    DISPATCH();
+op_read:
+    if ((status = read_value(simpletron, instruction.operand)) != SUCCESS) {
+        if (status == SUSPEND)
+            current--;
+        SYNC_STATE();
+        goto exit;
+    }
+    THREAD(instruction.operand);
+    DISPATCH();
+op_write:
+    write_value(simpletron, instruction.operand);
+    DISPATCH();
+op_readstr:
+    last_address = read_string(simpletron, instruction.operand);
+    if (last_address == SUSPENDED) {
+        current--;
+        SYNC_STATE();
+        status = SUSPEND;
+        goto exit;
+    }
+    for (size_t address = instruction.operand; address <= last_address; address++)
+        THREAD(address);
+    DISPATCH();
+op_writestr:
+    write_string(simpletron, instruction.operand);
+    DISPATCH();
+op_load:
+    accumulator = memory[instruction.operand];
+    DISPATCH();
+op_store:
+    memory[instruction.operand] = accumulator;
+    THREAD(instruction.operand);
+    DISPATCH();
+op_add:
+    accumulator += memory[instruction.operand];
+    CHECK_ACCUMULATOR();
+    DISPATCH();
+op_subtract:
+    accumulator = memory[instruction.operand] - accumulator;
+    CHECK_ACCUMULATOR();
+    DISPATCH();
+op_divide:
+    if (accumulator == 0) {
+        SYNC_STATE();
+        status = fault(simpletron, FAULT_DIVISION);
+        goto exit;
+    }
+    accumulator = memory[instruction.operand] / accumulator;
+    CHECK_ACCUMULATOR();
+    DISPATCH();
+op_multiply:
+    accumulator *= memory[instruction.operand];
+    CHECK_ACCUMULATOR();
+    DISPATCH();
+op_remainder:
+    if (accumulator == 0) {
+        SYNC_STATE();
+        status = fault(simpletron, FAULT_DIVISION);
+        goto exit;
+    }
+    accumulator = memory[instruction.operand] % accumulator;
+    CHECK_ACCUMULATOR();
+    DISPATCH();
+op_power:
+    accumulator = (word_t) pow(memory[instruction.operand], accumulator);
+    CHECK_ACCUMULATOR();
+    DISPATCH();
+op_branch:
+    JUMP(instruction.operand);
+    DISPATCH();
+op_branchneg:
+    if (accumulator < 0)
+        JUMP(instruction.operand);
+    DISPATCH();
+op_branchzero:
+    if (accumulator == 0)
+        JUMP(instruction.operand);
+    DISPATCH();
+op_halt:
+    SYNC_STATE();
+    status = halt(simpletron);
+    goto exit;
+op_negative:
+    /* execute_operation does not decode negative word */
+    SYNC_STATE();
+    simpletron->operation_code = previous.operation_code;
+    simpletron->operand = previous.operand;
+    status = fault(simpletron, FAULT_INSTRUCTION);
+    goto exit;
+op_invalid:
+    SYNC_STATE();
+    status = fault(simpletron, FAULT_INSTRUCTION);
+    goto exit;
+table_end:
+    /* Dispatched from the extra cell of table not covering all memory yet */
+    instruction = previous;
+    target = size;
+    goto grow;
+counter_out_of_range:
+    /* Dispatched from the extra cell: instruction was not fetched */
+    instruction = previous;
+    current--;
+    SYNC_STATE();
+    status = fault(simpletron, FAULT_COUNTER);
+
+exit:
+#undef CHECK_ACCUMULATOR
+#undef JUMP
+#undef DISPATCH
+#undef SYNC_STATE
+#undef SYNC_AT
+#undef THREAD
+    free(code);
+    return status;
+}
+
+#else
+
+/* Computed goto is not available, fall back to switch dispatch */
+enum Status run_threaded(struct Simpletron *simpletron) {
+    return run_decoded(simpletron);
+}
+
+#endif
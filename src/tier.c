@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include "simpletron.h"
+#include "decode.h"
+#include "fuse.h"
+#include "tier.h"
+
+
+#define TIER_THRESHOLD      64    /* taken backward branches to target before loop is promoted */
+#define TIER_REGIONS        32    /* loops promoted at once */
+#define TIER_CHUNK          256   /* words of fused code at first, it doubles from it */
+#define HOTNESS_SLOTS       1024  /* branch targets counted at once */
+#define HOTNESS_PROBES      4     /* slots tried for target before the first one is reused */
+#define COLD                0xFD  /* dispatch code of word outside promoted loops */
+
+/* Promoted loop: words from target of backward branch to the branch itself */
+struct Region {
+    size_t      from;
+    size_t      to;
+};
+
+/* Taken backward branches to target, slot with zero count is free */
+struct Hotness {
+    size_t      target;
+    unsigned    count;
+};
+
+struct Tiers {
+    struct Hotness              hotness[HOTNESS_SLOTS];  /* by hash of target */
+    struct FusedInstruction     *code;          /* fused code, NULL until first promotion */
+    size_t                      size;           /* words covered by code */
+    struct Region               regions[TIER_REGIONS];
+    size_t                      regions_size;
+};
+
+
+/* Returns counter of taken backward branches to target. When all slots tried for
+ * target count other targets, the first one is taken over and counts from zero */
+static unsigned *hotness(struct Tiers *tiers, const size_t target) {
+    for (size_t probe = 0; probe < HOTNESS_PROBES; probe++) {
+        struct Hotness *slot = &tiers->hotness[(target + probe) % HOTNESS_SLOTS];
+        if (slot->count == 0 || slot->target == target) {
+            slot->target = target;
+            return &slot->count;
+        }
+    }
+    struct Hotness *slot = &tiers->hotness[target % HOTNESS_SLOTS];
+    *slot = (struct Hotness) {.target=target, .count=0};
+    return &slot->count;
+}
+
+
+/* Sets dispatch codes of region. Its last word is a branch, so fused sequences starting
+ * in region do not reach words after it */
+static void mark_region(const struct Tiers *tiers, const struct Region *region) {
+    for (size_t address = region->from; address <= region->to; address++)
+        tiers->code[address].operation = find_fusion(tiers->code, address, tiers->size);
+}
+
+
+/* Grows fused code to cover address, new words are cold.
+ * Returns false if allocation fails, code is kept then */
+static bool grow_code(struct Tiers *tiers, const size_t address) {
+    size_t size = tiers->size == 0 ? TIER_CHUNK : tiers->size * 2;
+    while (size <= address)
+        size *= 2;
+    if (size > MEMORY_SIZE)
+        size = MEMORY_SIZE;
+    struct FusedInstruction *code = realloc(tiers->code, size * sizeof(struct FusedInstruction));
+    if (code == NULL)
+        return false;
+    for (size_t idx = tiers->size; idx < size; idx++) {
+        code[idx].instruction = decode_word(0);
+        code[idx].operation = COLD;
+    }
+    tiers->code = code;
+    tiers->size = size;
+    return true;
+}
+
+
+/* Promotes loop to fused code. Code is created on the first promotion and covers only
+ * words up to promoted loops, so short programs never pay for it. Words outside
+ * promoted loops may be outdated */
+static void promote(
+    struct Tiers *tiers, const word_t memory[], const size_t from, const size_t to
+) {
+    if (tiers->regions_size == TIER_REGIONS)
+        return;
+    if (to >= tiers->size && !grow_code(tiers, to))
+        return;
+
+    struct Region *region = &tiers->regions[tiers->regions_size++];
+    *region = (struct Region) {.from=from, .to=to};
+    for (size_t address = from; address <= to; address++)
+        tiers->code[address].instruction = decode_word(memory[address]);
+    mark_region(tiers, region);
+}
+
+
+/* Demotes loops containing words from..to back to execute_operation */
+static void demote(struct Tiers *tiers, const size_t from, const size_t to) {
+    size_t kept = 0;
+    for (size_t idx = 0; idx < tiers->regions_size; idx++) {
+        const struct Region region = tiers->regions[idx];
+        if (region.to < from || region.from > to) {
+            tiers->regions[kept++] = region;
+            continue;
+        }
+        for (size_t address = region.from; address <= region.to; address++)
+            tiers->code[address].operation = COLD;
+        *hotness(tiers, region.from) = 0;
+    }
+    tiers->regions_size = kept;
+
+    /* Nested loops may share words with demoted ones */
+    for (size_t idx = 0; idx < tiers->regions_size; idx++)
+        mark_region(tiers, &tiers->regions[idx]);
+}
+
+
+static inline bool promoted(const struct Tiers *tiers, const size_t address) {
+    return address < tiers->size && tiers->code[address].operation != COLD;
+}
+
+
+/* Operand value of instruction idx of fused sequence */
+#define VALUE(idx)          memory[cell[idx].instruction.operand]
+
+/* Fused sequence of length instructions ending with store of expression */
+#define FUSED_STORE(length, expression) \
+    accumulator = (expression); \
+    last = cell[(length) - 1].instruction; \
+    counter += (length) - 1; \
+    memory[last.operand] = accumulator; \
+    if (promoted(tiers, last.operand)) \
+        demote(tiers, last.operand, last.operand)
+
+/* Fused sequence ending with branch depending on expression */
+#define FUSED_BRANCH(expression, condition) \
+    accumulator = (expression); \
+    last = cell[1].instruction; \
+    counter = (condition) ? last.operand : counter + 1
+
+
+/* Runs promoted code until the first word which is cold or has to be executed by
+ * execute_operation (I/O, faults, HALT). Store to promoted loop demotes it */
+static enum Status run_promoted(struct Simpletron *simpletron, struct Tiers *tiers) {
+    const struct FusedInstruction *code = tiers->code;
+    word_t *memory = simpletron->memory;
+    size_t counter = simpletron->instruction_counter;
+    word_t accumulator = simpletron->accumulator;
+    struct DecodedInstruction last = {
+        .instruction_register=simpletron->instruction_register,
+        .operation_code=simpletron->operation_code,
+        .operand=simpletron->operand
+    };
+
+    for (;;) {
+        /* Words beyond fused code are cold */
+        if (counter >= tiers->size) {
+            sync_state(simpletron, counter, accumulator, &last);
+            return SUCCESS;
+        }
+        const struct FusedInstruction *cell = &code[counter++];
+        switch (cell->operation) {
+            case NOP:
+                last = cell->instruction;
+                break;
+            case LOAD:
+                last = cell->instruction;
+                accumulator = memory[last.operand];
+                break;
+            case STORE:
+                last = cell->instruction;
+                memory[last.operand] = accumulator;
+                if (promoted(tiers, last.operand))
+                    demote(tiers, last.operand, last.operand);
+                break;
+            case ADD:
+                last = cell->instruction;
+                accumulator += memory[last.operand];
+                break;
+            case SUBTRACT:
+                last = cell->instruction;
+                accumulator = memory[last.operand] - accumulator;
+                break;
+            case MULTIPLY:
+                last = cell->instruction;
+                accumulator *= memory[last.operand];
+                break;
+            case BRANCH:
+                last = cell->instruction;
+                counter = last.operand;
+                break;
+            case BRANCHNEG:
+                last = cell->instruction;
+                if (accumulator < 0)
+                    counter = last.operand;
+                break;
+            case BRANCHZERO:
+                last = cell->instruction;
+                if (accumulator == 0)
+                    counter = last.operand;
+                break;
+            case FUSED_BASE + FUSED_LOAD_STORE:
+                FUSED_STORE(2, VALUE(0));
+                break;
+            case FUSED_BASE + FUSED_LOAD_ADD_STORE:
+                FUSED_STORE(3, VALUE(0) + VALUE(1));
+                break;
+            case FUSED_BASE + FUSED_LOAD_SUBTRACT_STORE:
+                FUSED_STORE(3, VALUE(1) - VALUE(0));
+                break;
+            case FUSED_BASE + FUSED_LOAD_MULTIPLY_STORE:
+                FUSED_STORE(3, VALUE(0) * VALUE(1));
+                break;
+            case FUSED_BASE + FUSED_LOAD_BRANCHNEG:
+                FUSED_BRANCH(VALUE(0), accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_LOAD_BRANCHZERO:
+                FUSED_BRANCH(VALUE(0), accumulator == 0);
+                break;
+            case FUSED_BASE + FUSED_ADD_BRANCHNEG:
+                FUSED_BRANCH(accumulator + VALUE(0), accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_ADD_BRANCHZERO:
+                FUSED_BRANCH(accumulator + VALUE(0), accumulator == 0);
+                break;
+            case FUSED_BASE + FUSED_SUBTRACT_BRANCHNEG:
+                FUSED_BRANCH(VALUE(0) - accumulator, accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_SUBTRACT_BRANCHZERO:
+                FUSED_BRANCH(VALUE(0) - accumulator, accumulator == 0);
+                break;
+            case FUSED_BASE + FUSED_MULTIPLY_BRANCHNEG:
+                FUSED_BRANCH(accumulator * VALUE(0), accumulator < 0);
+                break;
+            case FUSED_BASE + FUSED_MULTIPLY_BRANCHZERO:
+                FUSED_BRANCH(accumulator * VALUE(0), accumulator == 0);
+                break;
+            default:
+                sync_state(simpletron, counter - 1, accumulator, &last);
+                return SUCCESS;
+        }
+        if (!check_value(accumulator)) {
+            sync_state(simpletron, counter, accumulator, &last);
+            return fault(simpletron, FAULT_ACCUMULATOR);
+        }
+    }
+}
+
+
+/*
+ * Runs program with execute_operation, counting taken backward branches. Loop which
+ * branches back to the same target TIER_THRESHOLD times is promoted to fused code,
+ * any write to its words demotes it again.
+ */
+enum Status run_tiered(struct Simpletron *simpletron) {
+    struct Tiers tiers = {.code=NULL, .size=0, .regions_size=0};
+
+    enum Status status = SUCCESS;
+    while (status == SUCCESS) {
+        const word_t address = simpletron->instruction_counter;
+        if (address >= 0 && address < MEMORY_SIZE && promoted(&tiers, address)) {
+            /* Word where promoted code stopped is executed below */
+            if ((status = run_promoted(simpletron, &tiers)) != SUCCESS)
+                break;
+        }
+
+        const word_t counter = simpletron->instruction_counter;
+        if ((status = execute_operation(simpletron)) != SUCCESS)
+            break;
+        const size_t operand = simpletron->operand;
+        switch (simpletron->operation_code) {
+            case READ:
+            case STORE:
+                if (promoted(&tiers, operand))
+                    demote(&tiers, operand, operand);
+                break;
+            case READSTR:
+                if (tiers.code != NULL)
+                    demote(&tiers, operand, operand + STRING_LENGTH / CHARS_WORD);
+                break;
+            case BRANCH:
+            case BRANCHNEG:
+            case BRANCHZERO:
+                if (
+                    simpletron->instruction_counter == (word_t) operand
+                    && (word_t) operand <= counter && ++*hotness(&tiers, operand) == TIER_THRESHOLD
+                )
+                    promote(&tiers, simpletron->memory, operand, counter);
+                break;
+            default:
+                break;
+        }
+    }
+    free(tiers.code);
+    return status;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "simpletron.h"
+
+
+enum Status run_tiered(struct Simpletron *);
@@ -0,0 +1,345 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simpletron.h"
+#include "engine.h"
+#include "trace.h"
+
+
+static const char *event_names[] = {
+    [TRACE_READ]="READ", [TRACE_WRITE]="WRITE", [TRACE_READSTR]="READSTR",
+    [TRACE_WRITESTR]="WRITESTR", [TRACE_INVALID]="invalid READ", [TRACE_END]="end"
+};
+
+
+static void put_varint(FILE *file, uint64_t value) {
+    while (value >= 0x80) {
+        fputc((int) (value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int) value, file);
+}
+
+
+static bool get_varint(struct Trace *trace, uint64_t *value) {
+    *value = 0;
+    for (unsigned shift = 0; trace->position < trace->size && shift < 64; shift += 7) {
+        const unsigned char byte = trace->data[trace->position++];
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+
+/* Zigzag coding keeps small negative values short */
+static uint64_t zigzag(const int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+
+static int64_t unzigzag(const uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+
+/* Starts event of recorded trace */
+static void put_event(struct Trace *trace, const enum TraceEvent kind) {
+    fputc(kind, trace->file);
+    put_varint(trace->file, trace->steps - trace->event_steps);
+    trace->event_steps = trace->steps;
+    trace->events++;
+}
+
+
+static enum Status record_read_value(void *context, word_t *value) {
+    struct Trace *trace = context;
+    const enum Status status = trace->io->read_value(trace->io->context, value);
+    if (status == SUSPEND)
+        return status;  /* Recorded when READ is executed again */
+    if (status != SUCCESS) {
+        put_event(trace, TRACE_INVALID);
+        return status;
+    }
+    put_event(trace, TRACE_READ);
+    put_varint(trace->file, zigzag(*value));
+    return status;
+}
+
+
+static void record_write_value(void *context, const word_t value) {
+    struct Trace *trace = context;
+    trace->io->write_value(trace->io->context, value);
+    put_event(trace, TRACE_WRITE);
+    put_varint(trace->file, zigzag(value));
+}
+
+
+static size_t record_read_string(void *context, char string[], const size_t size) {
+    struct Trace *trace = context;
+    const size_t length = trace->io->read_string(trace->io->context, string, size);
+    if (length == SUSPENDED)
+        return length;
+    put_event(trace, TRACE_READSTR);
+    put_varint(trace->file, length);
+    fwrite(string, 1, length, trace->file);
+    return length;
+}
+
+
+static void record_write_string(void *context, const char string[]) {
+    struct Trace *trace = context;
+    trace->io->write_string(trace->io->context, string);
+    put_event(trace, TRACE_WRITESTR);
+    put_varint(trace->file, strlen(string));
+    fputs(string, trace->file);
+}
+
+
+static void record_report(void *context, const enum Status status, const char message[]) {
+    const struct Trace *trace = context;
+    trace->io->report(trace->io->context, status, message);
+}
+
+
+/* Passes I/O to recorded channel and writes it to trace */
+const struct SimpletronIO record_io = {
+    .read_value=record_read_value,
+    .write_value=record_write_value,
+    .read_string=record_read_string,
+    .write_string=record_write_string,
+    .report=record_report,
+    .context=NULL
+};
+
+
+/* Keeps description of the first mismatch */
+static void mismatch(struct Trace *trace, const char description[]) {
+    if (trace->mismatches++ == 0)
+        snprintf(
+            trace->mismatch, MESSAGE_LENGTH, "event %lu after %lu instructions: %s",
+            trace->events, trace->steps, description
+        );
+}
+
+
+/* Takes the next event of replayed trace if it is of expected kinds,
+ * once replay diverged from trace no more events are taken */
+static bool take_event(
+    struct Trace *trace, const enum TraceEvent expected, const enum TraceEvent other,
+    enum TraceEvent *kind
+) {
+    char description[MESSAGE_LENGTH];
+    uint64_t steps;
+    const size_t start = trace->position;
+
+    trace->events++;
+    if (trace->position >= trace->size) {
+        snprintf(description, MESSAGE_LENGTH, "%s after end of trace", event_names[expected]);
+        mismatch(trace, description);
+        return false;
+    }
+    *kind = trace->data[trace->position++];
+    if ((*kind != expected && *kind != other) || !get_varint(trace, &steps)) {
+        snprintf(
+            description, MESSAGE_LENGTH, "%s, %s in trace", event_names[expected],
+            *kind <= TRACE_END ? event_names[*kind] : "invalid event"
+        );
+        mismatch(trace, description);
+        trace->position = start;
+        trace->size = start;  /* Diverged */
+        return false;
+    }
+    if (trace->counted && steps != trace->steps - trace->event_steps) {
+        snprintf(
+            description, MESSAGE_LENGTH, "%s %lu instructions after previous event, "
+            "%lu in trace", event_names[*kind], trace->steps - trace->event_steps,
+            (unsigned long) steps
+        );
+        mismatch(trace, description);
+    }
+    trace->event_steps = trace->steps;
+    return true;
+}
+
+
+static enum Status replay_read_value(void *context, word_t *value) {
+    struct Trace *trace = context;
+    enum TraceEvent kind;
+    uint64_t encoded;
+    if (!take_event(trace, TRACE_READ, TRACE_INVALID, &kind) || kind == TRACE_INVALID)
+        return FAIL;
+    if (!get_varint(trace, &encoded))
+        return FAIL;
+    *value = (word_t) unzigzag(encoded);
+    return SUCCESS;
+}
+
+
+static void replay_write_value(void *context, const word_t value) {
+    struct Trace *trace = context;
+    enum TraceEvent kind;
+    uint64_t encoded;
+    if (!take_event(trace, TRACE_WRITE, TRACE_WRITE, &kind) || !get_varint(trace, &encoded))
+        return;
+    if (unzigzag(encoded) != value) {
+        char description[MESSAGE_LENGTH];
+        snprintf(
+            description, MESSAGE_LENGTH, "WRITE %d, %ld in trace", value,
+            (long) unzigzag(encoded)
+        );
+        mismatch(trace, description);
+    }
+}
+
+
+/* Takes characters of string event, returns NULL if trace is too short */
+static const char *take_string(struct Trace *trace, size_t *length) {
+    uint64_t encoded;
+    if (!get_varint(trace, &encoded) || encoded > trace->size - trace->position)
+        return NULL;
+    *length = encoded;
+    trace->position += encoded;
+    return (const char *) trace->data + trace->position - encoded;
+}
+
+
+static size_t replay_read_string(void *context, char string[], const size_t size) {
+    struct Trace *trace = context;
+    enum TraceEvent kind;
+    size_t length;
+    const char *recorded;
+    if (
+        !take_event(trace, TRACE_READSTR, TRACE_READSTR, &kind)
+        || (recorded = take_string(trace, &length)) == NULL
+    )
+        return 0;
+    length = length < size ? length : size;
+    memcpy(string, recorded, length);
+    return length;
+}
+
+
+static void replay_write_string(void *context, const char string[]) {
+    struct Trace *trace = context;
+    enum TraceEvent kind;
+    size_t length;
+    const char *recorded;
+    if (
+        !take_event(trace, TRACE_WRITESTR, TRACE_WRITESTR, &kind)
+        || (recorded = take_string(trace, &length)) == NULL
+    )
+        return;
+    if (length != strlen(string) || memcmp(recorded, string, length) != 0)
+        mismatch(trace, "WRITESTR string differs from trace");
+}
+
+
+static void replay_report(void *context, const enum Status status, const char message[]) {
+    (void) context;
+    (void) status;
+    (void) message;
+}
+
+
+/* Feeds input from trace and compares output with it, nothing is printed */
+const struct SimpletronIO replay_io = {
+    .read_value=replay_read_value,
+    .write_value=replay_write_value,
+    .read_string=replay_read_string,
+    .write_string=replay_write_string,
+    .report=replay_report,
+    .context=NULL
+};
+
+
+bool open_record(struct Trace *trace, FILE *file, const struct SimpletronIO *io) {
+    memset(trace, 0, sizeof(struct Trace));
+    trace->file = file;
+    trace->io = io;
+    trace->counted = true;
+    fputs(TRACE_MAGIC, file);
+    fputc(TRACE_VERSION, file);
+    fputc(WORD_BITS, file);
+    return !ferror(file);
+}
+
+
+/* Writes end of program with its status */
+bool close_record(struct Trace *trace, const enum Status status) {
+    put_event(trace, TRACE_END);
+    fputc(status, trace->file);
+    return !ferror(trace->file);
+}
+
+
+/* Reads whole trace from file and checks its header */
+bool open_replay(struct Trace *trace, FILE *file) {
+    size_t capacity = 4096, result;
+
+    memset(trace, 0, sizeof(struct Trace));
+    trace->data = malloc(capacity);
+    while (
+        trace->data != NULL
+        && (result = fread(trace->data + trace->size, 1, capacity - trace->size, file)) > 0
+    ) {
+        trace->size += result;
+        if (trace->size == capacity) {
+            unsigned char *resized = realloc(trace->data, capacity *= 2);
+            if (resized == NULL)
+                free(trace->data);
+            trace->data = resized;
+        }
+    }
+    const size_t header_size = strlen(TRACE_MAGIC) + 2;
+    if (
+        trace->data == NULL || ferror(file) || trace->size < header_size
+        || memcmp(trace->data, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0
+        || trace->data[header_size - 2] != TRACE_VERSION
+        || trace->data[header_size - 1] != WORD_BITS
+    ) {
+        free(trace->data);
+        trace->data = NULL;
+        return false;
+    }
+    trace->position = header_size;
+    return true;
+}
+
+
+/* Checks that program terminated like in trace and frees trace,
+ * returns true if replay matched trace */
+bool close_replay(struct Trace *trace, const enum Status status) {
+    enum TraceEvent kind;
+    if (take_event(trace, TRACE_END, TRACE_END, &kind)) {
+        if (trace->position >= trace->size || trace->data[trace->position] != status)
+            mismatch(trace, "program terminated differently");
+        else if (trace->position + 1 != trace->size)
+            mismatch(trace, "events after end of program");
+    }
+    free(trace->data);
+    trace->data = NULL;
+    return trace->mismatches == 0;
+}
+
+
+/*
+ * Runs program with trace as context of its io. NULL engine steps with execute_operation
+ * counting instructions, so counts are recorded and checked, engines can not count.
+ */
+enum Status run_traced(
+    struct Simpletron *simpletron, const struct Engine *engine, struct Trace *trace
+) {
+    enum Status status;
+
+    if (engine != NULL) {
+        trace->counted = false;
+        return engine->run(simpletron);
+    }
+    trace->counted = true;
+    do {
+        trace->steps++;
+        status = execute_operation(simpletron);
+    } while (status == SUCCESS);
+    return status;
+}
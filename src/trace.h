@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdio.h>
+#include "simpletron.h"
+#include "engine.h"
+
+
+/*
+ * Trace of program I/O:
+ * header   "SMLT", uint8 TRACE_VERSION, uint8 WORD_BITS
+ * event    uint8 kind, varint instructions executed since previous event, payload:
+ *          READ and WRITE zigzag varint value, READSTR and WRITESTR varint length and
+ *          characters, INVALID nothing, END uint8 status.
+ * Varints are 7 bits per byte, least significant first, high bit set on all but last byte.
+ */
+#define TRACE_MAGIC         "SMLT"
+#define TRACE_VERSION       1
+
+enum TraceEvent {
+    TRACE_READ, TRACE_WRITE, TRACE_READSTR, TRACE_WRITESTR,
+    TRACE_INVALID,                              /* READ got invalid input */
+    TRACE_END                                   /* program terminated */
+};
+
+struct Trace {
+    FILE                        *file;          /* recorded trace, NULL on replay */
+    const struct SimpletronIO   *io;            /* recorded channel */
+    unsigned char               *data;          /* replayed trace */
+    size_t                      size;
+    size_t                      position;
+    bool                        counted;        /* instructions are counted in steps */
+    unsigned long               steps;          /* executed instructions */
+    unsigned long               event_steps;    /* steps at previous event */
+    unsigned long               events;
+    unsigned long               mismatches;     /* replayed events different from trace */
+    char                        mismatch[MESSAGE_LENGTH];  /* description of the first one */
+};
+
+extern const struct SimpletronIO record_io;
+extern const struct SimpletronIO replay_io;
+
+bool open_record(struct Trace *, FILE *, const struct SimpletronIO *);
+bool close_record(struct Trace *, const enum Status);
+bool open_replay(struct Trace *, FILE *);
+bool close_replay(struct Trace *, const enum Status);
+enum Status run_traced(struct Simpletron *, const struct Engine *, struct Trace *);
@@ -1,24 +1,184 @@
 #include <ctype.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "simpletron.h"
 #include "translator.h"
 #include "evaluate.h"
+#include "optimize.h"
 
 
 
+/* Program starts with empty buffers, they grow as source is translated */
 void init_program(struct Program *program) {
-    for (size_t ptr = 0; ptr < MEMORY_SIZE; ptr++) {
-        program->memory[ptr] = 0;
+    *program = (struct Program) {.constants_ptr=MEMORY_SIZE - 1, .error=TRANSLATE_OK};
+}
+
+
+void free_program(struct Program *program) {
+    free(program->lookup_list);
+    free(program->lookup_table);
+    free(program->missing_ref_list);
+    free(program->for_stack);
+    free(program->stack_offset_list);
+    free(program->code);
+    free(program->data);
+    init_program(program);
+}
+
+
+/* Returns items with room for size + 1 of them, capacity is doubled when full.
+ * Returns NULL and marks program failed if allocation fails */
+static void *grow(
+    struct Program *program,
+    void *items,
+    size_t *capacity,
+    const size_t size,
+    const size_t item_size
+) {
+    if (size < *capacity)
+        return items;
+    const size_t new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+    void *resized = realloc(items, new_capacity * item_size);
+    if (resized == NULL) {
+        program->error = TRANSLATE_ALLOCATION;
+        return NULL;
+    }
+    *capacity = new_capacity;
+    return resized;
+}
+
+
+/* Words of program: code from address 0 up, data from MEMORY_SIZE - 1 down */
+size_t data_size(const struct Program *program) {
+    return MEMORY_SIZE - 1 - program->constants_ptr;
+}
+
+
+/* Appends instruction to code. Code may overlap data until translation ends, optimized
+ * code is checked against data then */
+bool emit(struct Program *program, const word_t instruction) {
+    if (program->instruction_ptr >= MEMORY_SIZE) {
+        program->error = TRANSLATE_OVERFLOW;
+        return false;
+    }
+    word_t *code = grow(
+        program, program->code, &program->code_capacity, program->instruction_ptr, sizeof(word_t)
+    );
+    if (code == NULL)
+        return false;
+    program->code = code;
+    program->code[program->instruction_ptr++] = instruction;
+    return true;
+}
+
+
+/* Takes next word of data for constant or variable */
+static bool reserve_data(struct Program *program, const word_t value) {
+    const size_t size = data_size(program);
+    if (size >= MEMORY_SIZE) {
+        program->error = TRANSLATE_OVERFLOW;
+        return false;
+    }
+    word_t *data = grow(program, program->data, &program->data_capacity, size, sizeof(word_t));
+    if (data == NULL)
+        return false;
+    program->data = data;
+    program->data[size] = value;
+    program->constants_ptr--;
+    return true;
+}
+
+
+/* Returns word of program memory at address */
+word_t program_word(const struct Program *program, const size_t address) {
+    if (address < (size_t) program->instruction_ptr)
+        return program->code[address];
+    if (address > (size_t) program->constants_ptr && address < MEMORY_SIZE)
+        return program->data[MEMORY_SIZE - 1 - address];
+    return 0;
+}
+
+
+/* Writes program as image of two parts, code and data, without the gap between them */
+bool write_program_image(FILE *file, const struct Program *program) {
+    const size_t size = data_size(program);
+    word_t *data = malloc((size > 0 ? size : 1) * sizeof(word_t));
+    if (data == NULL)
+        return false;
+    for (size_t idx = 0; idx < size; idx++)
+        data[idx] = program->data[size - 1 - idx];
+    const struct ImagePart parts[2] = {
+        {.address=0, .words=program->code, .length=program->instruction_ptr},
+        {.address=MEMORY_SIZE - size, .words=data, .length=size}
+    };
+    const bool written = write_image_parts(file, parts, 2);
+    free(data);
+    return written;
+}
+
+
+/* FNV-1a hash of type and name (for variable) or value (for constant or line number) */
+static size_t hash_entry(
+    const union Identifier *identifier, const enum EntryType type, const size_t slots
+) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *bytes = (const unsigned char *) identifier;
+    size_t size = sizeof(identifier->value);
+    if (type == VAR)
+        for (size = 0; size < IDENTIFIER_SIZE && identifier->name[size] != '\0'; size++);
+
+    hash = (hash ^ (unsigned char) type) * 16777619u;
+    for (size_t idx = 0; idx < size; idx++)
+        hash = (hash ^ bytes[idx]) * 16777619u;
+    return hash & (slots - 1);
+}
+
+
+static bool match_entry(
+    const struct LookupListEntry *entry,
+    const union Identifier *identifier,
+    const enum EntryType type
+) {
+    if (entry->type != type)
+        return false;
+    if (type == VAR)
+        return strncmp(entry->identifier.name, identifier->name, IDENTIFIER_SIZE) == 0;
+    return entry->identifier.value == identifier->value;
+}
+
+
+/* Finds slot of lookup table holding object, or free slot where it belongs */
+static size_t find_slot(
+    const struct Program *program, const union Identifier *identifier, const enum EntryType type
+) {
+    size_t slot = hash_entry(identifier, type, program->lookup_slots);
+    while (
+        program->lookup_table[slot] != 0
+        && !match_entry(&program->lookup_list[program->lookup_table[slot] - 1], identifier, type)
+    )
+        slot = (slot + 1) & (program->lookup_slots - 1);
+    return slot;
+}
+
+
+/* Doubles lookup table and places every entry again, table is kept at most half full */
+static bool grow_lookup_table(struct Program *program) {
+    const size_t slots = program->lookup_slots == 0 ? 64 : program->lookup_slots * 2;
+    size_t *table = calloc(slots, sizeof(size_t));
+    if (table == NULL) {
+        program->error = TRANSLATE_ALLOCATION;
+        return false;
     }
-    program->instruction_ptr = 0;
-    program->constants_ptr = MEMORY_SIZE - 1;
-    program->stack_ptr = 0;
-    program->lookup_list_size = 0;
-    program->missing_ref_list_size = 0;
-    program->for_ptr = 0;
-    program->stack_offset_list_size = 0;
+    free(program->lookup_table);
+    program->lookup_table = table;
+    program->lookup_slots = slots;
+    for (size_t idx = 0; idx < program->lookup_list_size; idx++) {
+        const struct LookupListEntry *entry = &program->lookup_list[idx];
+        program->lookup_table[find_slot(program, &entry->identifier, entry->type)] = idx + 1;
+    }
+    return true;
 }
 
 
@@ -28,28 +188,10 @@ word_t search_entry (
     const union Identifier identifier,
     const enum EntryType type
 ) {
-    for (
-        size_t lookup_list_ptr = 0; lookup_list_ptr < program->lookup_list_size; lookup_list_ptr++
-    ) {
-        /* Check for matching type and name (for variable) or value (for constant or line number )*/
-        if (
-            (
-                type == VAR
-                && type == program->lookup_list[lookup_list_ptr].type
-                && strcmp(
-                    program->lookup_list[lookup_list_ptr].identifier.name, identifier.name
-                ) == 0
-            )
-            || (
-                (type == CONST || type == LINE)
-                && type == program->lookup_list[lookup_list_ptr].type
-                && program->lookup_list[lookup_list_ptr].identifier.value == identifier.value
-            )
-        ) {
-            return program->lookup_list[lookup_list_ptr].address;
-        }
-    }
-    return OBJ_NOT_FOUND;
+    if (program->lookup_slots == 0)
+        return OBJ_NOT_FOUND;
+    const size_t index = program->lookup_table[find_slot(program, &identifier, type)];
+    return index == 0 ? OBJ_NOT_FOUND : (word_t) program->lookup_list[index - 1].address;
 }
 
 /* Adds object to lookup list */
@@ -58,22 +200,30 @@ word_t add_entry(
     const union Identifier identifier,
     const enum EntryType type
 ) {
-    program->lookup_list[program->lookup_list_size].identifier = identifier;
-    program->lookup_list[program->lookup_list_size].type = type;
+    if (2 * (program->lookup_list_size + 1) > program->lookup_slots && !grow_lookup_table(program))
+        return OBJ_NOT_FOUND;
+    struct LookupListEntry *list = grow(
+        program, program->lookup_list, &program->lookup_list_capacity,
+        program->lookup_list_size, sizeof(struct LookupListEntry)
+    );
+    if (list == NULL)
+        return OBJ_NOT_FOUND;
+    program->lookup_list = list;
 
+    struct LookupListEntry *entry = &program->lookup_list[program->lookup_list_size];
+    entry->identifier = identifier;
+    entry->type = type;
     if (type == LINE) {
-        program->lookup_list[program->lookup_list_size].address = program->instruction_ptr;
+        entry->address = program->instruction_ptr;
     } else {
-        /* Reserving memory */
-        program->lookup_list[program->lookup_list_size].address = program->constants_ptr;
-        if (type == CONST) {
-            /* Writing constant value to memory */
-            program->memory[program->constants_ptr] = identifier.value;
-        }
-        program->constants_ptr--;
+        /* Reserving memory, constant value is written to it */
+        entry->address = program->constants_ptr;
+        if (!reserve_data(program, type == CONST ? identifier.value : 0))
+            return OBJ_NOT_FOUND;
     }
+    program->lookup_table[find_slot(program, &identifier, type)] = program->lookup_list_size + 1;
     program->lookup_list_size++;
-    return program->lookup_list[program->lookup_list_size - 1].address;
+    return entry->address;
 }
 
 /* Searches object's memory address in lookup list 
@@ -91,6 +241,13 @@ word_t search_or_add_entry(
 
 /* Saves reference to line, that was not still processed */
 void remember_missing_reference(struct Program *program, const int identifier) {
+    struct MissingRefListEntry *list = grow(
+        program, program->missing_ref_list, &program->missing_ref_list_capacity,
+        program->missing_ref_list_size, sizeof(struct MissingRefListEntry)
+    );
+    if (list == NULL)
+        return;
+    program->missing_ref_list = list;
     program->missing_ref_list[program->missing_ref_list_size++] = (struct MissingRefListEntry) {
         .label=identifier, .address=program->instruction_ptr
     };
@@ -99,9 +256,18 @@ void remember_missing_reference(struct Program *program, const int identifier) {
 
 /* Saves stack offset for instruction at specified address */
 void remember_stack_offset(struct Program *program, const word_t address, const word_t offset) {
+    struct StackOffsetEntry *list = grow(
+        program, program->stack_offset_list, &program->stack_offset_list_capacity,
+        program->stack_offset_list_size, sizeof(struct StackOffsetEntry)
+    );
+    if (list == NULL)
+        return;
+    program->stack_offset_list = list;
     program->stack_offset_list[program->stack_offset_list_size++] = (struct StackOffsetEntry) {
         .address=address, .offset=offset
     };
+    if ((size_t) offset + 1 > program->stack_size)
+        program->stack_size = offset + 1;
 }
 
 
@@ -193,7 +359,7 @@ bool parse_line(struct Program *program, char line[], const int line_number) {
     else if (strcmp("next", token) == 0) return parse_for_end(program, line, line_number);
     else if (strcmp("end", token) == 0) {
         const word_t instruction = HALT << OPERAND_BITS;
-        program->memory[program->instruction_ptr++] = instruction;
+        emit(program, instruction);
         return true;
     } else {
         printf("Wrong token '%s' on line %d\n", token, line_number);
@@ -228,7 +394,7 @@ bool parse_input(struct Program *program, char line[], const int line_number) {
             return false;
         }
         instruction = READ << OPERAND_BITS | address;
-        program->memory[program->instruction_ptr++] = instruction;
+        emit(program, instruction);
         token = strtok(NULL, " ,");
     }
     return true;
@@ -260,7 +426,7 @@ bool parse_print(struct Program *program, char line[], const int line_number) {
             return false;
         }
         instruction = WRITE << OPERAND_BITS | address;
-        program->memory[program->instruction_ptr++] = instruction;
+        emit(program, instruction);
         token = strtok(NULL, " ,");
     }
     return true;
@@ -294,7 +460,7 @@ bool parse_goto(struct Program *program, char line[], const int line_number) {
         address = 0;
     }
     instruction = BRANCH << OPERAND_BITS | address;
-    program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     return true;
 }
 
@@ -339,7 +505,7 @@ bool parse_let(struct Program *program, char line[], const int line_number) {
         return false;
     }
     const word_t instruction = STORE << OPERAND_BITS | address;
-    program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     return true;
 }
 
@@ -443,44 +609,61 @@ bool parse_if(struct Program *program, char line[], const int line_number) {
             return false;
     }
 
+    struct ExpressionNode nodes[MAX_TOKENS];
+    size_t root;
     if (
         !check_expression(transformed_expression) 
-        || !evaluate_expression(transformed_expression, program)
+        || !parse_expression(transformed_expression, program, nodes, &root)
     ) {
         printf("Invalid expression '%s' on line %d\n", buffer, line_number);
         return false;
     }
 
+    /* Constant condition becomes GOTO or nothing */
+    if (nodes[root].constant) {
+        const word_t value = nodes[root].value;
+        if (
+            (value < 0 && comparison != EQ)
+            || (value == 0 && comparison != LT && comparison != GT && comparison != NE)
+            || (value > 0 && comparison == NE)
+        ) {
+            if (add_missing) remember_missing_reference(program, identifier.value);
+            emit(program, BRANCH << OPERAND_BITS | address);
+        }
+        return true;
+    }
+    generate_expression(program, nodes, root);
+
     switch (comparison) {
         case LE:
         case GE:
             if (add_missing) remember_missing_reference(program, identifier.value);
             instruction = BRANCHNEG << OPERAND_BITS | address;
-            program->memory[program->instruction_ptr++] = instruction;
+            emit(program, instruction);
             if (add_missing) remember_missing_reference(program, identifier.value);
             instruction = BRANCHZERO << OPERAND_BITS | address;
-            program->memory[program->instruction_ptr++] = instruction;
+            emit(program, instruction);
             break;
         case LT:
         case GT:
             if (add_missing) remember_missing_reference(program, identifier.value);
             instruction = BRANCHNEG << OPERAND_BITS | address;
-            program->memory[program->instruction_ptr++] = instruction;
+            emit(program, instruction);
             break;
         case EQ:
             if (add_missing) remember_missing_reference(program, identifier.value);
             instruction = BRANCHZERO << OPERAND_BITS | address;
-            program->memory[program->instruction_ptr++] = instruction;
+            emit(program, instruction);
             break;
         case NE:
             /* If equal, skip next instruction */
             size_t fakeaddr = program->instruction_ptr + 2;
             instruction = BRANCHZERO << OPERAND_BITS | fakeaddr;
-            program->memory[program->instruction_ptr++] = instruction;
+            emit(program, instruction);
             /* Otherwise (not equal) go to specified line */
             if (add_missing) remember_missing_reference(program, identifier.value);
             instruction = BRANCH << OPERAND_BITS | address ;
-            program->memory[program->instruction_ptr++] = instruction;
+            emit(program, instruction);
             break;
         default:
             printf(
@@ -597,11 +780,18 @@ bool parse_for(struct Program *program, char line[], const int line_number) {
         }
     }
     instruction = LOAD << OPERAND_BITS | from_address;
-    program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     instruction = STORE << OPERAND_BITS | var_address;
-    program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
 
     /* Save to stack current instruction pointer. Will return here on NEXT keyword */
+    struct ForEntry *stack = grow(
+        program, program->for_stack, &program->for_stack_capacity, program->for_ptr,
+        sizeof(struct ForEntry)
+    );
+    if (stack == NULL)
+        return false;
+    program->for_stack = stack;
     program->for_stack[program->for_ptr++] = (struct ForEntry) {
         .cycle_begin_address=program->instruction_ptr,
         .var_address=var_address,
@@ -625,121 +815,350 @@ bool parse_for_end(struct Program *program, char line[], const int line_number)
         return false;
     }
 
+    if (program->for_ptr == 0) {
+        printf("NEXT without FOR on line %d\n", line_number);
+        return false;
+    }
     const struct ForEntry entry = program->for_stack[--program->for_ptr];
     /* increment and save variable */
     instruction = LOAD << OPERAND_BITS | entry.var_address;
-    instruction = program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     instruction = ADD << OPERAND_BITS | entry.step_address;
-    instruction = program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     instruction = STORE << OPERAND_BITS | entry.var_address;
-    instruction = program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     /* Compare variable and end value */
     instruction = LOAD << OPERAND_BITS | entry.to_address;
-    instruction = program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     instruction = SUBTRACT << OPERAND_BITS | entry.var_address;
-    instruction = program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     instruction = BRANCHZERO << OPERAND_BITS | entry.cycle_begin_address;
-    instruction = program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     instruction = BRANCHNEG << OPERAND_BITS | entry.cycle_begin_address;
-    instruction = program->memory[program->instruction_ptr++] = instruction;
+    emit(program, instruction);
     return true;
 }
 
 
-bool evaluate_expression(char buffer[], struct Program *program) {
-    /* Evaluates expression and places result into accumulator */
-    word_t instruction;
-    /* Tokenizing */
-    size_t num_tokens;
-    struct ExpressionToken expression_tokens[MAX_TOKENS];
-    if (!tokenize_expression(buffer, expression_tokens, &num_tokens)) {        
-        printf("Invalid expression '%s'\n", buffer);
+/* Returns opcode of arithmetic operation, 0 for unknown one */
+static word_t operation_code(const char operation) {
+    switch (operation) {
+        case '+':
+            return ADD;
+        case '-':
+            return SUBTRACT;
+        case '*':
+            return MULTIPLY;
+        case '/':
+            return DIVIDE;
+        case '%':
+            return REMAINDER;
+        case '^':
+            return POWER;
+        default:
+            return 0;
+    }
+}
+
+
+static bool is_commutative(const char operation) {
+    return operation == '+' || operation == '*';
+}
+
+
+static bool is_leaf(const struct ExpressionNode *node) {
+    return node->operation == '\0';
+}
+
+
+static bool is_constant(const struct ExpressionNode *node, const word_t value) {
+    return is_leaf(node) && node->constant && node->value == value;
+}
+
+
+/* Sets number of temporaries node needs. Arithmetic instructions take the left operand
+ * from memory and the right one from accumulator, so a left operand which is not a leaf
+ * is spilled to stack while the right one is evaluated */
+static void count_temporaries(struct ExpressionNode nodes[], const size_t node) {
+    struct ExpressionNode *current = &nodes[node];
+    if (is_leaf(current)) {
+        current->temporaries = 0;
+        return;
+    }
+    const struct ExpressionNode *left = &nodes[current->left];
+    const struct ExpressionNode *right = &nodes[current->right];
+    if (is_leaf(left)) {
+        current->temporaries = right->temporaries;
+    } else if (is_commutative(current->operation) && is_leaf(right)) {
+        current->temporaries = left->temporaries;
+    } else {
+        const struct ExpressionNode *first = left, *second = right;
+        if (is_commutative(current->operation) && right->temporaries > left->temporaries) {
+            first = right;
+            second = left;
+        }
+        current->temporaries = first->temporaries > second->temporaries + 1
+            ? first->temporaries : second->temporaries + 1;
+    }
+}
+
+
+/*
+ * Computes operation on constants the way the VM does, result wraps to word. Returns
+ * false if the result is left to runtime: division by zero faults there, division of
+ * the smallest word by -1 and power out of word range are not defined.
+ */
+static bool fold_operation(
+    const char operation, const word_t left, const word_t right, word_t *result
+) {
+    const word_t smallest = (word_t) ((uword_t) 1 << (WORD_BITS - 1));
+    switch (operation) {
+        case '+':
+            *result = (word_t) ((dword_t) left + right);
+            return true;
+        case '-':
+            *result = (word_t) ((dword_t) left - right);
+            return true;
+        case '*':
+            *result = (word_t) ((dword_t) left * right);
+            return true;
+        case '/':
+        case '%':
+            if (right == 0 || (left == smallest && right == -1))
+                return false;
+            *result = operation == '/' ? left / right : left % right;
+            return true;
+        case '^': {
+            const double power = pow(left, right);
+            if (!(power >= smallest && power <= -(smallest + 1)))
+                return false;
+            *result = (word_t) power;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+
+/* Checks if evaluation of node may stop with division by zero */
+static bool may_fault(const struct ExpressionNode nodes[], const size_t node) {
+    const struct ExpressionNode *current = &nodes[node];
+    if (is_leaf(current))
         return false;
+    return current->operation == '/' || current->operation == '%'
+        || may_fault(nodes, current->left) || may_fault(nodes, current->right);
+}
+
+
+/*
+ * Simplifies operation node, returns node to use instead of it. Operations on constants
+ * are folded, x + 0, x - 0, x * 1, x / 1 and x ^ 1 become x, x * 0, x % 1 and x ^ 0
+ * become constants unless x may fault. Constants of chains of + or * are combined, these
+ * operations wrap the same way in any order.
+ */
+static size_t simplify_node(struct ExpressionNode nodes[], const size_t node) {
+    struct ExpressionNode *current = &nodes[node];
+    const struct ExpressionNode *left = &nodes[current->left];
+    const struct ExpressionNode *right = &nodes[current->right];
+    const char operation = current->operation;
+    word_t result;
+
+    if (left->constant && right->constant) {
+        if (fold_operation(operation, left->value, right->value, &result))
+            *current = (struct ExpressionNode) {.operation='\0', .constant=true, .value=result};
+        return node;
     }
 
-    /* Generating code */
-    size_t current_stack_pointer = program->stack_ptr;    
-    word_t address;
+    if ((operation == '+' && is_constant(left, 0)) || (operation == '*' && is_constant(left, 1)))
+        return current->right;
+    if (
+        ((operation == '+' || operation == '-') && is_constant(right, 0))
+        || ((operation == '*' || operation == '/' || operation == '^') && is_constant(right, 1))
+    )
+        return current->left;
+    if (operation == '*' && (is_constant(left, 0) || is_constant(right, 0))) {
+        const bool left_zero = is_constant(left, 0);
+        if (may_fault(nodes, left_zero ? current->right : current->left))
+            return node;
+        return left_zero ? current->left : current->right;
+    }
+    if (
+        ((operation == '%' && is_constant(right, 1)) || (operation == '^' && is_constant(right, 0)))
+        && !may_fault(nodes, current->left)
+    ) {
+        *current = (struct ExpressionNode) {
+            .operation='\0', .constant=true, .value=operation == '%' ? 0 : 1
+        };
+        return node;
+    }
+
+    /* (x op c1) op c2 becomes x op (c1 op c2) */
+    if (is_commutative(operation) && (left->constant || right->constant)) {
+        const word_t value = left->constant ? left->value : right->value;
+        const size_t inner = left->constant ? current->right : current->left;
+        const struct ExpressionNode *chain = &nodes[inner];
+        if (chain->operation == operation) {
+            struct ExpressionNode *chain_constant = nodes[chain->left].constant
+                ? &nodes[chain->left] : &nodes[chain->right];
+            if (chain_constant->constant) {
+                fold_operation(operation, chain_constant->value, value, &chain_constant->value);
+                return simplify_node(nodes, inner);
+            }
+        }
+    }
+    return node;
+}
+
+
+/* Builds simplified expression tree from postfix tokens. Variables get their addresses,
+ * constants get memory only when code using them is generated */
+static bool build_tree(
+    struct Program *program,
+    struct ExpressionToken tokens[],
+    const size_t num_tokens,
+    struct ExpressionNode nodes[],
+    size_t *root
+) {
+    size_t stack[MAX_TOKENS], stack_size = 0;
     union Identifier identifier;
+
     for (size_t token_ptr = 0; token_ptr < num_tokens; token_ptr++) {
-        if (expression_tokens[token_ptr].token_type == IDENTIFIER) {
-            /* Load to stack */
-            if (check_integer(expression_tokens[token_ptr].token)) {
-                identifier.value = atoi(expression_tokens[token_ptr].token);
-                address = search_entry(program, identifier, CONST);
-            } else if (check_identifier(expression_tokens[token_ptr].token)) {
-                strcpy(identifier.name, expression_tokens[token_ptr].token);
-                address = search_entry(program, identifier, VAR);
+        char *token = tokens[token_ptr].token;
+        struct ExpressionNode *current = &nodes[token_ptr];
+        *current = (struct ExpressionNode) {.operation='\0', .constant=false};
+        if (tokens[token_ptr].token_type == IDENTIFIER) {
+            if (check_integer(token)) {
+                current->constant = true;
+                current->value = (word_t) atoi(token);
+            } else if (check_identifier(token)) {
+                strcpy(identifier.name, token);
+                current->address = search_or_add_entry(program, identifier, VAR);
+                if (current->address == OBJ_NOT_FOUND) {
+                    printf("Identifier '%s' was not found\n", token);
+                    return false;
+                }
             } else {
-                printf("%s is not a valid identifier\n", expression_tokens[token_ptr].token);
+                printf("%s is not a valid identifier\n", token);
                 return false;
             }
-            if (address == OBJ_NOT_FOUND) {
-                printf("Identifier '%s' was not found\n", expression_tokens[token_ptr].token);
+            stack[stack_size++] = token_ptr;
+        } else if (tokens[token_ptr].token_type == OPERATION) {
+            if (operation_code(token[0]) == 0) {
+                printf("Unknown operation '%c'\n", token[0]);
+                return false;
             }
-            /* From memory */
-            instruction = LOAD << OPERAND_BITS | address;
-            program->memory[program->instruction_ptr++] = instruction;
-            /* To stack */
-            address = program->stack_ptr++;
-            remember_stack_offset(program, program->instruction_ptr, address);
-            instruction = STORE << OPERAND_BITS;
-            program->memory[program->instruction_ptr++] = instruction;
-        } else if (expression_tokens[token_ptr].token_type == OPERATION) {
-            /* From stack to accumulator */
-            address = --(program->stack_ptr);
-            remember_stack_offset(program, program->instruction_ptr, address);
-            instruction = LOAD << OPERAND_BITS;
-            program->memory[program->instruction_ptr++] = instruction;
-            switch (expression_tokens[token_ptr].token[0]) {
-                case '+':
-                    instruction = ADD;
-                    break;
-                case '-':
-                    instruction = SUBTRACT;
-                    break;
-                case '*':
-                    instruction = MULTIPLY;
-                    break;
-                case '/':
-                    instruction = DIVIDE;
-                    break;
-                case '%':
-                    instruction = REMAINDER;
-                    break;
-                case '^':
-                    instruction = POWER;
-                    break;
-                default:
-                    printf("Unknown operation '%c'\n", expression_tokens[token_ptr].token[0]);
-                    return false;
+            if (stack_size < 2) {
+                printf("Missing operand of '%c'\n", token[0]);
+                return false;
             }
-            /* Second operand */
-            address = --(program->stack_ptr);
-            remember_stack_offset(program, program->instruction_ptr, address);
-            instruction = instruction << OPERAND_BITS;
-
-            /* Place result from accumulator to stack */
-            program->memory[program->instruction_ptr++] = instruction;
-            address = program->stack_ptr++;
-            remember_stack_offset(program, program->instruction_ptr, address);
-            instruction = STORE << OPERAND_BITS;
-            program->memory[program->instruction_ptr++] = instruction;
+            current->operation = token[0];
+            current->right = stack[--stack_size];
+            current->left = stack[--stack_size];
+            const size_t simplified = simplify_node(nodes, token_ptr);
+            count_temporaries(nodes, simplified);
+            stack[stack_size++] = simplified;
         } else {
-            printf("Wrong token '%s'\n", expression_tokens[token_ptr].token);
+            printf("Wrong token '%s'\n", token);
             return false;
         }
     }
-
-    /* Placing result into accumulator */
-    address = --(program->stack_ptr);
-    remember_stack_offset(program, program->instruction_ptr, address);
-    instruction = LOAD << OPERAND_BITS;
-    program->memory[program->instruction_ptr++] = instruction;
-    if (program->stack_ptr != current_stack_pointer) {
+    if (stack_size != 1) {
         puts("Stack is in dirty state");
         return false;
     }
+    *root = stack[0];
+    return true;
+}
+
+
+/* Stores accumulator to new temporary on stack, returns its offset */
+static size_t spill(struct Program *program) {
+    const size_t offset = program->stack_ptr++;
+    remember_stack_offset(program, program->instruction_ptr, offset);
+    emit(program, STORE << OPERAND_BITS);
+    return offset;
+}
+
+
+/* Returns address of leaf, memory for constant is taken on its first use */
+static word_t leaf_address(struct Program *program, const struct ExpressionNode *leaf) {
+    if (!leaf->constant)
+        return leaf->address;
+    const union Identifier identifier = {.value=leaf->value};
+    return search_or_add_entry(program, identifier, CONST);
+}
+
+
+/* Generates code placing value of node into accumulator. Operands which are variables
+ * or constants are used from memory, only results of subexpressions go to stack */
+static void generate_node(
+    struct Program *program, const struct ExpressionNode nodes[], const size_t node
+) {
+    const struct ExpressionNode *current = &nodes[node];
+    if (is_leaf(current)) {
+        emit(program, LOAD << OPERAND_BITS | leaf_address(program, current));
+        return;
+    }
+    const struct ExpressionNode *left = &nodes[current->left];
+    const struct ExpressionNode *right = &nodes[current->right];
+    const word_t opcode = operation_code(current->operation);
+    if (is_leaf(left)) {
+        generate_node(program, nodes, current->right);
+        emit(program, opcode << OPERAND_BITS | leaf_address(program, left));
+        return;
+    }
+    if (is_commutative(current->operation) && is_leaf(right)) {
+        generate_node(program, nodes, current->left);
+        emit(program, opcode << OPERAND_BITS | leaf_address(program, right));
+        return;
+    }
+
+    /* Left operand is computed first and kept on stack, commutative operations start
+     * with the operand needing more temporaries */
+    size_t first = current->left, second = current->right;
+    if (is_commutative(current->operation) && right->temporaries > left->temporaries) {
+        first = current->right;
+        second = current->left;
+    }
+    generate_node(program, nodes, first);
+    const size_t offset = spill(program);
+    generate_node(program, nodes, second);
+    remember_stack_offset(program, program->instruction_ptr, offset);
+    emit(program, opcode << OPERAND_BITS);
+    program->stack_ptr--;
+}
+
+
+/* Parses expression to simplified tree in nodes, which has room for MAX_TOKENS of them */
+bool parse_expression(
+    char buffer[], struct Program *program, struct ExpressionNode nodes[], size_t *root
+) {
+    size_t num_tokens;
+    struct ExpressionToken expression_tokens[MAX_TOKENS];
+    if (!tokenize_expression(buffer, expression_tokens, &num_tokens)) {
+        printf("Invalid expression '%s'\n", buffer);
+        return false;
+    }
+    return build_tree(program, expression_tokens, num_tokens, nodes, root);
+}
+
+
+/* Generates code placing value of expression tree into accumulator */
+void generate_expression(
+    struct Program *program, const struct ExpressionNode nodes[], const size_t root
+) {
+    generate_node(program, nodes, root);
+}
+
+
+/* Evaluates expression and places result into accumulator */
+bool evaluate_expression(char buffer[], struct Program *program) {
+    struct ExpressionNode nodes[MAX_TOKENS];
+    size_t root;
+    if (!parse_expression(buffer, program, nodes, &root))
+        return false;
+    generate_expression(program, nodes, root);
     return true;
 }
 
@@ -759,3 +1178,97 @@ bool check_expression (const char buffer[]) {
     }
     return true;
 }
+
+
+/* Explains capacity error of program */
+static void report_error(const struct Program *program, const int line_number) {
+    switch (program->error) {
+        case TRANSLATE_OVERFLOW:
+            printf(
+                "Program does not fit in memory of %d words, %lu words of code, %lu of data, "
+                "%lu of stack\n", MEMORY_SIZE, (unsigned long) program->instruction_ptr,
+                (unsigned long) data_size(program), (unsigned long) program->stack_size
+            );
+            break;
+        case TRANSLATE_ALLOCATION:
+            printf("Error allocating memory on line %d\n", line_number);
+            break;
+        case TRANSLATE_OK:
+            break;
+    }
+}
+
+
+/* Translates program from file: parses every line, then fills references to labels
+ * and stack offsets, optimizes code and packs data. Returns false on the first error */
+bool translate(struct Program *program, FILE *program_file) {
+    char buffer[BUFFER_SIZE];
+    int line_number = 0;
+    union Identifier identifier;
+    word_t address;
+
+    while (!feof(program_file)) {
+        if (fgets(buffer, BUFFER_SIZE, program_file) != NULL) {
+            line_number++;
+
+            /* Remove trailing newline symbols before tokenization */
+            buffer[strcspn(buffer, "\r\n")] = '\0';
+            strip(buffer, buffer);
+
+            /* Skip empty string */
+            if (strlen(buffer) == 0) continue;
+            if (!parse_line(program, buffer, line_number) || program->error != TRANSLATE_OK) {
+                report_error(program, line_number);
+                printf("Error at line %d\n", line_number);
+                printf("%s\n", buffer);
+                return false;
+            }
+        }
+    }
+
+    /* Fill missing pointers */
+    for (
+        size_t missing_ref_list_ptr = 0;
+        missing_ref_list_ptr < program->missing_ref_list_size;
+        missing_ref_list_ptr++
+    ) {
+        identifier.value = program->missing_ref_list[missing_ref_list_ptr].label;
+        address = search_entry(program, identifier, LINE);
+        if (address == OBJ_NOT_FOUND) {
+            printf(
+                "Unresolved label %d\n", program->missing_ref_list[missing_ref_list_ptr].label
+            );
+            return false;
+        }
+        program->code[program->missing_ref_list[missing_ref_list_ptr].address] |= address;
+    }
+
+    /* Stack goes below data until layout, words must not wrap around */
+    if (data_size(program) + program->stack_size > MEMORY_SIZE) {
+        program->error = TRANSLATE_OVERFLOW;
+        report_error(program, line_number);
+        return false;
+    }
+
+    /* Fill stack offsets */
+    for (
+        size_t stack_offsets_ptr = 0;
+        stack_offsets_ptr < program->stack_offset_list_size;
+        stack_offsets_ptr++
+    ) {
+        program->code[program->stack_offset_list[stack_offsets_ptr].address] |= (
+            program->constants_ptr - program->stack_offset_list[stack_offsets_ptr].offset
+        );
+    }
+    optimize(program);
+    program->packed_words = pack_data(program);
+
+    /* Stack takes words between code and data */
+    const size_t words = program->instruction_ptr + data_size(program) + program->stack_size;
+    if (words > MEMORY_SIZE) {
+        program->error = TRANSLATE_OVERFLOW;
+        report_error(program, line_number);
+        return false;
+    }
+    return true;
+}
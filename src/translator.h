@@ -33,25 +33,60 @@ struct ForEntry {
 };
 
 
+/* Node of expression tree: leaf is constant value or variable at address, other nodes
+ * are operations on nodes left and right */
+struct ExpressionNode {
+    char                        operation;      /* '\0' for leaf */
+    bool                        constant;
+    word_t                      value;          /* of constant */
+    word_t                      address;        /* of variable */
+    size_t                      left;
+    size_t                      right;
+    size_t                      temporaries;    /* stack words needed to evaluate node */
+};
+
+
 struct StackOffsetEntry {
     word_t                      address;
     word_t                      offset;
 };
 
 
+/* Capacity errors of translation, the first one stops it */
+enum TranslateError {TRANSLATE_OK, TRANSLATE_OVERFLOW, TRANSLATE_ALLOCATION};
+
+/*
+ * Translator state. Buffers are allocated on demand and grow with the program, code is
+ * placed from address 0 up, constants and variables from MEMORY_SIZE - 1 down (data[0] is
+ * at MEMORY_SIZE - 1) and stack of expressions between them.
+ */
 struct Program {
-    struct LookupListEntry      lookup_list[MEMORY_SIZE];
-    struct MissingRefListEntry  missing_ref_list[MEMORY_SIZE];
-    struct ForEntry             for_stack[MEMORY_SIZE];
-    struct StackOffsetEntry     stack_offset_list[MEMORY_SIZE];
-    word_t                      memory[MEMORY_SIZE];
+    struct LookupListEntry      *lookup_list;
+    size_t                      *lookup_table;  /* lookup list index + 1, 0 free */
+    struct MissingRefListEntry  *missing_ref_list;
+    struct ForEntry             *for_stack;
+    struct StackOffsetEntry     *stack_offset_list;
+    word_t                      *code;
+    word_t                      *data;
     word_t                      instruction_ptr;
     word_t                      constants_ptr;
     size_t                      stack_ptr;
+    size_t                      stack_size;     /* deepest stack of expressions */
     size_t                      lookup_list_size;
+    size_t                      lookup_list_capacity;
+    size_t                      lookup_slots;   /* power of two, at most half are used */
     size_t                      missing_ref_list_size;
+    size_t                      missing_ref_list_capacity;
     size_t                      for_ptr;
+    size_t                      for_stack_capacity;
     size_t                      stack_offset_list_size;
+    size_t                      stack_offset_list_capacity;
+    size_t                      code_capacity;
+    size_t                      data_capacity;
+    size_t                      saved_words;    /* by peephole optimizer */
+    size_t                      dead_words;     /* unreachable and dead code removed */
+    size_t                      packed_words;   /* unused data and temporaries dropped */
+    enum TranslateError         error;
 };
 
 
@@ -62,6 +97,11 @@ void remember_missing_reference(struct Program *, const int);
 bool check_identifier(char []);
 bool check_integer(char []);
 void init_program(struct Program *);
+void free_program(struct Program *);
+bool emit(struct Program *, const word_t);
+size_t data_size(const struct Program *);
+word_t program_word(const struct Program *, const size_t);
+bool write_program_image(FILE *, const struct Program *);
 void strip(char [], const char []);
 bool parse_line(struct Program *, char [], const int);
 bool parse_input(struct Program *, char [], const int);
@@ -71,8 +111,11 @@ bool parse_let(struct Program *, char [], const int);
 bool parse_if(struct Program *, char [], const int);
 bool parse_for(struct Program *, char [], const int);
 bool parse_for_end(struct Program *, char [], const int);
+bool translate(struct Program *, FILE *);
 
 bool check_expression(const char []);
+bool parse_expression(char [], struct Program *, struct ExpressionNode [], size_t *);
+void generate_expression(struct Program *, const struct ExpressionNode [], const size_t);
 bool evaluate_expression(char [], struct Program *);
 
 enum Comparison {GE, GT, LE, LT, EQ, NE};
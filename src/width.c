@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simpletron.h"
+
+
+/*
+ * Entry point of programs built for several word widths. Every width is compiled
+ * separately with its own WORD_BITS and main renamed to main_<bits>, so kernels have
+ * no width checks. Width is taken from option, with DETECT_WIDTH from the first image
+ * in arguments, otherwise the default WORD_BITS is used.
+ */
+
+#define WORD_BITS_OPTION    "--word-bits="
+
+int main_16(int, char *[]);
+int main_32(int, char *[]);
+
+struct Width {
+    unsigned    bits;
+    int         (*main)(int, char *[]);
+};
+
+static const struct Width widths[] = {
+    {.bits=16, .main=main_16},
+    {.bits=32, .main=main_32},
+    {.bits=0, .main=NULL}
+};
+
+
+#ifdef DETECT_WIDTH
+/* Returns word width of image in file, 0 if file is not an image */
+static unsigned image_bits(const char filename[]) {
+    unsigned char header[2 * sizeof(uint32_t) + 2 * sizeof(uint32_t)];
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL)
+        return 0;
+    const size_t size = fread(header, 1, sizeof(header), file);
+    fclose(file);
+
+    /* HEADER HEADER of width, then IMAGE_VERSION and WORD_BITS */
+    for (const struct Width *width = widths; width->main != NULL; width++) {
+        const size_t header_size = 2 * width->bits / 8;
+        uint32_t fields[2];
+        size_t ones = 0;
+        if (size < header_size + sizeof(fields))
+            continue;
+        for (; ones < header_size && header[ones] == 0xFF; ones++);
+        memcpy(fields, header + header_size, sizeof(fields));
+        if (ones == header_size && fields[0] == IMAGE_VERSION && fields[1] == width->bits)
+            return width->bits;
+    }
+    return 0;
+}
+#endif
+
+
+int main(int argc, char *argv[]) {
+    unsigned bits = 0;
+
+    for (int arg = 1; arg < argc; arg++) {
+        if (strncmp(argv[arg], WORD_BITS_OPTION, strlen(WORD_BITS_OPTION)) != 0)
+            continue;
+        bits = (unsigned) strtoul(argv[arg] + strlen(WORD_BITS_OPTION), NULL, 10);
+        memmove(&argv[arg], &argv[arg + 1], (argc - arg) * sizeof(char *));
+        argc--;
+        break;
+    }
+#ifdef DETECT_WIDTH
+    for (int arg = 1; bits == 0 && arg < argc; arg++)
+        bits = image_bits(argv[arg]);
+#endif
+    if (bits == 0)
+        bits = WORD_BITS;
+
+    for (const struct Width *width = widths; width->main != NULL; width++) {
+        if (width->bits == bits)
+            return width->main(argc, argv);
+    }
+    printf("Unsupported word width %u, supported:", bits);
+    for (const struct Width *width = widths; width->main != NULL; width++)
+        printf(" %u", width->bits);
+    puts("");
+    return 1;
+}